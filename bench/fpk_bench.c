@@ -0,0 +1,1925 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Throughput benchmarks for lib-fpack. The library source is included
+ * directly so that the individual CRC32, HMAC-SHA256 and AES128-CBC kernels
+ * can be timed on every backend the CPU supports, alongside whole-package
+ * unpacking through memory and file backed hooks and batch verification of
+ * many signed packages. Results are written to stdout as one JSON object
+ * per line.
+ *
+ * Usage: fpk_bench [-t <seconds per run>] [-n <image bytes>] [-j <threads>]
+ *                  [-P] [-C]
+ *
+ * -C gives the unpacks a verification cache, so that two-pass runs after
+ * the first skip the verification pass.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// the library itself comes in with the package generator
+#include "fpk_package.c"
+
+#ifdef FPK_ENABLE_THREADS
+#include "fpack_cache.h"
+#include "fpack_pool.h"
+#endif /* FPK_ENABLE_THREADS */
+
+
+#define MAX_KERNEL_SIZE         (1 << 20)
+#define CACHE_CLIENTS           4
+#define POOL_CLIENTS            4
+#define POOL_CONTEXTS           4096
+#define POOL_IMAGE_SIZE         4096
+#define BATCH_PACKAGES          64
+#define RESTART_THREADS         4
+#define RESTART_IMAGE_SIZE      4096
+#define RESTART_MIN_RUNS        1000
+
+
+typedef struct
+{
+    const char* name;
+    uint32_t features;
+} backend_t;
+
+
+typedef struct
+{
+    unsigned long read_file;
+    unsigned long seek_file;
+    unsigned long prepare_memory;
+    unsigned long program_memory;
+    unsigned long finalize_memory;
+    unsigned long handle_metadata;
+} call_counts_t;
+
+
+typedef struct
+{
+    double seconds;
+    uint64_t cycles;
+} sample_t;
+
+
+static const uint8_t AUTH_KEY[32] = {
+    0xea, 0x70, 0x39, 0xd4, 0x00, 0x0a, 0x98, 0x7a,
+    0x9d, 0x48, 0x63, 0xa9, 0x1c, 0x08, 0x9c, 0xfe,
+    0x64, 0x93, 0xee, 0xc5, 0xba, 0x08, 0x9b, 0x59,
+    0xb8, 0x45, 0x51, 0x97, 0x48, 0x7b, 0xda, 0x3b,
+};
+
+static const uint8_t CIPHER_KEY[16] = {
+    0x99, 0xd2, 0x37, 0x6f, 0x13, 0x3d, 0x9f, 0x7c,
+    0x5c, 0x89, 0x83, 0x89, 0x02, 0x84, 0xe0, 0x95
+};
+
+static const size_t KERNEL_SIZES[] = {64, 1024, 16384, MAX_KERNEL_SIZE};
+
+#define N_KERNEL_SIZES  (sizeof(KERNEL_SIZES) / sizeof(KERNEL_SIZES[0]))
+
+
+static double m_min_seconds = 0.25;
+static size_t m_image_size = 1 << 20;
+static unsigned m_threads = 1;
+static uint32_t m_options = 0;
+static int m_cache;
+
+static fpk_context_t m_ctx;
+static call_counts_t m_calls;
+static FILE* m_file;
+static uint32_t m_output_crc;
+static int m_verify;
+
+
+/* ==== TIMING ============================================================= */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static uint64_t cycles(void)
+{
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    return __rdtsc();
+#else /* FPK_ENABLE_X86_ACCELERATION */
+    return 0;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+}
+
+
+static void sample_begin(sample_t* sample)
+{
+    sample->cycles = cycles();
+    sample->seconds = now();
+}
+
+
+static void sample_end(sample_t* sample)
+{
+    sample->seconds = now() - sample->seconds;
+    sample->cycles = cycles() - sample->cycles;
+}
+
+
+static void print_rate(const sample_t* sample, double bytes)
+{
+    printf("\"mb_per_s\":%.2f,", bytes / sample->seconds / 1e6);
+
+    if ( sample->cycles ) 
+        printf("\"cycles_per_byte\":%.3f", sample->cycles / bytes);
+    else
+        printf("\"cycles_per_byte\":null");
+}
+
+
+/* ==== BACKENDS =========================================================== */
+
+// Backends are selected by overriding the library's cached CPU feature
+// mask; a backend is skipped when the CPU lacks any feature it needs.
+// CPU_FEATURES_UNKNOWN selects whatever the CPU supports.
+
+static int select_backend(const backend_t* backend)
+{
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    uint32_t features;
+
+    m_cpu_features = CPU_FEATURES_UNKNOWN;
+    features = cpu_features();
+
+    if ( backend->features == CPU_FEATURES_UNKNOWN ) return 1;
+    if ( (features & backend->features) != backend->features ) return 0;
+
+    m_cpu_features = backend->features;
+    return 1;
+#else /* FPK_ENABLE_X86_ACCELERATION */
+    return backend->features == 0;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+}
+
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+static const backend_t CRC32_BACKENDS[] = {
+    {"portable", 0},
+    {"pclmul", CPU_FEATURE_PCLMUL},
+    {NULL, 0}
+};
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+static const backend_t SHA256_BACKENDS[] = {
+    {"portable", 0},
+    {"ssse3", CPU_FEATURE_SSSE3},
+    {"shani", CPU_FEATURE_SSSE3 | CPU_FEATURE_SHANI},
+    {NULL, 0}
+};
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+static const backend_t AES128_BACKENDS[] = {
+    {"portable", 0},
+    {"aesni", CPU_FEATURE_AESNI},
+    {NULL, 0}
+};
+#endif /* FPK_ENABLE_AES128_CBC */
+
+static const backend_t UNPACK_BACKENDS[] = {
+    {"portable", 0},
+    {"native", CPU_FEATURES_UNKNOWN},
+    {NULL, 0}
+};
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+static const backend_t BATCH_BACKENDS[] = {
+    {"portable", 0},
+    {"shani", CPU_FEATURE_PCLMUL | CPU_FEATURE_SSSE3 | CPU_FEATURE_SHANI},
+    {"sse2", CPU_FEATURE_PCLMUL | CPU_FEATURE_SSE2},
+    {"avx2", CPU_FEATURE_PCLMUL | CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2},
+    {"avx512", CPU_FEATURE_PCLMUL | CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2 |
+            CPU_FEATURE_AVX512},
+    {"native", CPU_FEATURES_UNKNOWN},
+    {NULL, 0}
+};
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#else /* FPK_ENABLE_X86_ACCELERATION */
+
+static const backend_t PORTABLE_BACKENDS[] = {
+    {"portable", 0},
+    {NULL, 0}
+};
+
+#define CRC32_BACKENDS          PORTABLE_BACKENDS
+#define SHA256_BACKENDS         PORTABLE_BACKENDS
+#define AES128_BACKENDS         PORTABLE_BACKENDS
+#define UNPACK_BACKENDS         PORTABLE_BACKENDS
+#define BATCH_BACKENDS          PORTABLE_BACKENDS
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+/* ==== KERNELS ============================================================ */
+
+typedef void (*kernel_fn_t)(uint8_t* data, size_t length);
+
+
+static void crc32_kernel(uint8_t* data, size_t length)
+{
+    crc32_update(&m_ctx, data, length);
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static void hmac_sha256_kernel(uint8_t* data, size_t length)
+{
+    uint8_t hash[32];
+
+    hmac_reset(&m_ctx, AUTH_KEY);
+    hmac_update(&m_ctx, data, length);
+    hmac_digest(&m_ctx, hash);
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+static void aes128_cbc_kernel(uint8_t* data, size_t length)
+{
+    m_ctx.flags = 0;
+    aes128_init(&m_ctx, CIPHER_KEY, data);
+    aes128_decrypt_cbc(&m_ctx, data, data, length / AES128_KEY_LEN);
+}
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+static void bench_kernel(const char* name, kernel_fn_t kernel,
+        const backend_t* backends, uint8_t* buffer)
+{
+    for (; backends->name; backends++)
+    {
+        if ( !select_backend(backends) ) continue;
+
+        for (size_t i = 0; i < N_KERNEL_SIZES; i++)
+        {
+            size_t size = KERNEL_SIZES[i];
+            unsigned long n_calls = 0;
+            sample_t sample;
+
+            sample_begin(&sample);
+
+            do
+            {
+                kernel(buffer, size);
+                n_calls++;
+            } while (now() - sample.seconds < m_min_seconds);
+
+            sample_end(&sample);
+
+            printf("{\"bench\":\"kernel\",\"kernel\":\"%s\","
+                    "\"backend\":\"%s\",\"size\":%zu,\"calls\":%lu,",
+                    name, backends->name, size, n_calls);
+            print_rate(&sample, (double) size * n_calls);
+            printf("}\n");
+        }
+    }
+}
+
+
+/* ==== PACKAGE GENERATION ================================================= */
+
+static uint8_t* build_package(fpk_authentication_type_t auth_type,
+        fpk_cipher_type_t cipher_type, size_t* length, uint32_t* image_crc)
+{
+    return fpk_build_package(auth_type, cipher_type, AUTH_KEY, CIPHER_KEY,
+            m_image_size, length, image_crc);
+}
+
+
+/* ==== UNPACK HOOKS ======================================================= */
+
+static fpk_result_t read_file_bulk_cb(uint8_t* buffer, size_t n_bytes,
+        void* user_data)
+{
+    m_calls.read_file++;
+
+    if ( fread(buffer, n_bytes, 1, m_file) == 1 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_READ_ERROR;
+}
+
+
+static uint8_t* read_buffer_cb(size_t* size, void* user_data)
+{
+    static uint8_t buffer[65536];
+
+    *size = sizeof(buffer);
+    return buffer;
+}
+
+
+static fpk_result_t seek_file_cb(uint32_t position, void* user_data)
+{
+    m_calls.seek_file++;
+
+    if ( fseek(m_file, position, SEEK_SET) == 0 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_READ_ERROR;
+}
+
+
+static fpk_result_t prepare_memory_cb(const char* id, uint32_t size,
+        void* user_data)
+{
+    m_calls.prepare_memory++;
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t program_memory_cb(const char* id, const uint8_t* data,
+        uint8_t length, void* user_data)
+{
+    m_calls.program_memory++;
+
+    if ( m_verify ) m_output_crc = fpk_crc32(m_output_crc, data, length);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t finalize_memory_cb(const char* id, void* user_data)
+{
+    m_calls.finalize_memory++;
+    return FPK_RESULT_OK;
+}
+
+
+static const uint8_t* authentication_key_cb(fpk_authentication_type_t type,
+        void* user_data)
+{
+    return AUTH_KEY;
+}
+
+
+static const uint8_t* cipher_key_cb(fpk_cipher_type_t type, void* user_data)
+{
+    return CIPHER_KEY;
+}
+
+
+static fpk_result_t handle_metadata_cb(const char* key, const char* value,
+        void* user_data)
+{
+    m_calls.handle_metadata++;
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t commit_memory_cb(void* user_data)
+{
+    return FPK_RESULT_OK;
+}
+
+
+#ifdef FPK_ENABLE_THREADS
+
+static unsigned verify_threads_cb(void* user_data)
+{
+    return m_threads;
+}
+
+#endif /* FPK_ENABLE_THREADS */
+
+
+// A verification cache holding just the one key, which is all a bench
+// that keeps unpacking the same package needs.
+
+static uint8_t m_verified_key[FPK_VERIFY_KEY_SIZE];
+static int m_have_verified_key;
+
+
+static const uint8_t* package_identity_cb(size_t* size, void* user_data)
+{
+    static const uint8_t IDENTITY[] = "fpk_bench";
+
+    if ( !m_cache ) return NULL;
+
+    *size = sizeof(IDENTITY);
+    return IDENTITY;
+}
+
+
+static int lookup_verified_cb(const uint8_t* key, void* user_data)
+{
+    return m_have_verified_key &&
+            memcmp(m_verified_key, key, FPK_VERIFY_KEY_SIZE) == 0;
+}
+
+
+static void store_verified_cb(const uint8_t* key, void* user_data)
+{
+    memcpy(m_verified_key, key, FPK_VERIFY_KEY_SIZE);
+    m_have_verified_key = 1;
+}
+
+
+static const fpk_hooks_t m_hooks =
+{
+    .read_file_bulk =       read_file_bulk_cb,
+    .read_buffer =          read_buffer_cb,
+    .seek_file =            seek_file_cb,
+    .prepare_memory =       prepare_memory_cb,
+    .program_memory =       program_memory_cb,
+    .finalize_memory =      finalize_memory_cb,
+    .authentication_key =   authentication_key_cb,
+    .cipher_key =           cipher_key_cb,
+    .handle_metadata =      handle_metadata_cb,
+    .commit_memory =        commit_memory_cb,
+#ifdef FPK_ENABLE_THREADS
+    .verify_threads =       verify_threads_cb,
+#endif /* FPK_ENABLE_THREADS */
+    .package_identity =     package_identity_cb,
+    .lookup_verified =      lookup_verified_cb,
+    .store_verified =       store_verified_cb,
+};
+
+
+/* ==== UNPACKING ========================================================== */
+
+static const char* const AUTH_NAMES[] = {"none", "hmac_sha256"};
+static const char* const CIPHER_NAMES[] = {"none", "aes128_cbc"};
+
+
+static fpk_result_t unpack_once(const uint8_t* package, size_t length,
+        int from_file, uint32_t options)
+{
+    memset(&m_calls, 0, sizeof(m_calls));
+
+    if ( !from_file )
+    {
+        return fpk_unpack_buffer(&m_ctx, package, length, options, &m_hooks,
+                NULL);
+    }
+
+    rewind(m_file);
+    return fpk_unpack(&m_ctx, options, &m_hooks, NULL);
+}
+
+
+static int bench_unpack(fpk_authentication_type_t auth_type,
+        fpk_cipher_type_t cipher_type)
+{
+    const backend_t* backend;
+    uint32_t image_crc;
+    size_t length;
+    uint8_t* package;
+    int status = 0;
+
+    package = build_package(auth_type, cipher_type, &length, &image_crc);
+
+    if ( !package )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        return 1;
+    }
+
+    m_file = tmpfile();
+
+    if ( !m_file || fwrite(package, length, 1, m_file) != 1 )
+    {
+        fprintf(stderr, "Fatal error: Unable to write temporary file\n");
+        free(package);
+        return 1;
+    }
+
+    for (backend = UNPACK_BACKENDS; backend->name && status == 0; backend++)
+    {
+        if ( !select_backend(backend) ) continue;
+
+        for (int from_file = 0; from_file < 2 && status == 0; from_file++)
+        {
+            for (uint32_t options = 0; options <= FPK_OPTION_SINGLE_PASS;
+                    options += FPK_OPTION_SINGLE_PASS)
+            {
+                fpk_result_t result;
+                unsigned long n_runs = 0;
+                sample_t sample;
+
+                m_verify = 1;
+                m_have_verified_key = 0;
+                m_output_crc = 0xFFFFFFFFUL;
+                result = unpack_once(package, length, from_file,
+                        options | m_options);
+                m_verify = 0;
+
+                if ( result == FPK_RESULT_OK && m_output_crc != image_crc )
+                    result = FPK_RESULT_PROGRAM_ERROR;
+
+                if ( result != FPK_RESULT_OK )
+                {
+                    fprintf(stderr, "Fatal error: %s/%s unpack failed: %d\n",
+                            AUTH_NAMES[auth_type], CIPHER_NAMES[cipher_type],
+                            (int) result);
+                    status = 1;
+                    break;
+                }
+
+                sample_begin(&sample);
+
+                do
+                {
+                    unpack_once(package, length, from_file,
+                            options | m_options);
+                    n_runs++;
+                } while (now() - sample.seconds < m_min_seconds);
+
+                sample_end(&sample);
+
+                printf("{\"bench\":\"unpack\",\"auth\":\"%s\","
+                        "\"cipher\":\"%s\",\"source\":\"%s\","
+                        "\"mode\":\"%s\",\"backend\":\"%s\","
+                        "\"threads\":%u,\"pipeline\":%s,\"cache\":%s,"
+                        "\"package_bytes\":%zu,\"runs\":%lu,",
+                        AUTH_NAMES[auth_type], CIPHER_NAMES[cipher_type],
+                        from_file ? "file" : "memory",
+                        options ? "single_pass" : "two_pass", backend->name,
+                        m_threads,
+                        (m_options & FPK_OPTION_PIPELINE) ? "true" : "false",
+                        m_cache ? "true" : "false", length, n_runs);
+                print_rate(&sample, (double) length * n_runs);
+                printf(",\"hook_calls\":{\"read_file\":%lu,"
+                        "\"seek_file\":%lu,\"prepare_memory\":%lu,"
+                        "\"program_memory\":%lu,\"finalize_memory\":%lu,"
+                        "\"handle_metadata\":%lu}}\n",
+                        m_calls.read_file, m_calls.seek_file,
+                        m_calls.prepare_memory, m_calls.program_memory,
+                        m_calls.finalize_memory, m_calls.handle_metadata);
+            }
+        }
+    }
+
+    fclose(m_file);
+    free(package);
+
+    return status;
+}
+
+
+/* ==== BATCH VERIFICATION ================================================= */
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+// Builds a signed package with a body of n_blocks blocks of filler, which
+// is all fpk_verify_batch() looks at.
+
+static uint8_t* build_signed_package(uint32_t n_blocks, size_t* length)
+{
+    size_t body_length = (size_t) n_blocks * 16;
+    uint8_t* package;
+    uint8_t* p;
+
+    *length = 16 + body_length + 32 + 16;
+
+    package = calloc(1, *length);
+    if ( !package ) return NULL;
+
+    package[0] = 'F';
+    package[1] = 'P';
+    package[2] = 'K';
+    put_u32(package + 4, 0x5A000000);
+    put_u32(package + 8, n_blocks);
+    package[12] = FPK_AUTHENTICATION_TYPE_HMAC_SHA256;
+
+    for (size_t j = 0; j < body_length; j++)
+    {
+        package[16 + j] = (uint8_t) (j * 131 + n_blocks);
+    }
+
+    p = package + 16 + body_length;
+
+    hmac_reset(&m_ctx, AUTH_KEY);
+    hmac_update(&m_ctx, package + 16, body_length);
+    hmac_digest(&m_ctx, p);
+    p += 32;
+
+    put_u32(p, fpk_crc32(0xFFFFFFFFUL, package, p - package));
+
+    return package;
+}
+
+
+// Verifies BATCH_PACKAGES signed packages of assorted sizes (up to
+// m_image_size bytes) on every backend, counting it a failure if any
+// package is rejected or one with a tampered signature gets through.
+
+static int bench_verify_batch(void)
+{
+    fpk_verify_item_t items[BATCH_PACKAGES];
+    fpk_key_t key;
+    size_t total = 0;
+    int status = 0;
+
+    fpk_key_init(&key, FPK_KEY_TYPE_HMAC_SHA256, AUTH_KEY);
+
+    for (int i = 0; i < BATCH_PACKAGES; i++)
+    {
+        // sizes spread between 1/16 and all of m_image_size
+        uint32_t n_blocks = (uint32_t) (m_image_size / 16 *
+                (1 + (i * 7) % 16) / 16 + i % 5);
+
+        items[i].data = build_signed_package(n_blocks, &items[i].length);
+        items[i].key = &key;
+
+        if ( !items[i].data )
+        {
+            fprintf(stderr, "Fatal error: Out of memory\n");
+            status = 1;
+        }
+
+        total += items[i].length;
+    }
+
+    for (const backend_t* backend = BATCH_BACKENDS;
+        backend->name && status == 0; backend++)
+    {
+        unsigned long n_calls = 0;
+        uint8_t* tampered = (uint8_t*) items[BATCH_PACKAGES / 2].data;
+        size_t signature = items[BATCH_PACKAGES / 2].length - 48;
+        sample_t sample;
+
+        if ( !select_backend(backend) ) continue;
+
+        tampered[signature] ^= 1;
+
+        if ( fpk_verify_batch(&m_ctx, items, BATCH_PACKAGES, 0) !=
+            FPK_RESULT_INVALID_SIGNATURE )
+        {
+            fprintf(stderr, "Fatal error: tampered package passed on %s\n",
+                    backend->name);
+            status = 1;
+        }
+
+        tampered[signature] ^= 1;
+
+        sample_begin(&sample);
+
+        do
+        {
+            fpk_result_t result;
+
+            result = fpk_verify_batch(&m_ctx, items, BATCH_PACKAGES, 0);
+
+            if ( result != FPK_RESULT_OK )
+            {
+                fprintf(stderr, "Fatal error: batch failed on %s: %s\n",
+                        backend->name, fpk_result_to_string(result));
+                status = 1;
+            }
+
+            n_calls++;
+        } while (status == 0 && now() - sample.seconds < m_min_seconds);
+
+        sample_end(&sample);
+
+        if ( status == 0 )
+        {
+            printf("{\"bench\":\"verify_batch\",\"backend\":\"%s\","
+                    "\"packages\":%d,\"bytes\":%zu,\"calls\":%lu,",
+                    backend->name, BATCH_PACKAGES, total, n_calls);
+            print_rate(&sample, (double) total * n_calls);
+            printf("}\n");
+        }
+    }
+
+    for (int i = 0; i < BATCH_PACKAGES; i++) free((void*) items[i].data);
+
+    return status;
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+/* ==== ZERO-COPY SINKS ==================================================== */
+
+// Each sink puts the images into a window in RAM, as a gateway staging them
+// for flashing would, differing only in how the data gets there: copied in
+// from program_memory chunks, program_page pages or program_view runs, or
+// deciphered straight into it by way of image_destination.
+
+#define SINK_PAGE_SIZE          4096
+#define SINK_PAGE_ALIGNMENT     64
+
+typedef struct
+{
+    uint8_t* window;
+    size_t capacity;
+    size_t length;
+    size_t fill;
+    fpk_segment_t segment;
+    uint32_t crc;
+    uint8_t* page;
+    unsigned long direct_pages;
+    unsigned long copied_pages;
+
+} sink_t;
+
+
+static const char* const SINK_NAMES[] =
+{
+    "program_memory", "program_page", "program_view", "image_destination"
+};
+
+#define N_SINKS         (sizeof(SINK_NAMES) / sizeof(SINK_NAMES[0]))
+
+
+static fpk_result_t sink_prepare_cb(const char* id, uint32_t size,
+        void* user_data)
+{
+    sink_t* sink = user_data;
+
+    if ( size > sink->capacity ) return FPK_RESULT_PROGRAM_ERROR;
+
+    sink->length = size;
+    sink->fill = 0;
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t sink_memory_cb(const char* id, const uint8_t* data,
+        uint8_t length, void* user_data)
+{
+    sink_t* sink = user_data;
+
+    memcpy(sink->window + sink->fill, data, length);
+    sink->fill += length;
+
+    return FPK_RESULT_OK;
+}
+
+
+static uint8_t* sink_buffer_cb(size_t* page_size, void* user_data)
+{
+    sink_t* sink = user_data;
+
+    *page_size = SINK_PAGE_SIZE;
+    return sink->page;
+}
+
+
+static fpk_result_t sink_page_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, void* user_data)
+{
+    sink_t* sink = user_data;
+
+    if ( data == sink->page ) sink->copied_pages++;
+    else sink->direct_pages++;
+
+    memcpy(sink->window + offset, data, length);
+
+    return FPK_RESULT_OK;
+}
+
+
+static const fpk_segment_t* sink_destination_cb(const char* id,
+        uint32_t size, unsigned* n_segments, void* user_data)
+{
+    sink_t* sink = user_data;
+
+    sink->segment.data = sink->window;
+    sink->segment.length = size;
+    *n_segments = 1;
+
+    return &sink->segment;
+}
+
+
+static fpk_result_t sink_finalize_cb(const char* id, void* user_data)
+{
+    sink_t* sink = user_data;
+
+    if ( m_verify )
+        sink->crc = fpk_crc32(sink->crc, sink->window, sink->length);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t sink_unpack(sink_t* sink, int kind,
+        const uint8_t* package, size_t length, int from_file)
+{
+    fpk_hooks_t hooks =
+    {
+        .read_file_bulk =       read_file_bulk_cb,
+        .read_buffer =          read_buffer_cb,
+        .seek_file =            seek_file_cb,
+        .prepare_memory =       sink_prepare_cb,
+        .finalize_memory =      sink_finalize_cb,
+        .authentication_key =   authentication_key_cb,
+        .cipher_key =           cipher_key_cb,
+        .commit_memory =        commit_memory_cb,
+#ifdef FPK_ENABLE_THREADS
+        .verify_threads =       verify_threads_cb,
+#endif /* FPK_ENABLE_THREADS */
+    };
+    uint32_t options = FPK_OPTION_SINGLE_PASS | m_options;
+
+    switch (kind)
+    {
+    case 0:
+        hooks.program_memory = sink_memory_cb;
+        break;
+
+    case 1:
+        hooks.program_buffer = sink_buffer_cb;
+        hooks.program_page = sink_page_cb;
+        break;
+
+    case 2:
+        hooks.program_view = sink_page_cb;
+        break;
+
+    default:
+        hooks.image_destination = sink_destination_cb;
+        break;
+    }
+
+    if ( !from_file )
+    {
+        return fpk_unpack_buffer(&m_ctx, package, length, options, &hooks,
+                sink);
+    }
+
+    rewind(m_file);
+    return fpk_unpack(&m_ctx, options, &hooks, sink);
+}
+
+
+// Checks that program_page is handed whole pages straight from the input
+// when the page buffer is aligned to SINK_PAGE_ALIGNMENT, by unpacking a
+// copy of the package at each offset within that alignment: at some of
+// them the images' pages line up just as well as the buffer.
+
+static int check_direct_pages(sink_t* sink, const uint8_t* package,
+        size_t length)
+{
+    uint8_t* memory = malloc(length + 2 * SINK_PAGE_ALIGNMENT);
+    uint8_t* base;
+    int status = 0;
+
+    if ( !memory )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        return 1;
+    }
+
+    base = memory + (-(uintptr_t) memory & (SINK_PAGE_ALIGNMENT - 1));
+    sink->direct_pages = 0;
+    sink->copied_pages = 0;
+
+    for (size_t shift = 0; shift < SINK_PAGE_ALIGNMENT && status == 0;
+            shift++)
+    {
+        memcpy(base + shift, package, length);
+
+        if ( sink_unpack(sink, 1, base + shift, length, 0) != FPK_RESULT_OK )
+        {
+            fprintf(stderr, "Fatal error: program_page sink failed\n");
+            status = 1;
+        }
+    }
+
+    if ( status == 0 && sink->direct_pages == 0 )
+    {
+        fprintf(stderr, "Fatal error: no pages were programmed directly "
+                "from a %d byte aligned buffer\n", SINK_PAGE_ALIGNMENT);
+        status = 1;
+    }
+
+    if ( status == 0 )
+    {
+        printf("{\"bench\":\"zero_copy_alignment\","
+                "\"page_alignment\":%d,\"shifts\":%d,"
+                "\"direct_pages\":%lu,\"copied_pages\":%lu}\n",
+                SINK_PAGE_ALIGNMENT, SINK_PAGE_ALIGNMENT,
+                sink->direct_pages, sink->copied_pages);
+    }
+
+    free(memory);
+
+    return status;
+}
+
+
+static int bench_zero_copy(fpk_cipher_type_t cipher_type)
+{
+    const backend_t* backend;
+    uint32_t image_crc;
+    size_t length;
+    uint8_t* package;
+    uint8_t* page_memory;
+    sink_t sink;
+    int status = 0;
+
+    package = build_package(FPK_AUTHENTICATION_TYPE_NONE, cipher_type,
+            &length, &image_crc);
+
+    sink.capacity = m_image_size / 8 + 3;
+    if ( sink.capacity < m_image_size ) sink.capacity = m_image_size;
+    if ( sink.capacity < 100 ) sink.capacity = 100;
+
+    sink.window = malloc(sink.capacity);
+    page_memory = malloc(SINK_PAGE_SIZE + SINK_PAGE_ALIGNMENT);
+    m_file = tmpfile();
+
+    if ( !package || !sink.window || !page_memory )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        status = 1;
+    }
+    else if ( !m_file || fwrite(package, length, 1, m_file) != 1 )
+    {
+        fprintf(stderr, "Fatal error: Unable to write temporary file\n");
+        status = 1;
+    }
+    else
+    {
+        sink.page = page_memory + (-(uintptr_t) page_memory &
+                (SINK_PAGE_ALIGNMENT - 1));
+
+        // deciphered data lies wherever the read buffer happens to be
+        if ( cipher_type == FPK_CIPHER_TYPE_NONE )
+            status = check_direct_pages(&sink, package, length);
+    }
+
+    for (backend = UNPACK_BACKENDS; backend->name && status == 0; backend++)
+    {
+        if ( !select_backend(backend) ) continue;
+
+        for (int from_file = 0; from_file < 2 && status == 0; from_file++)
+        {
+            for (int kind = 0; kind < (int) N_SINKS && status == 0; kind++)
+            {
+                fpk_result_t result;
+                unsigned long n_runs = 0;
+                sample_t sample;
+
+                m_verify = 1;
+                sink.crc = 0xFFFFFFFFUL;
+                result = sink_unpack(&sink, kind, package, length,
+                        from_file);
+                m_verify = 0;
+
+                if ( result == FPK_RESULT_OK && sink.crc != image_crc )
+                    result = FPK_RESULT_PROGRAM_ERROR;
+
+                if ( result != FPK_RESULT_OK )
+                {
+                    fprintf(stderr, "Fatal error: %s sink failed: %s\n",
+                            SINK_NAMES[kind], fpk_result_to_string(result));
+                    status = 1;
+                    break;
+                }
+
+                sample_begin(&sample);
+
+                do
+                {
+                    sink_unpack(&sink, kind, package, length, from_file);
+                    n_runs++;
+                } while (now() - sample.seconds < m_min_seconds);
+
+                sample_end(&sample);
+
+                printf("{\"bench\":\"zero_copy\",\"cipher\":\"%s\","
+                        "\"source\":\"%s\",\"sink\":\"%s\","
+                        "\"backend\":\"%s\",\"package_bytes\":%zu,"
+                        "\"runs\":%lu,", CIPHER_NAMES[cipher_type],
+                        from_file ? "file" : "memory", SINK_NAMES[kind],
+                        backend->name, length, n_runs);
+                print_rate(&sample, (double) length * n_runs);
+                printf("}\n");
+            }
+        }
+    }
+
+    if ( m_file ) fclose(m_file);
+    free(page_memory);
+    free(sink.window);
+    free(package);
+
+    return status;
+}
+
+
+/* ==== THREADED RESTARTS ================================================= */
+
+// Unpacking a small signed package over and over on one context with
+// several verify threads starts and stops the hash worker back to back,
+// so that anything the worker does with the context after an unpack has
+// returned runs into the next one (or shows up under a thread sanitizer).
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_HMAC_SHA256)
+#define FPK_BENCH_RESTARTS
+#endif
+
+#ifdef FPK_BENCH_RESTARTS
+
+static unsigned restart_threads_cb(void* user_data)
+{
+    return RESTART_THREADS;
+}
+
+
+static int bench_restarts(void)
+{
+    fpk_hooks_t hooks = m_hooks;
+    size_t image_size = m_image_size;
+    unsigned long n_runs = 0;
+    uint32_t image_crc;
+    size_t length;
+    uint8_t* package;
+    sample_t sample;
+    int status = 0;
+
+    m_image_size = RESTART_IMAGE_SIZE;
+    package = build_package(FPK_AUTHENTICATION_TYPE_HMAC_SHA256,
+            FPK_CIPHER_TYPE_NONE, &length, &image_crc);
+    m_image_size = image_size;
+
+    if ( !package )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        return 1;
+    }
+
+    hooks.verify_threads = restart_threads_cb;
+    hooks.package_identity = NULL;
+    m_verify = 1;
+
+    sample_begin(&sample);
+
+    do
+    {
+        fpk_result_t result;
+
+        m_output_crc = 0xFFFFFFFFUL;
+        result = fpk_unpack_buffer(&m_ctx, package, length,
+                n_runs & 1 ? FPK_OPTION_SINGLE_PASS : 0, &hooks, NULL);
+
+        if ( result == FPK_RESULT_OK && m_output_crc != image_crc )
+            result = FPK_RESULT_PROGRAM_ERROR;
+
+        if ( result != FPK_RESULT_OK )
+        {
+            fprintf(stderr, "Fatal error: restart %lu failed: %d\n", n_runs,
+                    (int) result);
+            status = 1;
+            break;
+        }
+
+        n_runs++;
+    } while (n_runs < RESTART_MIN_RUNS ||
+        now() - sample.seconds < m_min_seconds);
+
+    sample_end(&sample);
+    m_verify = 0;
+
+    if ( status == 0 )
+    {
+        printf("{\"bench\":\"restarts\",\"threads\":%d,"
+                "\"package_bytes\":%zu,\"runs\":%lu,", RESTART_THREADS,
+                length, n_runs);
+        print_rate(&sample, (double) length * n_runs);
+        printf("}\n");
+    }
+
+    free(package);
+
+    return status;
+}
+
+#endif /* FPK_BENCH_RESTARTS */
+
+
+/* ==== ASYNC PROGRAMMING ================================================== */
+
+// Overlapping flash writes with deciphering matters where the cipher is in
+// software, so the bench needs one, and the flash is simulated by a thread.
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_AES128_CBC)
+#define FPK_BENCH_ASYNC_PROGRAM
+#endif
+
+#ifdef FPK_BENCH_ASYNC_PROGRAM
+
+#define FLASH_PAGE_SIZE         65536
+
+// A flash controller that takes page_ns to write each page without using
+// the CPU (the thread just sleeps), writing pages in the order started.
+// The CRC of what was written stands in for the flash contents.
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    long page_ns;
+    unsigned started[FPK_PROGRAM_SLOTS];
+    unsigned n_started;
+    unsigned done[FPK_PROGRAM_SLOTS];
+    unsigned n_done;
+    size_t lengths[FPK_PROGRAM_SLOTS];
+    int stop;
+    uint32_t crc;
+    uint8_t slots[FPK_PROGRAM_SLOTS * FLASH_PAGE_SIZE];
+
+} flash_t;
+
+
+static void flash_delay(long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+
+    while (nanosleep(&ts, &ts) != 0)
+    {
+    }
+}
+
+
+static void* flash_thread(void* arg)
+{
+    flash_t* flash = arg;
+
+    pthread_mutex_lock(&flash->lock);
+
+    for (;;)
+    {
+        unsigned slot;
+
+        while (flash->n_started == 0 && !flash->stop)
+            pthread_cond_wait(&flash->wake, &flash->lock);
+
+        if ( flash->n_started == 0 ) break;
+
+        slot = flash->started[0];
+        pthread_mutex_unlock(&flash->lock);
+
+        flash_delay(flash->page_ns);
+        flash->crc = fpk_crc32(flash->crc,
+                flash->slots + slot * FLASH_PAGE_SIZE, flash->lengths[slot]);
+
+        pthread_mutex_lock(&flash->lock);
+
+        flash->n_started--;
+        memmove(flash->started, flash->started + 1,
+                flash->n_started * sizeof(flash->started[0]));
+        flash->done[flash->n_done++] = slot;
+
+        pthread_cond_broadcast(&flash->wake);
+    }
+
+    pthread_mutex_unlock(&flash->lock);
+
+    return NULL;
+}
+
+
+static uint8_t* flash_buffer_cb(size_t* page_size, void* user_data)
+{
+    flash_t* flash = user_data;
+
+    *page_size = FLASH_PAGE_SIZE;
+    return flash->slots;
+}
+
+
+// Programming synchronously: the page is written before returning.
+
+static fpk_result_t flash_page_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, void* user_data)
+{
+    flash_t* flash = user_data;
+
+    flash_delay(flash->page_ns);
+    flash->crc = fpk_crc32(flash->crc, data, length);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t flash_page_async_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, unsigned slot, void* user_data)
+{
+    flash_t* flash = user_data;
+
+    pthread_mutex_lock(&flash->lock);
+
+    flash->lengths[slot] = length;
+    flash->started[flash->n_started++] = slot;
+
+    pthread_cond_broadcast(&flash->wake);
+    pthread_mutex_unlock(&flash->lock);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t flash_wait_cb(unsigned* slot, void* user_data)
+{
+    flash_t* flash = user_data;
+
+    pthread_mutex_lock(&flash->lock);
+
+    while (flash->n_done == 0) pthread_cond_wait(&flash->wake, &flash->lock);
+
+    *slot = flash->done[0];
+    flash->n_done--;
+    memmove(flash->done, flash->done + 1,
+            flash->n_done * sizeof(flash->done[0]));
+
+    pthread_mutex_unlock(&flash->lock);
+
+    return FPK_RESULT_OK;
+}
+
+
+static double flash_unpack(flash_t* flash, const uint8_t* package,
+        size_t length, int async, fpk_result_t* result)
+{
+    fpk_hooks_t hooks =
+    {
+        .program_buffer =       flash_buffer_cb,
+        .authentication_key =   authentication_key_cb,
+        .cipher_key =           cipher_key_cb,
+    };
+    double start = now();
+
+    if ( async )
+    {
+        hooks.program_page_async = flash_page_async_cb;
+        hooks.wait_program = flash_wait_cb;
+    }
+    else
+    {
+        hooks.program_page = flash_page_cb;
+    }
+
+    flash->crc = 0xFFFFFFFFUL;
+    *result = fpk_unpack_buffer(&m_ctx, package, length, 0, &hooks, flash);
+
+    return now() - start;
+}
+
+
+// Unpacks an enciphered package into a simulated flash that takes as long
+// to write a page as the portable cipher takes to decipher one, with
+// program_page and then with program_page_async.
+
+static int bench_async_program(void)
+{
+    static const backend_t PORTABLE = {"portable", 0};
+    uint32_t image_crc;
+    uint32_t expected_crc = 0xFFFFFFFFUL;
+    size_t length;
+    size_t n_pages = 0;
+    uint8_t* package;
+    flash_t* flash;
+    double seconds[2];
+    fpk_result_t result;
+    int status = 0;
+
+    package = build_package(FPK_AUTHENTICATION_TYPE_NONE,
+            FPK_CIPHER_TYPE_AES128_CBC, &length, &image_crc);
+    flash = calloc(1, sizeof(flash_t));
+
+    if ( !package || !flash )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        free(package);
+        free(flash);
+        return 1;
+    }
+
+    // the images as build_package lays them out
+    for (int i = 0; i < 3; i++)
+    {
+        size_t size = (i == 0) ? m_image_size / 8 + 3 :
+                (i == 1) ? m_image_size : 100;
+
+        for (size_t j = 0; j < size; j++)
+        {
+            uint8_t byte = (uint8_t) (j * 131 + (j >> 9) + i);
+            expected_crc = fpk_crc32(expected_crc, &byte, 1);
+        }
+
+        n_pages += (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    }
+
+    select_backend(&PORTABLE);
+
+    pthread_mutex_init(&flash->lock, NULL);
+    pthread_cond_init(&flash->wake, NULL);
+    pthread_create(&flash->thread, NULL, flash_thread, flash);
+
+    // with an instant flash, to time the deciphering
+    flash->page_ns = 0;
+    seconds[0] = flash_unpack(flash, package, length, 0, &result);
+    flash->page_ns = (long) (seconds[0] / n_pages * 1e9);
+
+    for (int async = 0; async < 2 && status == 0; async++)
+    {
+        seconds[async] = flash_unpack(flash, package, length, async,
+                &result);
+
+        if ( result != FPK_RESULT_OK || flash->crc != expected_crc )
+        {
+            fprintf(stderr, "Fatal error: %s flash unpack failed: %s\n",
+                    async ? "async" : "sync", fpk_result_to_string(result));
+            status = 1;
+        }
+    }
+
+    if ( status == 0 )
+    {
+        printf("{\"bench\":\"async_program\",\"backend\":\"portable\","
+                "\"page_bytes\":%d,\"pages\":%zu,\"page_us\":%.1f,"
+                "\"sync_ms\":%.2f,\"async_ms\":%.2f,\"speedup\":%.2f}\n",
+                FLASH_PAGE_SIZE, n_pages, flash->page_ns / 1e3,
+                seconds[0] * 1e3, seconds[1] * 1e3, seconds[0] / seconds[1]);
+    }
+
+    pthread_mutex_lock(&flash->lock);
+    flash->stop = 1;
+    pthread_cond_broadcast(&flash->wake);
+    pthread_mutex_unlock(&flash->lock);
+
+    pthread_join(flash->thread, NULL);
+    pthread_mutex_destroy(&flash->lock);
+    pthread_cond_destroy(&flash->wake);
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    m_cpu_features = CPU_FEATURES_UNKNOWN;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+    free(flash);
+    free(package);
+
+    return status;
+}
+
+#endif /* FPK_BENCH_ASYNC_PROGRAM */
+
+
+/* ==== IMAGE CACHE ======================================================== */
+
+// Serving deciphered images matters for packages that are enciphered and
+// signed, so the bench needs both, and the cache needs threads.
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_HMAC_SHA256) && \
+    defined(FPK_ENABLE_AES128_CBC)
+#define FPK_BENCH_IMAGE_CACHE
+#endif
+
+#ifdef FPK_BENCH_IMAGE_CACHE
+
+// A download session on an update server: the "app" image of a package in
+// memory is programmed, through the image cache, into a sink that just
+// checks it.
+
+typedef struct
+{
+    fpk_cache_t* cache;
+    const uint8_t* package;
+    size_t length;
+    size_t position;
+    double start;
+    unsigned long sessions;
+    uint32_t crc;
+    uint32_t expected_crc;
+    fpk_result_t result;
+    fpk_context_t ctx;
+    uint8_t buffer[65536];
+    uint8_t page[4096];
+
+} session_t;
+
+
+static fpk_result_t session_read_cb(uint8_t* buffer, size_t n_bytes,
+        void* user_data)
+{
+    session_t* session = user_data;
+
+    if ( session->length - session->position < n_bytes )
+        return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+    memcpy(buffer, session->package + session->position, n_bytes);
+    session->position += n_bytes;
+
+    return FPK_RESULT_OK;
+}
+
+
+static uint8_t* session_read_buffer_cb(size_t* size, void* user_data)
+{
+    session_t* session = user_data;
+
+    *size = sizeof(session->buffer);
+    return session->buffer;
+}
+
+
+static fpk_result_t session_seek_cb(uint32_t position, void* user_data)
+{
+    session_t* session = user_data;
+
+    if ( position > session->length ) return FPK_RESULT_READ_ERROR;
+
+    session->position = position;
+    return FPK_RESULT_OK;
+}
+
+
+static uint8_t* session_program_buffer_cb(size_t* page_size,
+        void* user_data)
+{
+    session_t* session = user_data;
+
+    *page_size = sizeof(session->page);
+    return session->page;
+}
+
+
+static fpk_result_t session_program_page_cb(const char* id,
+        uint32_t offset, const uint8_t* data, size_t length, void* user_data)
+{
+    session_t* session = user_data;
+
+    session->crc = fpk_crc32(session->crc, data, length);
+    return FPK_RESULT_OK;
+}
+
+
+static const fpk_hooks_t m_session_hooks =
+{
+    .read_file_bulk =       session_read_cb,
+    .read_buffer =          session_read_buffer_cb,
+    .seek_file =            session_seek_cb,
+    .program_buffer =       session_program_buffer_cb,
+    .program_page =         session_program_page_cb,
+    .authentication_key =   authentication_key_cb,
+    .cipher_key =           cipher_key_cb,
+};
+
+
+static void* session_thread(void* arg)
+{
+    static const uint8_t IDENTITY[] = "fpk_bench";
+    session_t* session = arg;
+
+    do
+    {
+        session->position = 0;
+        session->crc = 0xFFFFFFFFUL;
+
+        session->result = fpk_cache_program(session->cache, &session->ctx,
+                IDENTITY, sizeof(IDENTITY), "app", 0, &m_session_hooks,
+                session);
+
+        if ( session->result == FPK_RESULT_OK &&
+            session->crc != session->expected_crc )
+        {
+            session->result = FPK_RESULT_PROGRAM_ERROR;
+        }
+
+        session->sessions++;
+    } while (session->result == FPK_RESULT_OK &&
+        now() - session->start < m_min_seconds);
+
+    return NULL;
+}
+
+
+// Serves the same image to CACHE_CLIENTS concurrent sessions, so that only
+// the first has to verify and decipher the package.
+
+static int bench_image_cache(void)
+{
+    session_t* sessions[CACHE_CLIENTS] = {NULL};
+    pthread_t threads[CACHE_CLIENTS];
+    unsigned long n_sessions = 0;
+    fpk_cache_t cache;
+    uint32_t expected_crc = 0xFFFFFFFFUL;
+    uint32_t image_crc;
+    size_t length;
+    uint8_t* package;
+    sample_t sample;
+    int status = 0;
+
+    package = build_package(FPK_AUTHENTICATION_TYPE_HMAC_SHA256,
+            FPK_CIPHER_TYPE_AES128_CBC, &length, &image_crc);
+
+    if ( !package || fpk_cache_init(&cache, 2 * length) != FPK_RESULT_OK )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        free(package);
+        return 1;
+    }
+
+    // the "app" image as build_package lays it out
+    for (size_t j = 0; j < m_image_size; j++)
+    {
+        uint8_t byte = (uint8_t) (j * 131 + (j >> 9) + 1);
+        expected_crc = fpk_crc32(expected_crc, &byte, 1);
+    }
+
+    sample_begin(&sample);
+
+    for (int i = 0; i < CACHE_CLIENTS; i++)
+    {
+        sessions[i] = calloc(1, sizeof(session_t));
+
+        if ( !sessions[i] )
+        {
+            status = 1;
+            break;
+        }
+
+        sessions[i]->cache = &cache;
+        sessions[i]->package = package;
+        sessions[i]->length = length;
+        sessions[i]->start = sample.seconds;
+        sessions[i]->expected_crc = expected_crc;
+
+        if ( pthread_create(&threads[i], NULL, session_thread,
+            sessions[i]) != 0 )
+        {
+            free(sessions[i]);
+            sessions[i] = NULL;
+            status = 1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < CACHE_CLIENTS && sessions[i]; i++)
+    {
+        pthread_join(threads[i], NULL);
+        n_sessions += sessions[i]->sessions;
+
+        if ( sessions[i]->result != FPK_RESULT_OK )
+        {
+            fprintf(stderr, "Fatal error: image cache session failed: %d\n",
+                    (int) sessions[i]->result);
+            status = 1;
+        }
+
+        free(sessions[i]);
+    }
+
+    sample_end(&sample);
+
+    if ( status == 0 )
+    {
+        printf("{\"bench\":\"image_cache\",\"clients\":%d,"
+                "\"image_bytes\":%zu,\"sessions\":%lu,\"unpacks\":%lu,",
+                CACHE_CLIENTS, m_image_size, n_sessions,
+                (unsigned long) cache.misses);
+        print_rate(&sample, (double) m_image_size * n_sessions);
+        printf("}\n");
+    }
+
+    fpk_cache_destroy(&cache);
+    free(package);
+
+    return status;
+}
+
+#endif /* FPK_BENCH_IMAGE_CACHE */
+
+
+/* ==== CONTEXT POOL ======================================================= */
+
+// What each concurrent session costs: the context itself, padded to a
+// cache line as in fpk_context_pool_t, and the stack scratch that stands
+// in for a read_buffer during a call.
+
+static void bench_footprint(void)
+{
+    size_t session_bytes = (sizeof(fpk_context_t) + 63) & ~(size_t) 63;
+
+    printf("{\"bench\":\"footprint\",\"context_bytes\":%zu,"
+            "\"session_bytes\":%zu,\"scratch_bytes\":%d}\n",
+            sizeof(fpk_context_t), session_bytes, FPK_INPUT_BUFFER_SIZE);
+}
+
+
+#ifdef FPK_BENCH_IMAGE_CACHE
+#define FPK_BENCH_CONTEXT_POOL
+#endif
+
+#ifdef FPK_BENCH_CONTEXT_POOL
+
+// A short session on a server: a small signed and enciphered package in
+// memory is unpacked with a context that is either taken from a shared
+// fpk_context_pool_t or freshly allocated, and is then given back.
+
+typedef struct
+{
+    fpk_context_pool_t* pool;
+    const uint8_t* package;
+    size_t length;
+    double start;
+    unsigned long sessions;
+    fpk_result_t result;
+
+} pool_client_t;
+
+
+static fpk_result_t pool_view_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, void* user_data)
+{
+    return FPK_RESULT_OK;
+}
+
+
+static const fpk_hooks_t m_pool_hooks =
+{
+    .program_view =         pool_view_cb,
+    .authentication_key =   authentication_key_cb,
+    .cipher_key =           cipher_key_cb,
+};
+
+
+static void* pool_client_thread(void* arg)
+{
+    pool_client_t* client = arg;
+    fpk_context_t* ctx;
+
+    do
+    {
+        if ( client->pool ) ctx = fpk_context_pool_acquire(client->pool);
+        else ctx = malloc(sizeof(fpk_context_t));
+
+        if ( !ctx )
+        {
+            client->result = FPK_RESULT_OUT_OF_MEMORY;
+            break;
+        }
+
+        client->result = fpk_unpack_buffer(ctx, client->package,
+                client->length, FPK_OPTION_ENFORCE_AUTHENTICATION,
+                &m_pool_hooks, client);
+
+        if ( client->pool ) fpk_context_pool_release(client->pool, ctx);
+        else free(ctx);
+
+        client->sessions++;
+    } while (client->result == FPK_RESULT_OK &&
+        now() - client->start < m_min_seconds);
+
+    return NULL;
+}
+
+
+// Runs POOL_CLIENTS threads of back to back sessions, first with contexts
+// from a pool of POOL_CONTEXTS and then with malloc and free.
+
+static int bench_context_pool(void)
+{
+    static const char* const SOURCE_NAMES[] = {"malloc", "pool"};
+    pool_client_t clients[POOL_CLIENTS];
+    pthread_t threads[POOL_CLIENTS];
+    fpk_context_pool_t pool;
+    size_t image_size = m_image_size;
+    uint32_t image_crc;
+    size_t length;
+    uint8_t* package;
+    int status = 0;
+
+    m_image_size = POOL_IMAGE_SIZE;
+    package = build_package(FPK_AUTHENTICATION_TYPE_HMAC_SHA256,
+            FPK_CIPHER_TYPE_AES128_CBC, &length, &image_crc);
+    m_image_size = image_size;
+
+    if ( !package ||
+        fpk_context_pool_init(&pool, POOL_CONTEXTS) != FPK_RESULT_OK )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        free(package);
+        return 1;
+    }
+
+    for (int use_pool = 1; use_pool >= 0 && status == 0; use_pool--)
+    {
+        unsigned long n_sessions = 0;
+        sample_t sample;
+        int n_clients;
+
+        sample_begin(&sample);
+
+        for (n_clients = 0; n_clients < POOL_CLIENTS; n_clients++)
+        {
+            pool_client_t* client = &clients[n_clients];
+
+            client->pool = use_pool ? &pool : NULL;
+            client->package = package;
+            client->length = length;
+            client->start = sample.seconds;
+            client->sessions = 0;
+            client->result = FPK_RESULT_OK;
+
+            if ( pthread_create(&threads[n_clients], NULL,
+                pool_client_thread, client) != 0 )
+            {
+                status = 1;
+                break;
+            }
+        }
+
+        for (int i = 0; i < n_clients; i++)
+        {
+            pthread_join(threads[i], NULL);
+            n_sessions += clients[i].sessions;
+
+            if ( clients[i].result != FPK_RESULT_OK )
+            {
+                fprintf(stderr, "Fatal error: pool session failed: %d\n",
+                        (int) clients[i].result);
+                status = 1;
+            }
+        }
+
+        sample_end(&sample);
+
+        if ( status == 0 )
+        {
+            printf("{\"bench\":\"context_pool\",\"contexts\":\"%s\","
+                    "\"clients\":%d,\"pool_contexts\":%d,"
+                    "\"session_bytes\":%zu,\"package_bytes\":%zu,"
+                    "\"sessions\":%lu,\"sessions_per_s\":%.0f,",
+                    SOURCE_NAMES[use_pool], POOL_CLIENTS, POOL_CONTEXTS,
+                    pool.stride, length, n_sessions,
+                    n_sessions / sample.seconds);
+            print_rate(&sample, (double) length * n_sessions);
+            printf("}\n");
+        }
+    }
+
+    fpk_context_pool_destroy(&pool);
+    free(package);
+
+    return status;
+}
+
+#endif /* FPK_BENCH_CONTEXT_POOL */
+
+
+/* ==== MAIN =============================================================== */
+
+int main(int argc, char* argv[])
+{
+    uint8_t* buffer;
+    int status = 0;
+
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if ( strcmp(argv[1], "-C") == 0 )
+        {
+            m_cache = 1;
+            argc--;
+            argv++;
+            continue;
+        }
+
+#ifdef FPK_ENABLE_THREADS
+        if ( strcmp(argv[1], "-P") == 0 )
+        {
+            m_options |= FPK_OPTION_PIPELINE;
+            argc--;
+            argv++;
+            continue;
+        }
+#endif /* FPK_ENABLE_THREADS */
+
+        if ( argc < 3 ) break;
+
+        if ( strcmp(argv[1], "-t") == 0 ) m_min_seconds = atof(argv[2]);
+        else if ( strcmp(argv[1], "-n") == 0 ) m_image_size = atol(argv[2]);
+#ifdef FPK_ENABLE_THREADS
+        else if ( strcmp(argv[1], "-j") == 0 ) m_threads = atoi(argv[2]);
+#endif /* FPK_ENABLE_THREADS */
+        else break;
+
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ( argc > 1 )
+    {
+        puts("Usage: fpk_bench [-t <seconds per run>] [-n <image bytes>] "
+                "[-j <threads>] [-P] [-C]");
+        return 0;
+    }
+
+    buffer = malloc(MAX_KERNEL_SIZE);
+
+    if ( !buffer )
+    {
+        fprintf(stderr, "Fatal error: Out of memory\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < MAX_KERNEL_SIZE; i++) buffer[i] = (uint8_t) i;
+
+    bench_kernel("crc32", crc32_kernel, CRC32_BACKENDS, buffer);
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+    bench_kernel("hmac_sha256", hmac_sha256_kernel, SHA256_BACKENDS, buffer);
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+    bench_kernel("aes128_cbc", aes128_cbc_kernel, AES128_BACKENDS, buffer);
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    free(buffer);
+
+    for (int auth = 0; auth < 2 && status == 0; auth++)
+    {
+        for (int cipher = 0; cipher < 2 && status == 0; cipher++)
+        {
+#ifndef FPK_ENABLE_HMAC_SHA256
+            if ( auth ) continue;
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+#ifndef FPK_ENABLE_AES128_CBC
+            if ( cipher ) continue;
+#endif /* FPK_ENABLE_AES128_CBC */
+
+            status = bench_unpack((fpk_authentication_type_t) auth,
+                    (fpk_cipher_type_t) cipher);
+        }
+    }
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+    if ( status == 0 ) status = bench_verify_batch();
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    for (int cipher = 0; cipher < 2 && status == 0; cipher++)
+    {
+#ifndef FPK_ENABLE_AES128_CBC
+        if ( cipher ) continue;
+#endif /* FPK_ENABLE_AES128_CBC */
+
+        status = bench_zero_copy((fpk_cipher_type_t) cipher);
+    }
+
+#ifdef FPK_BENCH_RESTARTS
+    if ( status == 0 ) status = bench_restarts();
+#endif /* FPK_BENCH_RESTARTS */
+
+#ifdef FPK_BENCH_ASYNC_PROGRAM
+    if ( status == 0 ) status = bench_async_program();
+#endif /* FPK_BENCH_ASYNC_PROGRAM */
+
+#ifdef FPK_BENCH_IMAGE_CACHE
+    if ( status == 0 ) status = bench_image_cache();
+#endif /* FPK_BENCH_IMAGE_CACHE */
+
+    if ( status == 0 ) bench_footprint();
+
+#ifdef FPK_BENCH_CONTEXT_POOL
+    if ( status == 0 ) status = bench_context_pool();
+#endif /* FPK_BENCH_CONTEXT_POOL */
+
+    return status;
+}
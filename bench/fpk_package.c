@@ -0,0 +1,226 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Generates packages for the benchmarks and the examples' self-checks.
+ * The library source is included directly for its AES tables and HMAC, so
+ * this file takes the place of fpack.c in whatever it is built into.
+ */
+
+#include <stdlib.h>
+
+#include "fpack.c"
+#include "fpk_package.h"
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+static uint8_t xtime(uint8_t x)
+{
+    return (uint8_t) ((x << 1) ^ ((x >> 7) * 0x1B));
+}
+
+
+// The library only ever deciphers, so packages are enciphered here with a
+// straightforward implementation of the forward cipher.
+
+static void aes128_encrypt_block(const uint8_t* round_key, uint8_t* block)
+{
+    uint8_t t[16];
+
+    for (int i = 0; i < 16; i++) block[i] ^= round_key[i];
+
+    for (int round = 1; round <= AES128_NR; round++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            for (int r = 0; r < 4; r++)
+            {
+                t[4 * c + r] = AES128_SBOX[block[4 * ((c + r) & 3) + r]];
+            }
+        }
+
+        for (int c = 0; c < 4 && round < AES128_NR; c++)
+        {
+            uint8_t* col = t + 4 * c;
+            uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+            uint8_t first = col[0];
+
+            col[0] ^= all ^ xtime(col[0] ^ col[1]);
+            col[1] ^= all ^ xtime(col[1] ^ col[2]);
+            col[2] ^= all ^ xtime(col[2] ^ col[3]);
+            col[3] ^= all ^ xtime(col[3] ^ first);
+        }
+
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] = t[i] ^ round_key[16 * round + i];
+        }
+    }
+}
+
+
+static void aes128_encrypt_cbc(const uint8_t* key, uint8_t* data,
+        size_t n_blocks)
+{
+    uint8_t round_key[AES128_KEY_EXP_SIZE];
+
+    aes128_key_expansion(round_key, key);
+
+    // data[0..15] holds the IV
+    for (size_t i = 1; i <= n_blocks; i++)
+    {
+        uint8_t* block = data + 16 * i;
+
+        for (int j = 0; j < 16; j++) block[j] ^= block[j - 16];
+
+        aes128_encrypt_block(round_key, block);
+    }
+}
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+static uint8_t* put_string(uint8_t* p, const char* s)
+{
+    size_t length = strlen(s);
+
+    *p++ = (uint8_t) length;
+    memcpy(p, s, length);
+
+    return p + length;
+}
+
+
+static uint8_t* put_u32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t) value;
+    p[1] = (uint8_t) (value >> 8);
+    p[2] = (uint8_t) (value >> 16);
+    p[3] = (uint8_t) (value >> 24);
+
+    return p + 4;
+}
+
+
+uint8_t* fpk_build_package(fpk_authentication_type_t auth_type,
+        fpk_cipher_type_t cipher_type, const uint8_t* auth_key,
+        const uint8_t* cipher_key, size_t image_size, size_t* length,
+        uint32_t* image_crc)
+{
+    static const char* const IDS[] = {"boot", "app", "config"};
+    size_t image_sizes[3];
+    size_t payload_length;
+    size_t body_length;
+    uint32_t crc;
+    uint8_t* package;
+    uint8_t* body;
+    uint8_t* p;
+
+    image_sizes[0] = image_size / 8 + 3;
+    image_sizes[1] = image_size;
+    image_sizes[2] = 100;
+
+    // two counts plus "board" = "rev-c" and "ver" = "1.0"
+    payload_length = 2 + 2 + (1 + 5) + (1 + 5) + (1 + 3) + (1 + 3);
+
+    for (int i = 0; i < 3; i++)
+    {
+        payload_length += 1 + strlen(IDS[i]) + 4 + image_sizes[i];
+    }
+
+    body_length = (payload_length + 15) & ~(size_t) 15;
+
+    if ( cipher_type == FPK_CIPHER_TYPE_AES128_CBC ) body_length += 16;
+
+    *length = 16 + body_length + 16 +
+            (auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 ? 32 : 0);
+
+    package = calloc(1, *length);
+    if ( !package ) return NULL;
+
+    package[0] = 'F';
+    package[1] = 'P';
+    package[2] = 'K';
+    put_u32(package + 4, 0x5A000000);
+    put_u32(package + 8, (uint32_t) (body_length / 16));
+    package[12] = (uint8_t) auth_type;
+    package[13] = (uint8_t) cipher_type;
+
+    body = package + 16;
+    p = body + (cipher_type == FPK_CIPHER_TYPE_AES128_CBC ? 16 : 0);
+
+    *p++ = 2;
+    *p++ = 0;
+    p = put_string(p, "board");
+    p = put_string(p, "rev-c");
+    p = put_string(p, "ver");
+    p = put_string(p, "1.0");
+
+    *p++ = 3;
+    *p++ = 0;
+
+    *image_crc = 0xFFFFFFFFUL;
+
+    for (int i = 0; i < 3; i++)
+    {
+        p = put_string(p, IDS[i]);
+        p = put_u32(p, (uint32_t) image_sizes[i]);
+
+        for (size_t j = 0; j < image_sizes[i]; j++)
+        {
+            p[j] = (uint8_t) (j * 131 + (j >> 9) + i);
+        }
+
+        *image_crc = fpk_crc32(*image_crc, p, image_sizes[i]);
+        p += image_sizes[i];
+    }
+
+#ifdef FPK_ENABLE_AES128_CBC
+    if ( cipher_type == FPK_CIPHER_TYPE_AES128_CBC )
+    {
+        for (int i = 0; i < 16; i++) body[i] = (uint8_t) (i * 17 + 5);
+        aes128_encrypt_cbc(cipher_key, body, body_length / 16 - 1);
+    }
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    p = body + body_length;
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+    if ( auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
+    {
+        fpk_context_t ctx;
+
+        hmac_reset(&ctx, auth_key);
+        hmac_update(&ctx, body, body_length);
+        hmac_digest(&ctx, p);
+        p += 32;
+    }
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    crc = fpk_crc32(0xFFFFFFFFUL, package, p - package);
+    put_u32(p, crc);
+
+    return package;
+}
@@ -0,0 +1,52 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FPK_PACKAGE_H_
+#define _FPK_PACKAGE_H_
+
+#include "fpack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// Builds a package holding two metadata entries ("board" = "rev-c" and
+// "ver" = "1.0") and three images, "boot", "app" and "config", the second
+// of which is image_size bytes. auth_key and cipher_key are only used for
+// the authentication and cipher types that need them. Returns the
+// package, which the caller must free, or NULL if out of memory; its
+// length and the CRC32 of the three images' data run together are
+// returned through length and image_crc.
+
+uint8_t* fpk_build_package(fpk_authentication_type_t auth_type,
+        fpk_cipher_type_t cipher_type, const uint8_t* auth_key,
+        const uint8_t* cipher_key, size_t image_size, size_t* length,
+        uint32_t* image_crc);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPK_PACKAGE_H_ */
@@ -0,0 +1,510 @@
+/*
+ * Copyright 2017 Matthew T. Bucknall
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Runs many unpacks of one package at once on a single thread with
+// fpk::async_unpack, against a fake file and flash whose reads and writes
+// complete after a simulated delay. A small executor keeps a virtual clock
+// and resumes each operation when its delay is up, so the unpacks overlap
+// their I/O deterministically. Each unpack's images are checked against a
+// synchronous fpk_unpack_buffer of the same package, and two more runs
+// check that a corrupt package and a failing flash write are aborted.
+//
+// Usage: async_example [-n <unpacks>] [<fpk-file>]
+//
+// Without a file, the checks are run on a package generated in memory for
+// each authentication and cipher type, as the project's test.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "fpack_async.hpp"
+#include "fpk_package.h"
+
+
+#define READ_DELAY_US           200
+#define PROGRAM_DELAY_US        800
+#define COMMIT_DELAY_US         2000
+#define IMAGE_SIZE              20000
+
+
+typedef std::map<std::string, std::vector<uint8_t>> images_t;
+
+
+static const uint8_t AUTH_KEY[] = {
+    0xea, 0x70, 0x39, 0xd4, 0x00, 0x0a, 0x98, 0x7a,
+    0x9d, 0x48, 0x63, 0xa9, 0x1c, 0x08, 0x9c, 0xfe,
+    0x64, 0x93, 0xee, 0xc5, 0xba, 0x08, 0x9b, 0x59,
+    0xb8, 0x45, 0x51, 0x97, 0x48, 0x7b, 0xda, 0x3b,
+};
+
+static const uint8_t CIPHER_KEY[] = {
+    0x99, 0xd2, 0x37, 0x6f, 0x13, 0x3d, 0x9f, 0x7c,
+    0x5c, 0x89, 0x83, 0x89, 0x02, 0x84, 0xe0, 0x95
+};
+
+
+/* ==== EXECUTOR =========================================================== */
+
+class executor
+{
+public:
+
+    // Awaitable that resumes the awaiter delay microseconds later.
+
+    struct sleep_t
+    {
+        executor& exec;
+        uint64_t delay;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            exec.m_timers.push({exec.m_now + delay, exec.m_seq++, handle});
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    sleep_t sleep(uint64_t delay)
+    {
+        return sleep_t{*this, delay};
+    }
+
+    // Resumes whatever is due next until nothing is left waiting.
+
+    void run()
+    {
+        while (!m_timers.empty())
+        {
+            timer_t timer = m_timers.top();
+
+            m_timers.pop();
+            m_now = timer.due;
+            timer.handle.resume();
+        }
+    }
+
+    uint64_t now() const
+    {
+        return m_now;
+    }
+
+private:
+
+    struct timer_t
+    {
+        uint64_t due;
+        uint64_t seq;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const timer_t& other) const
+        {
+            return due != other.due ? due > other.due : seq > other.seq;
+        }
+    };
+
+    std::priority_queue<timer_t, std::vector<timer_t>,
+            std::greater<timer_t>> m_timers;
+    uint64_t m_now = 0;
+    uint64_t m_seq = 0;
+};
+
+
+/* ==== BACKEND ============================================================ */
+
+// Reads from a package in memory and programs into a map of images, each
+// after a delay. fail_after makes the write after that many fail.
+
+class fake_backend
+{
+public:
+
+    fake_backend(executor& exec, const std::vector<uint8_t>& package) :
+        m_exec(exec),
+        m_package(package)
+    {
+    }
+
+    fpk::task read(uint8_t* buffer, size_t size, size_t* length)
+    {
+        size_t n = m_package.size() - m_position;
+
+        if ( n > size ) n = size;
+
+        co_await m_exec.sleep(READ_DELAY_US);
+
+        std::memcpy(buffer, m_package.data() + m_position, n);
+        m_position += n;
+        *length = n;
+        m_io_time += READ_DELAY_US;
+
+        co_return FPK_RESULT_OK;
+    }
+
+    fpk::task prepare(const char* id, uint32_t size)
+    {
+        m_staged[id].assign(size, 0xFF);
+        co_return FPK_RESULT_OK;
+    }
+
+    fpk::task program(const char* id, uint32_t offset, const uint8_t* data,
+            size_t length)
+    {
+        std::vector<uint8_t>& image = m_staged[id];
+
+        co_await m_exec.sleep(PROGRAM_DELAY_US);
+        m_io_time += PROGRAM_DELAY_US;
+
+        if ( m_writes++ == m_fail_after || offset + length > image.size() )
+            co_return FPK_RESULT_PROGRAM_ERROR;
+
+        std::memcpy(image.data() + offset, data, length);
+
+        co_return FPK_RESULT_OK;
+    }
+
+    fpk::task commit()
+    {
+        co_await m_exec.sleep(COMMIT_DELAY_US);
+        m_io_time += COMMIT_DELAY_US;
+
+        m_images.swap(m_staged);
+        m_staged.clear();
+
+        co_return FPK_RESULT_OK;
+    }
+
+    void abort(fpk_result_t result)
+    {
+        m_staged.clear();
+        m_aborted = true;
+    }
+
+    const uint8_t* authentication_key(fpk_authentication_type_t type)
+    {
+        if ( type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 ) return AUTH_KEY;
+        else return NULL;
+    }
+
+    const uint8_t* cipher_key(fpk_cipher_type_t type)
+    {
+        if ( type == FPK_CIPHER_TYPE_AES128_CBC ) return CIPHER_KEY;
+        else return NULL;
+    }
+
+    void fail_after(unsigned long n_writes)
+    {
+        m_fail_after = n_writes;
+    }
+
+    const images_t& images() const
+    {
+        return m_images;
+    }
+
+    bool aborted() const
+    {
+        return m_aborted;
+    }
+
+    uint64_t io_time() const
+    {
+        return m_io_time;
+    }
+
+private:
+
+    executor& m_exec;
+    const std::vector<uint8_t>& m_package;
+    size_t m_position = 0;
+    images_t m_staged;
+    images_t m_images;
+    unsigned long m_writes = 0;
+    unsigned long m_fail_after = ~0UL;
+    bool m_aborted = false;
+    uint64_t m_io_time = 0;
+};
+
+
+/* ==== REFERENCE ========================================================== */
+
+static images_t m_reference;
+
+
+static fpk_result_t prepare_memory_cb(const char* id, uint32_t size,
+        void* user_data)
+{
+    m_reference[id].clear();
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t program_memory_cb(const char* id, const uint8_t* data,
+        uint8_t length, void* user_data)
+{
+    std::vector<uint8_t>& image = m_reference[id];
+
+    image.insert(image.end(), data, data + length);
+    return FPK_RESULT_OK;
+}
+
+
+static const uint8_t* authentication_key_cb(fpk_authentication_type_t type,
+        void* user_data)
+{
+    return static_cast<fake_backend*>(user_data)->authentication_key(type);
+}
+
+
+static const uint8_t* cipher_key_cb(fpk_cipher_type_t type, void* user_data)
+{
+    return static_cast<fake_backend*>(user_data)->cipher_key(type);
+}
+
+
+static fpk_result_t unpack_reference(const std::vector<uint8_t>& package)
+{
+    static fpk_context_t ctx;
+    fpk_hooks_t hooks = {};
+    executor exec;
+    fake_backend keys(exec, package);
+
+    hooks.prepare_memory = prepare_memory_cb;
+    hooks.program_memory = program_memory_cb;
+    hooks.authentication_key = authentication_key_cb;
+    hooks.cipher_key = cipher_key_cb;
+
+    return fpk_unpack_buffer(&ctx, package.data(), package.size(), 0,
+            &hooks, &keys);
+}
+
+
+/* ==== MAIN =============================================================== */
+
+// Runs one unpack of package on its own and returns its result.
+
+static fpk_result_t unpack_one(const std::vector<uint8_t>& package,
+        unsigned long fail_after, bool* aborted)
+{
+    executor exec;
+    fake_backend backend(exec, package);
+    std::unique_ptr<fpk_context_t> ctx(new fpk_context_t());
+    fpk::task task = fpk::async_unpack(*ctx, backend);
+
+    backend.fail_after(fail_after);
+    task.start();
+    exec.run();
+
+    *aborted = backend.aborted();
+    return task.done() ? task.result() : FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+}
+
+
+// Runs n_unpacks concurrent unpacks of package, then the corrupt package
+// and failed write checks, returning non-zero if any of them fail.
+
+static int check_package(std::vector<uint8_t>& package, unsigned n_unpacks)
+{
+    std::vector<std::unique_ptr<fpk_context_t>> contexts;
+    std::vector<std::unique_ptr<fake_backend>> backends;
+    std::vector<fpk::task> tasks;
+    uint64_t io_time = 0;
+    executor exec;
+    fpk_result_t result;
+    bool aborted;
+    int status = 0;
+
+    m_reference.clear();
+    result = unpack_reference(package);
+
+    if ( result != FPK_RESULT_OK )
+    {
+        std::fprintf(stderr, "Unpack failed: %s\n",
+                fpk_result_to_string(result));
+        return 1;
+    }
+
+    for (unsigned i = 0; i < n_unpacks; i++)
+    {
+        contexts.emplace_back(new fpk_context_t());
+        backends.emplace_back(new fake_backend(exec, package));
+        tasks.push_back(fpk::async_unpack(*contexts[i], *backends[i]));
+        tasks[i].start();
+    }
+
+    exec.run();
+
+    for (unsigned i = 0; i < n_unpacks; i++)
+    {
+        if ( !tasks[i].done() || tasks[i].result() != FPK_RESULT_OK ||
+            backends[i]->images() != m_reference )
+        {
+            std::fprintf(stderr, "Unpack %u failed: %s\n", i,
+                    tasks[i].done() ?
+                    fpk_result_to_string(tasks[i].result()) : "unfinished");
+            status = 1;
+        }
+
+        io_time += backends[i]->io_time();
+    }
+
+    std::printf("%u unpacks of %zu bytes: %.1f ms, %.1f ms of I/O "
+            "(virtual time)\n", n_unpacks, package.size(), exec.now() / 1e3,
+            io_time / 1e3);
+
+    // a corrupt package, which must not be committed
+    package[package.size() / 2] ^= 1;
+    result = unpack_one(package, ~0UL, &aborted);
+    package[package.size() / 2] ^= 1;
+
+    std::printf("Corrupt package: %s%s\n", fpk_result_to_string(result),
+            aborted ? ", aborted" : "");
+    if ( result == FPK_RESULT_OK || !aborted ) status = 1;
+
+    // a flash write that fails part way through
+    result = unpack_one(package, 1, &aborted);
+
+    std::printf("Failed write: %s%s\n", fpk_result_to_string(result),
+            aborted ? ", aborted" : "");
+    if ( result != FPK_RESULT_PROGRAM_ERROR || !aborted ) status = 1;
+
+    return status;
+}
+
+
+// Generates a package of each type the library was built to handle and
+// checks it, and that its images are the ones that went into it.
+
+static int check_generated(unsigned n_unpacks)
+{
+    static const char* const IDS[] = {"boot", "app", "config"};
+    int status = 0;
+
+    for (int auth = 0; auth < 2; auth++)
+    {
+        for (int cipher = 0; cipher < 2; cipher++)
+        {
+            std::vector<uint8_t> package;
+            uint32_t image_crc;
+            uint32_t crc = 0xFFFFFFFFUL;
+            uint8_t* data;
+            size_t length;
+
+#ifndef FPK_ENABLE_HMAC_SHA256
+            if ( auth ) continue;
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+#ifndef FPK_ENABLE_AES128_CBC
+            if ( cipher ) continue;
+#endif /* FPK_ENABLE_AES128_CBC */
+
+            data = fpk_build_package((fpk_authentication_type_t) auth,
+                    (fpk_cipher_type_t) cipher, AUTH_KEY, CIPHER_KEY,
+                    IMAGE_SIZE, &length, &image_crc);
+
+            if ( !data )
+            {
+                std::fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+
+            package.assign(data, data + length);
+            std::free(data);
+
+            std::printf("Package with authentication %d, cipher %d\n", auth,
+                    cipher);
+
+            if ( check_package(package, n_unpacks) != 0 )
+            {
+                status = 1;
+                continue;
+            }
+
+            for (const char* id : IDS)
+            {
+                const std::vector<uint8_t>& image = m_reference[id];
+
+                crc = fpk_crc32(crc, image.data(), image.size());
+            }
+
+            if ( crc != image_crc )
+            {
+                std::fprintf(stderr, "Images differ from the package's\n");
+                status = 1;
+            }
+        }
+    }
+
+    return status;
+}
+
+
+int main(int argc, char* argv[])
+{
+    std::vector<uint8_t> package;
+    unsigned n_unpacks = 100;
+    FILE* file;
+
+    if ( argc > 2 && std::strcmp(argv[1], "-n") == 0 )
+    {
+        n_unpacks = std::atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ( argc > 2 || n_unpacks == 0 ||
+        (argc == 2 && argv[1][0] == '-') )
+    {
+        std::puts("Usage: async_example [-n <unpacks>] [<fpk-file>]");
+        return 0;
+    }
+
+    if ( argc == 1 ) return check_generated(n_unpacks);
+
+    file = std::fopen(argv[1], "rb");
+
+    if ( !file )
+    {
+        std::fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    for (int c; (c = std::fgetc(file)) != EOF;) package.push_back(c);
+    std::fclose(file);
+
+    return check_package(package, n_unpacks);
+}
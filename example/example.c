@@ -24,17 +24,32 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fpack.h"
+#include "fpack_file.h"
+#include "fpack_catalog.h"
 
 
 static fpk_context_t m_ctx;
+static unsigned m_threads;
+static const char* m_image;
+static const char* m_cache_path;
+static uint64_t m_identity[4];
 static FILE* m_input;
 static FILE* m_output;
+static fpk_segment_t m_window;
 
 
-static fpk_result_t read_file_cb(uint8_t* buffer, uint8_t n_bytes,
+static fpk_result_t read_file_bulk_cb(uint8_t* buffer, size_t n_bytes,
             void* user_data)
 {
     if ( fread(buffer, n_bytes, 1, m_input) == 1 ) return FPK_RESULT_OK;
@@ -42,6 +57,15 @@ static fpk_result_t read_file_cb(uint8_t* buffer, uint8_t n_bytes,
 }
 
 
+static uint8_t* read_buffer_cb(size_t* size, void* user_data)
+{
+    static uint8_t buffer[65536];
+    
+    *size = sizeof(buffer);
+    return buffer;
+}
+
+
 static fpk_result_t seek_file_cb(uint32_t position, void* user_data)
 {
     if ( fseek(m_input, position, SEEK_SET) == 0 ) return FPK_RESULT_OK;
@@ -69,8 +93,61 @@ static fpk_result_t program_memory_cb(const char* id, const uint8_t* data,
 }
 
 
+static uint8_t* program_buffer_cb(size_t* page_size, void* user_data)
+{
+    static uint8_t page[4096];
+    
+    *page_size = sizeof(page);
+    return page;
+}
+
+
+static fpk_result_t program_page_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, void* user_data)
+{
+    if ( fseek(m_output, offset, SEEK_SET) == 0 &&
+        fwrite(data, length, 1, m_output) == 1 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_PROGRAM_ERROR;
+}
+
+
+static fpk_result_t program_view_cb(const char* id, uint32_t offset,
+        const uint8_t* data, size_t length, void* user_data)
+{
+    if ( fwrite(data, length, 1, m_output) == 1 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_PROGRAM_ERROR;
+}
+
+
+// Maps the output file so that the image is deciphered straight into it.
+
+static const fpk_segment_t* image_destination_cb(const char* id,
+        uint32_t size, unsigned* n_segments, void* user_data)
+{
+    int fd = fileno(m_output);
+    void* data;
+
+    if ( size == 0 || ftruncate(fd, size) != 0 ) return NULL;
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( data == MAP_FAILED ) return NULL;
+
+    m_window.data = data;
+    m_window.length = size;
+    *n_segments = 1;
+
+    return &m_window;
+}
+
+
 static fpk_result_t finalize_memory_cb(const char* id, void* user_data)
 {
+    if ( m_window.data )
+    {
+        munmap(m_window.data, m_window.length);
+        m_window.data = NULL;
+    }
+
     fclose(m_output);
     return FPK_RESULT_OK;
 }
@@ -111,46 +188,368 @@ static fpk_result_t handle_metadata_cb(const char* key, const char* value,
 }
 
 
+static fpk_result_t commit_memory_cb(void* user_data)
+{
+    puts("Package verified");
+    return FPK_RESULT_OK;
+}
+
+
+static void abort_memory_cb(fpk_result_t result, void* user_data)
+{
+    fprintf(stderr, "Discarding unpacked images\n");
+}
+
+
+#ifdef FPK_ENABLE_STATISTICS
+
+static uint64_t read_clock_cb(void* user_data)
+{
+    return clock();
+}
+
+
+static void print_stat(const char* name, const fpk_stat_t* stat)
+{
+    printf("%-16s %8lu calls %12llu bytes %8.3f s\n", name,
+            (unsigned long) stat->calls, (unsigned long long) stat->bytes,
+            (double) stat->time / CLOCKS_PER_SEC);
+}
+
+
+static void print_stats(const fpk_stats_t* stats)
+{
+    printf("%-16s %12llu bytes\n", "input",
+            (unsigned long long) stats->bytes_read);
+    print_stat("read_file", &stats->read_file);
+    print_stat("seek_file", &stats->seek_file);
+    print_stat("prepare_memory", &stats->prepare_memory);
+    print_stat("program_memory", &stats->program_memory);
+    print_stat("program_wait", &stats->program_wait);
+    print_stat("finalize_memory", &stats->finalize_memory);
+    print_stat("handle_metadata", &stats->handle_metadata);
+    print_stat("commit_memory", &stats->commit_memory);
+    print_stat("crc32", &stats->crc32);
+    print_stat("authentication", &stats->authentication);
+    print_stat("cipher", &stats->cipher);
+}
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+
+#ifdef FPK_ENABLE_THREADS
+
+static unsigned verify_threads_cb(void* user_data)
+{
+    return m_threads;
+}
+
+#endif /* FPK_ENABLE_THREADS */
+
+
+static int select_image_cb(const char* id, uint32_t size, void* user_data)
+{
+    return strcmp(id, m_image) == 0;
+}
+
+
+// A verification cache kept as a file of keys, one after the other. The
+// identity of a package is the device, inode, size and mtime of its file.
+
+static const uint8_t* package_identity_cb(size_t* size, void* user_data)
+{
+    *size = sizeof(m_identity);
+    return (const uint8_t*) m_identity;
+}
+
+
+static int lookup_verified_cb(const uint8_t* key, void* user_data)
+{
+    uint8_t entry[FPK_VERIFY_KEY_SIZE];
+    FILE* file = fopen(m_cache_path, "rb");
+    int found = 0;
+
+    if ( !file ) return 0;
+
+    while (!found && fread(entry, sizeof(entry), 1, file) == 1)
+        found = memcmp(entry, key, sizeof(entry)) == 0;
+
+    fclose(file);
+    return found;
+}
+
+
+static void store_verified_cb(const uint8_t* key, void* user_data)
+{
+    FILE* file = fopen(m_cache_path, "ab");
+
+    if ( !file ) return;
+
+    fwrite(key, FPK_VERIFY_KEY_SIZE, 1, file);
+    fclose(file);
+}
+
+
 static const fpk_hooks_t m_hooks =
 {
-    .read_file =            read_file_cb,
+    .read_file_bulk =       read_file_bulk_cb,
+    .read_buffer =          read_buffer_cb,
     .seek_file =            seek_file_cb,
     .prepare_memory =       prepare_memory_cb,
     .program_memory =       program_memory_cb,
     .finalize_memory =      finalize_memory_cb,
     .authentication_key =   authentication_key_cb,
     .cipher_key =           cipher_key_cb,
-    .handle_metadata =      handle_metadata_cb
+    .handle_metadata =      handle_metadata_cb,
+    .commit_memory =        commit_memory_cb,
+    .abort_memory =         abort_memory_cb,
+#ifdef FPK_ENABLE_STATISTICS
+    .read_clock =           read_clock_cb,
+#endif /* FPK_ENABLE_STATISTICS */
+#ifdef FPK_ENABLE_THREADS
+    .verify_threads =       verify_threads_cb,
+#endif /* FPK_ENABLE_THREADS */
 };
 
 
+// Lists where each image lies in the package, as a server offering
+// partial downloads with fpk_read_range would.
+
+static fpk_result_t list_images(uint32_t options, const fpk_hooks_t* hooks)
+{
+    fpk_image_entry_t entries[16];
+    fpk_result_t result;
+    uint16_t n;
+
+    result = fpk_index(&m_ctx, options, hooks, NULL, entries, 16, &n);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    if ( n > 16 ) n = 16;
+
+    for (uint16_t i = 0; i < n; i++)
+    {
+        printf("%-16s offset %10u length %10u\n", entries[i].id,
+                entries[i].offset, entries[i].length);
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+// Shows what a package says about itself without verifying any of it.
+
+static fpk_result_t probe_package(const fpk_hooks_t* hooks)
+{
+    fpk_probe_t probe;
+    fpk_result_t result;
+
+    result = fpk_probe(&m_ctx, hooks, NULL, &probe);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    printf("Timestamp: %u, blocks: %u, authentication: %d, cipher: %d%s\n",
+            probe.timestamp, probe.n_blocks, (int) probe.auth_type,
+            (int) probe.cipher_type,
+            probe.unauthenticated ? " (unauthenticated)" : "");
+
+    return FPK_RESULT_OK;
+}
+
+
+// Brings the catalog up to date with the packages in directory, then shows
+// what it says about each of them.
+
+static fpk_result_t show_catalog(const char* path, const char* directory,
+        const fpk_hooks_t* hooks)
+{
+    fpk_catalog_t catalog;
+    fpk_result_t result;
+
+    result = fpk_catalog_update(path, directory, hooks, NULL);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    result = fpk_catalog_open(&catalog, path);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    for (uint32_t i = 0; i < catalog.header->n_packages; i++)
+    {
+        const fpk_catalog_package_t* package = &catalog.packages[i];
+        const fpk_catalog_image_t* images;
+        const fpk_catalog_metadata_t* metadata;
+
+        printf("%s: %s, timestamp %u\n",
+                fpk_catalog_string(&catalog, package->name),
+                fpk_result_to_string((fpk_result_t) package->status),
+                package->timestamp);
+
+        images = fpk_catalog_images(&catalog, package);
+        metadata = fpk_catalog_metadata(&catalog, package);
+
+        for (uint32_t j = 0; images && j < package->n_images; j++)
+        {
+            printf("  %-16s offset %10u length %10u\n",
+                    fpk_catalog_string(&catalog, images[j].id),
+                    images[j].offset, images[j].length);
+        }
+
+        for (uint32_t j = 0; metadata && j < package->n_metadata; j++)
+        {
+            printf("  %s = %s\n",
+                    fpk_catalog_string(&catalog, metadata[j].key),
+                    fpk_catalog_string(&catalog, metadata[j].value));
+        }
+    }
+
+    fpk_catalog_close(&catalog);
+
+    return FPK_RESULT_OK;
+}
+
+
+// Feeds the package to the push API in pieces, as data would arrive from a
+// network stream.
+
+static fpk_result_t unpack_pushed(uint32_t options, const fpk_hooks_t* hooks)
+{
+    uint8_t buffer[4096];
+    fpk_result_t result;
+    size_t n;
+
+    result = fpk_begin(&m_ctx, options, hooks, NULL);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    do
+    {
+        n = fread(buffer, 1, sizeof(buffer), m_input);
+        if ( n == 0 ) return fpk_finish(&m_ctx);
+
+        result = fpk_feed(&m_ctx, buffer, n);
+    } while (result == FPK_RESULT_NEED_MORE_INPUT);
+
+    return result;
+}
+
+
 int main(int argc, char* argv[])
 {
     fpk_result_t result;
+    uint32_t options = 0;//FPK_OPTION_ENFORCE_AUTHENTICATION;
+    int map_file = 0;
+    int push = 0;
+    int list = 0;
+    int probe = 0;
+    int show_stats = 0;
+    const char* catalog = NULL;
+    fpk_hooks_t hooks = m_hooks;
+    
+    while (argc > 2 && argv[1][0] == '-')
+    {
+        if ( strcmp(argv[1], "-s") == 0 ) options |= FPK_OPTION_SINGLE_PASS;
+        else if ( strcmp(argv[1], "-m") == 0 ) map_file = 1;
+        else if ( strcmp(argv[1], "-f") == 0 ) push = 1;
+        else if ( strcmp(argv[1], "-v") == 0 ) show_stats = 1;
+        else if ( strcmp(argv[1], "-P") == 0 ) options |= FPK_OPTION_PIPELINE;
+        else if ( strcmp(argv[1], "-l") == 0 ) list = 1;
+        else if ( strcmp(argv[1], "-q") == 0 ) probe = 1;
+        else if ( strcmp(argv[1], "-i") == 0 && argc > 3 )
+        {
+            m_image = argv[2];
+            hooks.select_image = select_image_cb;
+            argc--;
+            argv++;
+        }
+        else if ( strcmp(argv[1], "-c") == 0 && argc > 3 )
+        {
+            catalog = argv[2];
+            argc--;
+            argv++;
+        }
+        else if ( strcmp(argv[1], "-k") == 0 && argc > 3 )
+        {
+            m_cache_path = argv[2];
+            argc--;
+            argv++;
+        }
+        else if ( strcmp(argv[1], "-j") == 0 && argc > 3 )
+        {
+            m_threads = (unsigned) atoi(argv[2]);
+            argc--;
+            argv++;
+        }
+        else if ( strcmp(argv[1], "-p") == 0 )
+        {
+            hooks.program_buffer = program_buffer_cb;
+            hooks.program_page = program_page_cb;
+        }
+        else if ( strcmp(argv[1], "-z") == 0 )
+        {
+            hooks.program_view = program_view_cb;
+        }
+        else if ( strcmp(argv[1], "-d") == 0 )
+        {
+            hooks.image_destination = image_destination_cb;
+        }
+        else break;
+        
+        argc--;
+        argv++;
+    }
     
     if ( argc < 2 )
     {
-        puts("Usage: example <fpk-file>");
+        puts("Usage: example [-s] [-m] [-f] [-p] [-z] [-d] [-v] "
+                "[-j <threads>] [-P] [-i <image>] [-l] [-q] [-c <catalog>] "
+                "[-k <cache>] <fpk-file|directory>");
         return 0;
     }
-    
-    m_input = fopen(argv[1], "rb");
-    
-    if ( !m_input )
+
+    if ( m_cache_path )
     {
-        fprintf(stderr, "Fatal error: Unable to open file: %s\n", argv[1]);
-        return 1;
+        struct stat st;
+
+        if ( stat(argv[1], &st) == 0 )
+        {
+            m_identity[0] = st.st_dev;
+            m_identity[1] = st.st_ino;
+            m_identity[2] = st.st_size;
+            m_identity[3] = st.st_mtime;
+
+            hooks.package_identity = package_identity_cb;
+            hooks.lookup_verified = lookup_verified_cb;
+            hooks.store_verified = store_verified_cb;
+        }
     }
     
-    result = fpk_unpack(
-        &m_ctx,
-        0,//FPK_OPTION_ENFORCE_AUTHENTICATION,
-        &m_hooks,
-        NULL
-    );
-    
-    fclose(m_input);
+    if ( catalog )
+    {
+        result = show_catalog(catalog, argv[1], &hooks);
+    }
+    else if ( map_file )
+    {
+        result = fpk_unpack_file(&m_ctx, argv[1], options, &hooks, NULL);
+    }
+    else
+    {
+        m_input = fopen(argv[1], "rb");
+        
+        if ( !m_input )
+        {
+            fprintf(stderr, "Fatal error: Unable to open file: %s\n",
+                    argv[1]);
+            return 1;
+        }
+        
+        if ( probe ) result = probe_package(&hooks);
+        else if ( list ) result = list_images(options, &hooks);
+        else if ( push ) result = unpack_pushed(options, &hooks);
+        else result = fpk_unpack(&m_ctx, options, &hooks, NULL);
+        
+        fclose(m_input);
+    }
     
+#ifdef FPK_ENABLE_STATISTICS
+    if ( show_stats ) print_stats(fpk_get_stats(&m_ctx));
+#endif /* FPK_ENABLE_STATISTICS */
+
     if ( result == FPK_RESULT_OK )
     {
         return 0;
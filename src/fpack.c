@@ -25,6 +25,189 @@
 
 #include "fpack.h"
 
+#ifdef FPK_ENABLE_THREADS
+#include <stdlib.h>
+#endif /* FPK_ENABLE_THREADS */
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+#include <cpuid.h>
+#include <immintrin.h>
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+#define FLAG_CAPTURE_CRC32      (1 << 0)
+#define FLAG_CAPTURE_AUTH       (1 << 1)
+#define FLAG_DECIPHER           (1 << 2)
+#define FLAG_AESNI              (1 << 3)
+#define FLAG_PUSH               (1 << 4)
+#define FLAG_VERIFY_ONLY        (1 << 5)
+#define FLAG_VERIFIED           (1 << 6)
+#define FLAG_INDEX              (1 << 7)
+#define FLAG_PROBE              (1 << 8)
+#define FLAG_STORE_VERIFIED     (1 << 9)
+#define FLAG_SCRATCH_INPUT      (1 << 10)
+
+
+// Where unpacking is up to in the package (ctx->state) and, within the
+// body, in the payload (ctx->payload_state). Two-pass unpacking runs
+// through the states twice: first with FLAG_VERIFY_ONLY, which just
+// captures the CRC32 and HMAC of the body, then with FLAG_VERIFIED, which
+// deciphers and unpacks it.
+
+typedef enum
+{
+    STATE_HEADER,
+    STATE_IV,
+    STATE_BODY,
+    STATE_SIGNATURE,
+    STATE_TRAILER,
+    STATE_DONE
+
+} state_t;
+
+
+typedef enum
+{
+    PAYLOAD_META_COUNT,
+    PAYLOAD_META_KEY_LENGTH,
+    PAYLOAD_META_KEY,
+    PAYLOAD_META_VALUE_LENGTH,
+    PAYLOAD_META_VALUE,
+    PAYLOAD_IMAGE_COUNT,
+    PAYLOAD_IMAGE_ID_LENGTH,
+    PAYLOAD_IMAGE_ID,
+    PAYLOAD_IMAGE_LENGTH,
+    PAYLOAD_IMAGE_DATA,
+    PAYLOAD_IMAGE_SKIP,
+    PAYLOAD_DONE
+
+} payload_state_t;
+
+
+/* ==== CPU FEATURES ======================================================= */
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+#define CPU_FEATURE_AESNI           (1 << 0)
+#define CPU_FEATURE_SSSE3           (1 << 1)
+#define CPU_FEATURE_SHANI           (1 << 2)
+#define CPU_FEATURE_PCLMUL          (1 << 3)
+#define CPU_FEATURE_SSE2            (1 << 4)
+#define CPU_FEATURE_AVX2            (1 << 5)
+#define CPU_FEATURE_AVX512          (1 << 6)
+#define CPU_FEATURES_UNKNOWN        (1UL << 31)
+
+
+static uint32_t m_cpu_features = CPU_FEATURES_UNKNOWN;
+
+
+static uint64_t xgetbv(void)
+{
+    uint32_t eax, edx;
+
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+    return ((uint64_t) edx << 32) | eax;
+}
+
+
+static uint32_t cpu_features(void)
+{
+    uint32_t features = m_cpu_features;
+    unsigned int eax, ebx, ecx, edx;
+    uint64_t xcr0 = 0;
+    int sha_baseline;
+
+    if ( features != CPU_FEATURES_UNKNOWN ) return features;
+
+    features = 0;
+
+    if ( __get_cpuid(1, &eax, &ebx, &ecx, &edx) )
+    {
+        if ( ecx & bit_AES ) features |= CPU_FEATURE_AESNI;
+        if ( ecx & bit_SSSE3 ) features |= CPU_FEATURE_SSSE3;
+
+        if ( (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1) )
+            features |= CPU_FEATURE_PCLMUL;
+
+        if ( edx & bit_SSE2 ) features |= CPU_FEATURE_SSE2;
+
+        sha_baseline = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+
+        // AVX state has to be enabled by the OS as well (XCR0: YMM for
+        // AVX2, plus opmask and ZMM for AVX-512)
+        if ( ecx & bit_OSXSAVE ) xcr0 = xgetbv();
+
+        if ( __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) )
+        {
+            if ( sha_baseline && (ebx & bit_SHA) )
+                features |= CPU_FEATURE_SHANI;
+
+            if ( (ebx & bit_AVX2) && (xcr0 & 0x06) == 0x06 )
+                features |= CPU_FEATURE_AVX2;
+
+            if ( (ebx & bit_AVX512F) && (xcr0 & 0xE6) == 0xE6 )
+                features |= CPU_FEATURE_AVX512;
+        }
+    }
+
+    // detection is idempotent, so racing threads all store the same value
+    m_cpu_features = features;
+
+    return features;
+}
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+/* ==== STATISTICS ======================================================== */
+
+#ifdef FPK_ENABLE_STATISTICS
+
+static uint64_t stats_clock(fpk_context_t* ctx)
+{
+    if ( !ctx->hooks->read_clock ) return 0;
+    return ctx->hooks->read_clock(ctx->user_data);
+}
+
+
+static void stats_record(fpk_context_t* ctx, fpk_stat_t* stat,
+        uint64_t bytes, uint64_t start)
+{
+    stat->calls++;
+    stat->bytes += bytes;
+    stat->time += stats_clock(ctx) - start;
+}
+
+
+// STATS_BEGIN declares the start time, so each pair needs its own block.
+
+#define STATS_BEGIN(ctx)        uint64_t stats_start = stats_clock(ctx)
+#define STATS_END(ctx, stat, n) \
+    stats_record((ctx), &(ctx)->stats.stat, (n), stats_start)
+
+#else /* FPK_ENABLE_STATISTICS */
+
+#define STATS_BEGIN(ctx)
+#define STATS_END(ctx, stat, n)
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+
+/* ==== HELPERS ============================================================ */
+
+static uint16_t parse_u16(const uint8_t* buffer)
+{
+    return buffer[0] | (buffer[1] << 8);
+}
+
+
+static uint32_t parse_u32(const uint8_t* buffer)
+{
+    return (uint32_t) buffer[0] | ( (uint32_t) buffer[1] << 8) |
+            ( (uint32_t) buffer[2] << 16) | ( (uint32_t) buffer[3] << 24);
+}
+
 
 /* ==== CRC32 ============================================================== */
 
@@ -78,25 +261,557 @@ static const uint32_t CRC32_LUT[] =
 };
 
 
+#ifdef FPK_ENABLE_CRC32_SLICING
+
+static const uint32_t CRC32_SLICE_LUT[7][256] =
+{
+    {
+        0x00000000, 0x191b3141, 0x32366282, 0x2b2d53c3, 0x646cc504, 0x7d77f445,
+        0x565aa786, 0x4f4196c7, 0xc8d98a08, 0xd1c2bb49, 0xfaefe88a, 0xe3f4d9cb,
+        0xacb54f0c, 0xb5ae7e4d, 0x9e832d8e, 0x87981ccf, 0x4ac21251, 0x53d92310,
+        0x78f470d3, 0x61ef4192, 0x2eaed755, 0x37b5e614, 0x1c98b5d7, 0x05838496,
+        0x821b9859, 0x9b00a918, 0xb02dfadb, 0xa936cb9a, 0xe6775d5d, 0xff6c6c1c,
+        0xd4413fdf, 0xcd5a0e9e, 0x958424a2, 0x8c9f15e3, 0xa7b24620, 0xbea97761,
+        0xf1e8e1a6, 0xe8f3d0e7, 0xc3de8324, 0xdac5b265, 0x5d5daeaa, 0x44469feb,
+        0x6f6bcc28, 0x7670fd69, 0x39316bae, 0x202a5aef, 0x0b07092c, 0x121c386d,
+        0xdf4636f3, 0xc65d07b2, 0xed705471, 0xf46b6530, 0xbb2af3f7, 0xa231c2b6,
+        0x891c9175, 0x9007a034, 0x179fbcfb, 0x0e848dba, 0x25a9de79, 0x3cb2ef38,
+        0x73f379ff, 0x6ae848be, 0x41c51b7d, 0x58de2a3c, 0xf0794f05, 0xe9627e44,
+        0xc24f2d87, 0xdb541cc6, 0x94158a01, 0x8d0ebb40, 0xa623e883, 0xbf38d9c2,
+        0x38a0c50d, 0x21bbf44c, 0x0a96a78f, 0x138d96ce, 0x5ccc0009, 0x45d73148,
+        0x6efa628b, 0x77e153ca, 0xbabb5d54, 0xa3a06c15, 0x888d3fd6, 0x91960e97,
+        0xded79850, 0xc7cca911, 0xece1fad2, 0xf5facb93, 0x7262d75c, 0x6b79e61d,
+        0x4054b5de, 0x594f849f, 0x160e1258, 0x0f152319, 0x243870da, 0x3d23419b,
+        0x65fd6ba7, 0x7ce65ae6, 0x57cb0925, 0x4ed03864, 0x0191aea3, 0x188a9fe2,
+        0x33a7cc21, 0x2abcfd60, 0xad24e1af, 0xb43fd0ee, 0x9f12832d, 0x8609b26c,
+        0xc94824ab, 0xd05315ea, 0xfb7e4629, 0xe2657768, 0x2f3f79f6, 0x362448b7,
+        0x1d091b74, 0x04122a35, 0x4b53bcf2, 0x52488db3, 0x7965de70, 0x607eef31,
+        0xe7e6f3fe, 0xfefdc2bf, 0xd5d0917c, 0xcccba03d, 0x838a36fa, 0x9a9107bb,
+        0xb1bc5478, 0xa8a76539, 0x3b83984b, 0x2298a90a, 0x09b5fac9, 0x10aecb88,
+        0x5fef5d4f, 0x46f46c0e, 0x6dd93fcd, 0x74c20e8c, 0xf35a1243, 0xea412302,
+        0xc16c70c1, 0xd8774180, 0x9736d747, 0x8e2de606, 0xa500b5c5, 0xbc1b8484,
+        0x71418a1a, 0x685abb5b, 0x4377e898, 0x5a6cd9d9, 0x152d4f1e, 0x0c367e5f,
+        0x271b2d9c, 0x3e001cdd, 0xb9980012, 0xa0833153, 0x8bae6290, 0x92b553d1,
+        0xddf4c516, 0xc4eff457, 0xefc2a794, 0xf6d996d5, 0xae07bce9, 0xb71c8da8,
+        0x9c31de6b, 0x852aef2a, 0xca6b79ed, 0xd37048ac, 0xf85d1b6f, 0xe1462a2e,
+        0x66de36e1, 0x7fc507a0, 0x54e85463, 0x4df36522, 0x02b2f3e5, 0x1ba9c2a4,
+        0x30849167, 0x299fa026, 0xe4c5aeb8, 0xfdde9ff9, 0xd6f3cc3a, 0xcfe8fd7b,
+        0x80a96bbc, 0x99b25afd, 0xb29f093e, 0xab84387f, 0x2c1c24b0, 0x350715f1,
+        0x1e2a4632, 0x07317773, 0x4870e1b4, 0x516bd0f5, 0x7a468336, 0x635db277,
+        0xcbfad74e, 0xd2e1e60f, 0xf9ccb5cc, 0xe0d7848d, 0xaf96124a, 0xb68d230b,
+        0x9da070c8, 0x84bb4189, 0x03235d46, 0x1a386c07, 0x31153fc4, 0x280e0e85,
+        0x674f9842, 0x7e54a903, 0x5579fac0, 0x4c62cb81, 0x8138c51f, 0x9823f45e,
+        0xb30ea79d, 0xaa1596dc, 0xe554001b, 0xfc4f315a, 0xd7626299, 0xce7953d8,
+        0x49e14f17, 0x50fa7e56, 0x7bd72d95, 0x62cc1cd4, 0x2d8d8a13, 0x3496bb52,
+        0x1fbbe891, 0x06a0d9d0, 0x5e7ef3ec, 0x4765c2ad, 0x6c48916e, 0x7553a02f,
+        0x3a1236e8, 0x230907a9, 0x0824546a, 0x113f652b, 0x96a779e4, 0x8fbc48a5,
+        0xa4911b66, 0xbd8a2a27, 0xf2cbbce0, 0xebd08da1, 0xc0fdde62, 0xd9e6ef23,
+        0x14bce1bd, 0x0da7d0fc, 0x268a833f, 0x3f91b27e, 0x70d024b9, 0x69cb15f8,
+        0x42e6463b, 0x5bfd777a, 0xdc656bb5, 0xc57e5af4, 0xee530937, 0xf7483876,
+        0xb809aeb1, 0xa1129ff0, 0x8a3fcc33, 0x9324fd72
+    },
+    {
+        0x00000000, 0x01c26a37, 0x0384d46e, 0x0246be59, 0x0709a8dc, 0x06cbc2eb,
+        0x048d7cb2, 0x054f1685, 0x0e1351b8, 0x0fd13b8f, 0x0d9785d6, 0x0c55efe1,
+        0x091af964, 0x08d89353, 0x0a9e2d0a, 0x0b5c473d, 0x1c26a370, 0x1de4c947,
+        0x1fa2771e, 0x1e601d29, 0x1b2f0bac, 0x1aed619b, 0x18abdfc2, 0x1969b5f5,
+        0x1235f2c8, 0x13f798ff, 0x11b126a6, 0x10734c91, 0x153c5a14, 0x14fe3023,
+        0x16b88e7a, 0x177ae44d, 0x384d46e0, 0x398f2cd7, 0x3bc9928e, 0x3a0bf8b9,
+        0x3f44ee3c, 0x3e86840b, 0x3cc03a52, 0x3d025065, 0x365e1758, 0x379c7d6f,
+        0x35dac336, 0x3418a901, 0x3157bf84, 0x3095d5b3, 0x32d36bea, 0x331101dd,
+        0x246be590, 0x25a98fa7, 0x27ef31fe, 0x262d5bc9, 0x23624d4c, 0x22a0277b,
+        0x20e69922, 0x2124f315, 0x2a78b428, 0x2bbade1f, 0x29fc6046, 0x283e0a71,
+        0x2d711cf4, 0x2cb376c3, 0x2ef5c89a, 0x2f37a2ad, 0x709a8dc0, 0x7158e7f7,
+        0x731e59ae, 0x72dc3399, 0x7793251c, 0x76514f2b, 0x7417f172, 0x75d59b45,
+        0x7e89dc78, 0x7f4bb64f, 0x7d0d0816, 0x7ccf6221, 0x798074a4, 0x78421e93,
+        0x7a04a0ca, 0x7bc6cafd, 0x6cbc2eb0, 0x6d7e4487, 0x6f38fade, 0x6efa90e9,
+        0x6bb5866c, 0x6a77ec5b, 0x68315202, 0x69f33835, 0x62af7f08, 0x636d153f,
+        0x612bab66, 0x60e9c151, 0x65a6d7d4, 0x6464bde3, 0x662203ba, 0x67e0698d,
+        0x48d7cb20, 0x4915a117, 0x4b531f4e, 0x4a917579, 0x4fde63fc, 0x4e1c09cb,
+        0x4c5ab792, 0x4d98dda5, 0x46c49a98, 0x4706f0af, 0x45404ef6, 0x448224c1,
+        0x41cd3244, 0x400f5873, 0x4249e62a, 0x438b8c1d, 0x54f16850, 0x55330267,
+        0x5775bc3e, 0x56b7d609, 0x53f8c08c, 0x523aaabb, 0x507c14e2, 0x51be7ed5,
+        0x5ae239e8, 0x5b2053df, 0x5966ed86, 0x58a487b1, 0x5deb9134, 0x5c29fb03,
+        0x5e6f455a, 0x5fad2f6d, 0xe1351b80, 0xe0f771b7, 0xe2b1cfee, 0xe373a5d9,
+        0xe63cb35c, 0xe7fed96b, 0xe5b86732, 0xe47a0d05, 0xef264a38, 0xeee4200f,
+        0xeca29e56, 0xed60f461, 0xe82fe2e4, 0xe9ed88d3, 0xebab368a, 0xea695cbd,
+        0xfd13b8f0, 0xfcd1d2c7, 0xfe976c9e, 0xff5506a9, 0xfa1a102c, 0xfbd87a1b,
+        0xf99ec442, 0xf85cae75, 0xf300e948, 0xf2c2837f, 0xf0843d26, 0xf1465711,
+        0xf4094194, 0xf5cb2ba3, 0xf78d95fa, 0xf64fffcd, 0xd9785d60, 0xd8ba3757,
+        0xdafc890e, 0xdb3ee339, 0xde71f5bc, 0xdfb39f8b, 0xddf521d2, 0xdc374be5,
+        0xd76b0cd8, 0xd6a966ef, 0xd4efd8b6, 0xd52db281, 0xd062a404, 0xd1a0ce33,
+        0xd3e6706a, 0xd2241a5d, 0xc55efe10, 0xc49c9427, 0xc6da2a7e, 0xc7184049,
+        0xc25756cc, 0xc3953cfb, 0xc1d382a2, 0xc011e895, 0xcb4dafa8, 0xca8fc59f,
+        0xc8c97bc6, 0xc90b11f1, 0xcc440774, 0xcd866d43, 0xcfc0d31a, 0xce02b92d,
+        0x91af9640, 0x906dfc77, 0x922b422e, 0x93e92819, 0x96a63e9c, 0x976454ab,
+        0x9522eaf2, 0x94e080c5, 0x9fbcc7f8, 0x9e7eadcf, 0x9c381396, 0x9dfa79a1,
+        0x98b56f24, 0x99770513, 0x9b31bb4a, 0x9af3d17d, 0x8d893530, 0x8c4b5f07,
+        0x8e0de15e, 0x8fcf8b69, 0x8a809dec, 0x8b42f7db, 0x89044982, 0x88c623b5,
+        0x839a6488, 0x82580ebf, 0x801eb0e6, 0x81dcdad1, 0x8493cc54, 0x8551a663,
+        0x8717183a, 0x86d5720d, 0xa9e2d0a0, 0xa820ba97, 0xaa6604ce, 0xaba46ef9,
+        0xaeeb787c, 0xaf29124b, 0xad6fac12, 0xacadc625, 0xa7f18118, 0xa633eb2f,
+        0xa4755576, 0xa5b73f41, 0xa0f829c4, 0xa13a43f3, 0xa37cfdaa, 0xa2be979d,
+        0xb5c473d0, 0xb40619e7, 0xb640a7be, 0xb782cd89, 0xb2cddb0c, 0xb30fb13b,
+        0xb1490f62, 0xb08b6555, 0xbbd72268, 0xba15485f, 0xb853f606, 0xb9919c31,
+        0xbcde8ab4, 0xbd1ce083, 0xbf5a5eda, 0xbe9834ed
+    },
+    {
+        0x00000000, 0xb8bc6765, 0xaa09c88b, 0x12b5afee, 0x8f629757, 0x37def032,
+        0x256b5fdc, 0x9dd738b9, 0xc5b428ef, 0x7d084f8a, 0x6fbde064, 0xd7018701,
+        0x4ad6bfb8, 0xf26ad8dd, 0xe0df7733, 0x58631056, 0x5019579f, 0xe8a530fa,
+        0xfa109f14, 0x42acf871, 0xdf7bc0c8, 0x67c7a7ad, 0x75720843, 0xcdce6f26,
+        0x95ad7f70, 0x2d111815, 0x3fa4b7fb, 0x8718d09e, 0x1acfe827, 0xa2738f42,
+        0xb0c620ac, 0x087a47c9, 0xa032af3e, 0x188ec85b, 0x0a3b67b5, 0xb28700d0,
+        0x2f503869, 0x97ec5f0c, 0x8559f0e2, 0x3de59787, 0x658687d1, 0xdd3ae0b4,
+        0xcf8f4f5a, 0x7733283f, 0xeae41086, 0x525877e3, 0x40edd80d, 0xf851bf68,
+        0xf02bf8a1, 0x48979fc4, 0x5a22302a, 0xe29e574f, 0x7f496ff6, 0xc7f50893,
+        0xd540a77d, 0x6dfcc018, 0x359fd04e, 0x8d23b72b, 0x9f9618c5, 0x272a7fa0,
+        0xbafd4719, 0x0241207c, 0x10f48f92, 0xa848e8f7, 0x9b14583d, 0x23a83f58,
+        0x311d90b6, 0x89a1f7d3, 0x1476cf6a, 0xaccaa80f, 0xbe7f07e1, 0x06c36084,
+        0x5ea070d2, 0xe61c17b7, 0xf4a9b859, 0x4c15df3c, 0xd1c2e785, 0x697e80e0,
+        0x7bcb2f0e, 0xc377486b, 0xcb0d0fa2, 0x73b168c7, 0x6104c729, 0xd9b8a04c,
+        0x446f98f5, 0xfcd3ff90, 0xee66507e, 0x56da371b, 0x0eb9274d, 0xb6054028,
+        0xa4b0efc6, 0x1c0c88a3, 0x81dbb01a, 0x3967d77f, 0x2bd27891, 0x936e1ff4,
+        0x3b26f703, 0x839a9066, 0x912f3f88, 0x299358ed, 0xb4446054, 0x0cf80731,
+        0x1e4da8df, 0xa6f1cfba, 0xfe92dfec, 0x462eb889, 0x549b1767, 0xec277002,
+        0x71f048bb, 0xc94c2fde, 0xdbf98030, 0x6345e755, 0x6b3fa09c, 0xd383c7f9,
+        0xc1366817, 0x798a0f72, 0xe45d37cb, 0x5ce150ae, 0x4e54ff40, 0xf6e89825,
+        0xae8b8873, 0x1637ef16, 0x048240f8, 0xbc3e279d, 0x21e91f24, 0x99557841,
+        0x8be0d7af, 0x335cb0ca, 0xed59b63b, 0x55e5d15e, 0x47507eb0, 0xffec19d5,
+        0x623b216c, 0xda874609, 0xc832e9e7, 0x708e8e82, 0x28ed9ed4, 0x9051f9b1,
+        0x82e4565f, 0x3a58313a, 0xa78f0983, 0x1f336ee6, 0x0d86c108, 0xb53aa66d,
+        0xbd40e1a4, 0x05fc86c1, 0x1749292f, 0xaff54e4a, 0x322276f3, 0x8a9e1196,
+        0x982bbe78, 0x2097d91d, 0x78f4c94b, 0xc048ae2e, 0xd2fd01c0, 0x6a4166a5,
+        0xf7965e1c, 0x4f2a3979, 0x5d9f9697, 0xe523f1f2, 0x4d6b1905, 0xf5d77e60,
+        0xe762d18e, 0x5fdeb6eb, 0xc2098e52, 0x7ab5e937, 0x680046d9, 0xd0bc21bc,
+        0x88df31ea, 0x3063568f, 0x22d6f961, 0x9a6a9e04, 0x07bda6bd, 0xbf01c1d8,
+        0xadb46e36, 0x15080953, 0x1d724e9a, 0xa5ce29ff, 0xb77b8611, 0x0fc7e174,
+        0x9210d9cd, 0x2aacbea8, 0x38191146, 0x80a57623, 0xd8c66675, 0x607a0110,
+        0x72cfaefe, 0xca73c99b, 0x57a4f122, 0xef189647, 0xfdad39a9, 0x45115ecc,
+        0x764dee06, 0xcef18963, 0xdc44268d, 0x64f841e8, 0xf92f7951, 0x41931e34,
+        0x5326b1da, 0xeb9ad6bf, 0xb3f9c6e9, 0x0b45a18c, 0x19f00e62, 0xa14c6907,
+        0x3c9b51be, 0x842736db, 0x96929935, 0x2e2efe50, 0x2654b999, 0x9ee8defc,
+        0x8c5d7112, 0x34e11677, 0xa9362ece, 0x118a49ab, 0x033fe645, 0xbb838120,
+        0xe3e09176, 0x5b5cf613, 0x49e959fd, 0xf1553e98, 0x6c820621, 0xd43e6144,
+        0xc68bceaa, 0x7e37a9cf, 0xd67f4138, 0x6ec3265d, 0x7c7689b3, 0xc4caeed6,
+        0x591dd66f, 0xe1a1b10a, 0xf3141ee4, 0x4ba87981, 0x13cb69d7, 0xab770eb2,
+        0xb9c2a15c, 0x017ec639, 0x9ca9fe80, 0x241599e5, 0x36a0360b, 0x8e1c516e,
+        0x866616a7, 0x3eda71c2, 0x2c6fde2c, 0x94d3b949, 0x090481f0, 0xb1b8e695,
+        0xa30d497b, 0x1bb12e1e, 0x43d23e48, 0xfb6e592d, 0xe9dbf6c3, 0x516791a6,
+        0xccb0a91f, 0x740cce7a, 0x66b96194, 0xde0506f1
+    },
+    {
+        0x00000000, 0x3d6029b0, 0x7ac05360, 0x47a07ad0, 0xf580a6c0, 0xc8e08f70,
+        0x8f40f5a0, 0xb220dc10, 0x30704bc1, 0x0d106271, 0x4ab018a1, 0x77d03111,
+        0xc5f0ed01, 0xf890c4b1, 0xbf30be61, 0x825097d1, 0x60e09782, 0x5d80be32,
+        0x1a20c4e2, 0x2740ed52, 0x95603142, 0xa80018f2, 0xefa06222, 0xd2c04b92,
+        0x5090dc43, 0x6df0f5f3, 0x2a508f23, 0x1730a693, 0xa5107a83, 0x98705333,
+        0xdfd029e3, 0xe2b00053, 0xc1c12f04, 0xfca106b4, 0xbb017c64, 0x866155d4,
+        0x344189c4, 0x0921a074, 0x4e81daa4, 0x73e1f314, 0xf1b164c5, 0xccd14d75,
+        0x8b7137a5, 0xb6111e15, 0x0431c205, 0x3951ebb5, 0x7ef19165, 0x4391b8d5,
+        0xa121b886, 0x9c419136, 0xdbe1ebe6, 0xe681c256, 0x54a11e46, 0x69c137f6,
+        0x2e614d26, 0x13016496, 0x9151f347, 0xac31daf7, 0xeb91a027, 0xd6f18997,
+        0x64d15587, 0x59b17c37, 0x1e1106e7, 0x23712f57, 0x58f35849, 0x659371f9,
+        0x22330b29, 0x1f532299, 0xad73fe89, 0x9013d739, 0xd7b3ade9, 0xead38459,
+        0x68831388, 0x55e33a38, 0x124340e8, 0x2f236958, 0x9d03b548, 0xa0639cf8,
+        0xe7c3e628, 0xdaa3cf98, 0x3813cfcb, 0x0573e67b, 0x42d39cab, 0x7fb3b51b,
+        0xcd93690b, 0xf0f340bb, 0xb7533a6b, 0x8a3313db, 0x0863840a, 0x3503adba,
+        0x72a3d76a, 0x4fc3feda, 0xfde322ca, 0xc0830b7a, 0x872371aa, 0xba43581a,
+        0x9932774d, 0xa4525efd, 0xe3f2242d, 0xde920d9d, 0x6cb2d18d, 0x51d2f83d,
+        0x167282ed, 0x2b12ab5d, 0xa9423c8c, 0x9422153c, 0xd3826fec, 0xeee2465c,
+        0x5cc29a4c, 0x61a2b3fc, 0x2602c92c, 0x1b62e09c, 0xf9d2e0cf, 0xc4b2c97f,
+        0x8312b3af, 0xbe729a1f, 0x0c52460f, 0x31326fbf, 0x7692156f, 0x4bf23cdf,
+        0xc9a2ab0e, 0xf4c282be, 0xb362f86e, 0x8e02d1de, 0x3c220dce, 0x0142247e,
+        0x46e25eae, 0x7b82771e, 0xb1e6b092, 0x8c869922, 0xcb26e3f2, 0xf646ca42,
+        0x44661652, 0x79063fe2, 0x3ea64532, 0x03c66c82, 0x8196fb53, 0xbcf6d2e3,
+        0xfb56a833, 0xc6368183, 0x74165d93, 0x49767423, 0x0ed60ef3, 0x33b62743,
+        0xd1062710, 0xec660ea0, 0xabc67470, 0x96a65dc0, 0x248681d0, 0x19e6a860,
+        0x5e46d2b0, 0x6326fb00, 0xe1766cd1, 0xdc164561, 0x9bb63fb1, 0xa6d61601,
+        0x14f6ca11, 0x2996e3a1, 0x6e369971, 0x5356b0c1, 0x70279f96, 0x4d47b626,
+        0x0ae7ccf6, 0x3787e546, 0x85a73956, 0xb8c710e6, 0xff676a36, 0xc2074386,
+        0x4057d457, 0x7d37fde7, 0x3a978737, 0x07f7ae87, 0xb5d77297, 0x88b75b27,
+        0xcf1721f7, 0xf2770847, 0x10c70814, 0x2da721a4, 0x6a075b74, 0x576772c4,
+        0xe547aed4, 0xd8278764, 0x9f87fdb4, 0xa2e7d404, 0x20b743d5, 0x1dd76a65,
+        0x5a7710b5, 0x67173905, 0xd537e515, 0xe857cca5, 0xaff7b675, 0x92979fc5,
+        0xe915e8db, 0xd475c16b, 0x93d5bbbb, 0xaeb5920b, 0x1c954e1b, 0x21f567ab,
+        0x66551d7b, 0x5b3534cb, 0xd965a31a, 0xe4058aaa, 0xa3a5f07a, 0x9ec5d9ca,
+        0x2ce505da, 0x11852c6a, 0x562556ba, 0x6b457f0a, 0x89f57f59, 0xb49556e9,
+        0xf3352c39, 0xce550589, 0x7c75d999, 0x4115f029, 0x06b58af9, 0x3bd5a349,
+        0xb9853498, 0x84e51d28, 0xc34567f8, 0xfe254e48, 0x4c059258, 0x7165bbe8,
+        0x36c5c138, 0x0ba5e888, 0x28d4c7df, 0x15b4ee6f, 0x521494bf, 0x6f74bd0f,
+        0xdd54611f, 0xe03448af, 0xa794327f, 0x9af41bcf, 0x18a48c1e, 0x25c4a5ae,
+        0x6264df7e, 0x5f04f6ce, 0xed242ade, 0xd044036e, 0x97e479be, 0xaa84500e,
+        0x4834505d, 0x755479ed, 0x32f4033d, 0x0f942a8d, 0xbdb4f69d, 0x80d4df2d,
+        0xc774a5fd, 0xfa148c4d, 0x78441b9c, 0x4524322c, 0x028448fc, 0x3fe4614c,
+        0x8dc4bd5c, 0xb0a494ec, 0xf704ee3c, 0xca64c78c
+    },
+    {
+        0x00000000, 0xcb5cd3a5, 0x4dc8a10b, 0x869472ae, 0x9b914216, 0x50cd91b3,
+        0xd659e31d, 0x1d0530b8, 0xec53826d, 0x270f51c8, 0xa19b2366, 0x6ac7f0c3,
+        0x77c2c07b, 0xbc9e13de, 0x3a0a6170, 0xf156b2d5, 0x03d6029b, 0xc88ad13e,
+        0x4e1ea390, 0x85427035, 0x9847408d, 0x531b9328, 0xd58fe186, 0x1ed33223,
+        0xef8580f6, 0x24d95353, 0xa24d21fd, 0x6911f258, 0x7414c2e0, 0xbf481145,
+        0x39dc63eb, 0xf280b04e, 0x07ac0536, 0xccf0d693, 0x4a64a43d, 0x81387798,
+        0x9c3d4720, 0x57619485, 0xd1f5e62b, 0x1aa9358e, 0xebff875b, 0x20a354fe,
+        0xa6372650, 0x6d6bf5f5, 0x706ec54d, 0xbb3216e8, 0x3da66446, 0xf6fab7e3,
+        0x047a07ad, 0xcf26d408, 0x49b2a6a6, 0x82ee7503, 0x9feb45bb, 0x54b7961e,
+        0xd223e4b0, 0x197f3715, 0xe82985c0, 0x23755665, 0xa5e124cb, 0x6ebdf76e,
+        0x73b8c7d6, 0xb8e41473, 0x3e7066dd, 0xf52cb578, 0x0f580a6c, 0xc404d9c9,
+        0x4290ab67, 0x89cc78c2, 0x94c9487a, 0x5f959bdf, 0xd901e971, 0x125d3ad4,
+        0xe30b8801, 0x28575ba4, 0xaec3290a, 0x659ffaaf, 0x789aca17, 0xb3c619b2,
+        0x35526b1c, 0xfe0eb8b9, 0x0c8e08f7, 0xc7d2db52, 0x4146a9fc, 0x8a1a7a59,
+        0x971f4ae1, 0x5c439944, 0xdad7ebea, 0x118b384f, 0xe0dd8a9a, 0x2b81593f,
+        0xad152b91, 0x6649f834, 0x7b4cc88c, 0xb0101b29, 0x36846987, 0xfdd8ba22,
+        0x08f40f5a, 0xc3a8dcff, 0x453cae51, 0x8e607df4, 0x93654d4c, 0x58399ee9,
+        0xdeadec47, 0x15f13fe2, 0xe4a78d37, 0x2ffb5e92, 0xa96f2c3c, 0x6233ff99,
+        0x7f36cf21, 0xb46a1c84, 0x32fe6e2a, 0xf9a2bd8f, 0x0b220dc1, 0xc07ede64,
+        0x46eaacca, 0x8db67f6f, 0x90b34fd7, 0x5bef9c72, 0xdd7beedc, 0x16273d79,
+        0xe7718fac, 0x2c2d5c09, 0xaab92ea7, 0x61e5fd02, 0x7ce0cdba, 0xb7bc1e1f,
+        0x31286cb1, 0xfa74bf14, 0x1eb014d8, 0xd5ecc77d, 0x5378b5d3, 0x98246676,
+        0x852156ce, 0x4e7d856b, 0xc8e9f7c5, 0x03b52460, 0xf2e396b5, 0x39bf4510,
+        0xbf2b37be, 0x7477e41b, 0x6972d4a3, 0xa22e0706, 0x24ba75a8, 0xefe6a60d,
+        0x1d661643, 0xd63ac5e6, 0x50aeb748, 0x9bf264ed, 0x86f75455, 0x4dab87f0,
+        0xcb3ff55e, 0x006326fb, 0xf135942e, 0x3a69478b, 0xbcfd3525, 0x77a1e680,
+        0x6aa4d638, 0xa1f8059d, 0x276c7733, 0xec30a496, 0x191c11ee, 0xd240c24b,
+        0x54d4b0e5, 0x9f886340, 0x828d53f8, 0x49d1805d, 0xcf45f2f3, 0x04192156,
+        0xf54f9383, 0x3e134026, 0xb8873288, 0x73dbe12d, 0x6eded195, 0xa5820230,
+        0x2316709e, 0xe84aa33b, 0x1aca1375, 0xd196c0d0, 0x5702b27e, 0x9c5e61db,
+        0x815b5163, 0x4a0782c6, 0xcc93f068, 0x07cf23cd, 0xf6999118, 0x3dc542bd,
+        0xbb513013, 0x700de3b6, 0x6d08d30e, 0xa65400ab, 0x20c07205, 0xeb9ca1a0,
+        0x11e81eb4, 0xdab4cd11, 0x5c20bfbf, 0x977c6c1a, 0x8a795ca2, 0x41258f07,
+        0xc7b1fda9, 0x0ced2e0c, 0xfdbb9cd9, 0x36e74f7c, 0xb0733dd2, 0x7b2fee77,
+        0x662adecf, 0xad760d6a, 0x2be27fc4, 0xe0beac61, 0x123e1c2f, 0xd962cf8a,
+        0x5ff6bd24, 0x94aa6e81, 0x89af5e39, 0x42f38d9c, 0xc467ff32, 0x0f3b2c97,
+        0xfe6d9e42, 0x35314de7, 0xb3a53f49, 0x78f9ecec, 0x65fcdc54, 0xaea00ff1,
+        0x28347d5f, 0xe368aefa, 0x16441b82, 0xdd18c827, 0x5b8cba89, 0x90d0692c,
+        0x8dd55994, 0x46898a31, 0xc01df89f, 0x0b412b3a, 0xfa1799ef, 0x314b4a4a,
+        0xb7df38e4, 0x7c83eb41, 0x6186dbf9, 0xaada085c, 0x2c4e7af2, 0xe712a957,
+        0x15921919, 0xdececabc, 0x585ab812, 0x93066bb7, 0x8e035b0f, 0x455f88aa,
+        0xc3cbfa04, 0x089729a1, 0xf9c19b74, 0x329d48d1, 0xb4093a7f, 0x7f55e9da,
+        0x6250d962, 0xa90c0ac7, 0x2f987869, 0xe4c4abcc
+    },
+    {
+        0x00000000, 0xa6770bb4, 0x979f1129, 0x31e81a9d, 0xf44f2413, 0x52382fa7,
+        0x63d0353a, 0xc5a73e8e, 0x33ef4e67, 0x959845d3, 0xa4705f4e, 0x020754fa,
+        0xc7a06a74, 0x61d761c0, 0x503f7b5d, 0xf64870e9, 0x67de9cce, 0xc1a9977a,
+        0xf0418de7, 0x56368653, 0x9391b8dd, 0x35e6b369, 0x040ea9f4, 0xa279a240,
+        0x5431d2a9, 0xf246d91d, 0xc3aec380, 0x65d9c834, 0xa07ef6ba, 0x0609fd0e,
+        0x37e1e793, 0x9196ec27, 0xcfbd399c, 0x69ca3228, 0x582228b5, 0xfe552301,
+        0x3bf21d8f, 0x9d85163b, 0xac6d0ca6, 0x0a1a0712, 0xfc5277fb, 0x5a257c4f,
+        0x6bcd66d2, 0xcdba6d66, 0x081d53e8, 0xae6a585c, 0x9f8242c1, 0x39f54975,
+        0xa863a552, 0x0e14aee6, 0x3ffcb47b, 0x998bbfcf, 0x5c2c8141, 0xfa5b8af5,
+        0xcbb39068, 0x6dc49bdc, 0x9b8ceb35, 0x3dfbe081, 0x0c13fa1c, 0xaa64f1a8,
+        0x6fc3cf26, 0xc9b4c492, 0xf85cde0f, 0x5e2bd5bb, 0x440b7579, 0xe27c7ecd,
+        0xd3946450, 0x75e36fe4, 0xb044516a, 0x16335ade, 0x27db4043, 0x81ac4bf7,
+        0x77e43b1e, 0xd19330aa, 0xe07b2a37, 0x460c2183, 0x83ab1f0d, 0x25dc14b9,
+        0x14340e24, 0xb2430590, 0x23d5e9b7, 0x85a2e203, 0xb44af89e, 0x123df32a,
+        0xd79acda4, 0x71edc610, 0x4005dc8d, 0xe672d739, 0x103aa7d0, 0xb64dac64,
+        0x87a5b6f9, 0x21d2bd4d, 0xe47583c3, 0x42028877, 0x73ea92ea, 0xd59d995e,
+        0x8bb64ce5, 0x2dc14751, 0x1c295dcc, 0xba5e5678, 0x7ff968f6, 0xd98e6342,
+        0xe86679df, 0x4e11726b, 0xb8590282, 0x1e2e0936, 0x2fc613ab, 0x89b1181f,
+        0x4c162691, 0xea612d25, 0xdb8937b8, 0x7dfe3c0c, 0xec68d02b, 0x4a1fdb9f,
+        0x7bf7c102, 0xdd80cab6, 0x1827f438, 0xbe50ff8c, 0x8fb8e511, 0x29cfeea5,
+        0xdf879e4c, 0x79f095f8, 0x48188f65, 0xee6f84d1, 0x2bc8ba5f, 0x8dbfb1eb,
+        0xbc57ab76, 0x1a20a0c2, 0x8816eaf2, 0x2e61e146, 0x1f89fbdb, 0xb9fef06f,
+        0x7c59cee1, 0xda2ec555, 0xebc6dfc8, 0x4db1d47c, 0xbbf9a495, 0x1d8eaf21,
+        0x2c66b5bc, 0x8a11be08, 0x4fb68086, 0xe9c18b32, 0xd82991af, 0x7e5e9a1b,
+        0xefc8763c, 0x49bf7d88, 0x78576715, 0xde206ca1, 0x1b87522f, 0xbdf0599b,
+        0x8c184306, 0x2a6f48b2, 0xdc27385b, 0x7a5033ef, 0x4bb82972, 0xedcf22c6,
+        0x28681c48, 0x8e1f17fc, 0xbff70d61, 0x198006d5, 0x47abd36e, 0xe1dcd8da,
+        0xd034c247, 0x7643c9f3, 0xb3e4f77d, 0x1593fcc9, 0x247be654, 0x820cede0,
+        0x74449d09, 0xd23396bd, 0xe3db8c20, 0x45ac8794, 0x800bb91a, 0x267cb2ae,
+        0x1794a833, 0xb1e3a387, 0x20754fa0, 0x86024414, 0xb7ea5e89, 0x119d553d,
+        0xd43a6bb3, 0x724d6007, 0x43a57a9a, 0xe5d2712e, 0x139a01c7, 0xb5ed0a73,
+        0x840510ee, 0x22721b5a, 0xe7d525d4, 0x41a22e60, 0x704a34fd, 0xd63d3f49,
+        0xcc1d9f8b, 0x6a6a943f, 0x5b828ea2, 0xfdf58516, 0x3852bb98, 0x9e25b02c,
+        0xafcdaab1, 0x09baa105, 0xfff2d1ec, 0x5985da58, 0x686dc0c5, 0xce1acb71,
+        0x0bbdf5ff, 0xadcafe4b, 0x9c22e4d6, 0x3a55ef62, 0xabc30345, 0x0db408f1,
+        0x3c5c126c, 0x9a2b19d8, 0x5f8c2756, 0xf9fb2ce2, 0xc813367f, 0x6e643dcb,
+        0x982c4d22, 0x3e5b4696, 0x0fb35c0b, 0xa9c457bf, 0x6c636931, 0xca146285,
+        0xfbfc7818, 0x5d8b73ac, 0x03a0a617, 0xa5d7ada3, 0x943fb73e, 0x3248bc8a,
+        0xf7ef8204, 0x519889b0, 0x6070932d, 0xc6079899, 0x304fe870, 0x9638e3c4,
+        0xa7d0f959, 0x01a7f2ed, 0xc400cc63, 0x6277c7d7, 0x539fdd4a, 0xf5e8d6fe,
+        0x647e3ad9, 0xc209316d, 0xf3e12bf0, 0x55962044, 0x90311eca, 0x3646157e,
+        0x07ae0fe3, 0xa1d90457, 0x579174be, 0xf1e67f0a, 0xc00e6597, 0x66796e23,
+        0xa3de50ad, 0x05a95b19, 0x34414184, 0x92364a30
+    },
+    {
+        0x00000000, 0xccaa009e, 0x4225077d, 0x8e8f07e3, 0x844a0efa, 0x48e00e64,
+        0xc66f0987, 0x0ac50919, 0xd3e51bb5, 0x1f4f1b2b, 0x91c01cc8, 0x5d6a1c56,
+        0x57af154f, 0x9b0515d1, 0x158a1232, 0xd92012ac, 0x7cbb312b, 0xb01131b5,
+        0x3e9e3656, 0xf23436c8, 0xf8f13fd1, 0x345b3f4f, 0xbad438ac, 0x767e3832,
+        0xaf5e2a9e, 0x63f42a00, 0xed7b2de3, 0x21d12d7d, 0x2b142464, 0xe7be24fa,
+        0x69312319, 0xa59b2387, 0xf9766256, 0x35dc62c8, 0xbb53652b, 0x77f965b5,
+        0x7d3c6cac, 0xb1966c32, 0x3f196bd1, 0xf3b36b4f, 0x2a9379e3, 0xe639797d,
+        0x68b67e9e, 0xa41c7e00, 0xaed97719, 0x62737787, 0xecfc7064, 0x205670fa,
+        0x85cd537d, 0x496753e3, 0xc7e85400, 0x0b42549e, 0x01875d87, 0xcd2d5d19,
+        0x43a25afa, 0x8f085a64, 0x562848c8, 0x9a824856, 0x140d4fb5, 0xd8a74f2b,
+        0xd2624632, 0x1ec846ac, 0x9047414f, 0x5ced41d1, 0x299dc2ed, 0xe537c273,
+        0x6bb8c590, 0xa712c50e, 0xadd7cc17, 0x617dcc89, 0xeff2cb6a, 0x2358cbf4,
+        0xfa78d958, 0x36d2d9c6, 0xb85dde25, 0x74f7debb, 0x7e32d7a2, 0xb298d73c,
+        0x3c17d0df, 0xf0bdd041, 0x5526f3c6, 0x998cf358, 0x1703f4bb, 0xdba9f425,
+        0xd16cfd3c, 0x1dc6fda2, 0x9349fa41, 0x5fe3fadf, 0x86c3e873, 0x4a69e8ed,
+        0xc4e6ef0e, 0x084cef90, 0x0289e689, 0xce23e617, 0x40ace1f4, 0x8c06e16a,
+        0xd0eba0bb, 0x1c41a025, 0x92cea7c6, 0x5e64a758, 0x54a1ae41, 0x980baedf,
+        0x1684a93c, 0xda2ea9a2, 0x030ebb0e, 0xcfa4bb90, 0x412bbc73, 0x8d81bced,
+        0x8744b5f4, 0x4beeb56a, 0xc561b289, 0x09cbb217, 0xac509190, 0x60fa910e,
+        0xee7596ed, 0x22df9673, 0x281a9f6a, 0xe4b09ff4, 0x6a3f9817, 0xa6959889,
+        0x7fb58a25, 0xb31f8abb, 0x3d908d58, 0xf13a8dc6, 0xfbff84df, 0x37558441,
+        0xb9da83a2, 0x7570833c, 0x533b85da, 0x9f918544, 0x111e82a7, 0xddb48239,
+        0xd7718b20, 0x1bdb8bbe, 0x95548c5d, 0x59fe8cc3, 0x80de9e6f, 0x4c749ef1,
+        0xc2fb9912, 0x0e51998c, 0x04949095, 0xc83e900b, 0x46b197e8, 0x8a1b9776,
+        0x2f80b4f1, 0xe32ab46f, 0x6da5b38c, 0xa10fb312, 0xabcaba0b, 0x6760ba95,
+        0xe9efbd76, 0x2545bde8, 0xfc65af44, 0x30cfafda, 0xbe40a839, 0x72eaa8a7,
+        0x782fa1be, 0xb485a120, 0x3a0aa6c3, 0xf6a0a65d, 0xaa4de78c, 0x66e7e712,
+        0xe868e0f1, 0x24c2e06f, 0x2e07e976, 0xe2ade9e8, 0x6c22ee0b, 0xa088ee95,
+        0x79a8fc39, 0xb502fca7, 0x3b8dfb44, 0xf727fbda, 0xfde2f2c3, 0x3148f25d,
+        0xbfc7f5be, 0x736df520, 0xd6f6d6a7, 0x1a5cd639, 0x94d3d1da, 0x5879d144,
+        0x52bcd85d, 0x9e16d8c3, 0x1099df20, 0xdc33dfbe, 0x0513cd12, 0xc9b9cd8c,
+        0x4736ca6f, 0x8b9ccaf1, 0x8159c3e8, 0x4df3c376, 0xc37cc495, 0x0fd6c40b,
+        0x7aa64737, 0xb60c47a9, 0x3883404a, 0xf42940d4, 0xfeec49cd, 0x32464953,
+        0xbcc94eb0, 0x70634e2e, 0xa9435c82, 0x65e95c1c, 0xeb665bff, 0x27cc5b61,
+        0x2d095278, 0xe1a352e6, 0x6f2c5505, 0xa386559b, 0x061d761c, 0xcab77682,
+        0x44387161, 0x889271ff, 0x825778e6, 0x4efd7878, 0xc0727f9b, 0x0cd87f05,
+        0xd5f86da9, 0x19526d37, 0x97dd6ad4, 0x5b776a4a, 0x51b26353, 0x9d1863cd,
+        0x1397642e, 0xdf3d64b0, 0x83d02561, 0x4f7a25ff, 0xc1f5221c, 0x0d5f2282,
+        0x079a2b9b, 0xcb302b05, 0x45bf2ce6, 0x89152c78, 0x50353ed4, 0x9c9f3e4a,
+        0x121039a9, 0xdeba3937, 0xd47f302e, 0x18d530b0, 0x965a3753, 0x5af037cd,
+        0xff6b144a, 0x33c114d4, 0xbd4e1337, 0x71e413a9, 0x7b211ab0, 0xb78b1a2e,
+        0x39041dcd, 0xf5ae1d53, 0x2c8e0fff, 0xe0240f61, 0x6eab0882, 0xa201081c,
+        0xa8c40105, 0x646e019b, 0xeae10678, 0x264b06e6
+    }
+};
+
+#endif /* FPK_ENABLE_CRC32_SLICING */
+
+
 static void crc32_reset(fpk_context_t* ctx)
 {
     ctx->crc32 = 0xFFFFFFFFUL;
 }
 
 
+#ifdef FPK_ENABLE_CRC32_SLICING
+
+// Slicing-by-8 folds eight input bytes into the CRC per iteration, using
+// tables that give the effect of each byte position on the CRC.
+
+static uint32_t crc32_slice_by_8(uint32_t crc, const uint8_t* data,
+        size_t length)
+{
+    const uint32_t (*lut)[256] = CRC32_SLICE_LUT;
+    uint32_t lo;
+    uint32_t hi;
+
+    while (length >= 8)
+    {
+        lo = crc ^ parse_u32(data);
+        hi = parse_u32(data + 4);
+
+        crc = lut[6][lo & 0xFF] ^ lut[5][(lo >> 8) & 0xFF] ^
+                lut[4][(lo >> 16) & 0xFF] ^ lut[3][lo >> 24] ^
+                lut[2][hi & 0xFF] ^ lut[1][(hi >> 8) & 0xFF] ^
+                lut[0][(hi >> 16) & 0xFF] ^ CRC32_LUT[hi >> 24];
+
+        data += 8;
+        length -= 8;
+    }
+
+    while (length--)
+    {
+        crc = CRC32_LUT[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#endif /* FPK_ENABLE_CRC32_SLICING */
+
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+// Folds 64 bytes at a time with carry-less multiplication, then reduces
+// to 32 bits with a Barrett reduction (Intel, "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction"). length must be a
+// multiple of 16 and at least 64.
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data,
+        size_t length)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000LL, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*) data);
+    x2 = _mm_loadu_si128((const __m128i*) (data + 16));
+    x3 = _mm_loadu_si128((const __m128i*) (data + 32));
+    x4 = _mm_loadu_si128((const __m128i*) (data + 48));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    data += 64;
+    length -= 64;
+
+    while (length >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                _mm_loadu_si128((const __m128i*) data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                _mm_loadu_si128((const __m128i*) (data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                _mm_loadu_si128((const __m128i*) (data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                _mm_loadu_si128((const __m128i*) (data + 48)));
+
+        data += 64;
+        length -= 64;
+    }
+
+    // fold the four lanes into one
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (length >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1,
+                _mm_loadu_si128((const __m128i*) data)), x5);
+
+        data += 16;
+        length -= 16;
+    }
+
+    // fold 128 bits down to 64
+
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction down to 32 bits
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+// Runs the raw CRC register (the complement of what ctx->crc32 holds) over
+// data.
+
+static uint32_t crc32_compute(uint32_t crc, const uint8_t* data,
+        size_t length)
+{
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+    if ( length >= 64 && (cpu_features() & CPU_FEATURE_PCLMUL) )
+    {
+        size_t n = length & ~(size_t) 15;
+
+        crc = crc32_pclmul(crc, data, n);
+        data += n;
+        length -= n;
+    }
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+#ifdef FPK_ENABLE_CRC32_SLICING
+
+    return crc32_slice_by_8(crc, data, length);
+
+#else /* FPK_ENABLE_CRC32_SLICING */
+
+    while (length--)
+    {
+        crc = CRC32_LUT[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+
+#endif /* FPK_ENABLE_CRC32_SLICING */
+}
+
+
 static void crc32_update(fpk_context_t* ctx, const uint8_t* data,
-        uint32_t length)
+        size_t length)
 {
-    const uint8_t* i = data;
-    const uint8_t* e = data + length;
-    uint32_t crc = ~ctx->crc32;
-    
-    while (i != e)
+    ctx->crc32 = ~crc32_compute(~ctx->crc32, data, length);
+}
+
+
+// Multiplies two polynomials modulo the CRC polynomial, in the same bit
+// reflected representation the CRC register uses (after zlib).
+
+static uint32_t crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1UL << 31;
+    uint32_t p = 0;
+
+    while (m != 0)
     {
-        crc = CRC32_LUT[(crc ^ *i++) & 0xFF] ^ (crc >> 8);
+        if ( a & m ) p ^= b;
+
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320UL : b >> 1;
     }
-    
-    ctx->crc32 = ~crc;
+
+    return p;
+}
+
+
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t length2)
+{
+    uint32_t shift = 1UL << 31;
+    uint32_t square = 1UL << 23;
+
+    // shift = x^(8 * length2), built up from repeated squares of x^8
+
+    while (length2 != 0)
+    {
+        if ( length2 & 1 ) shift = crc32_multiply(square, shift);
+
+        square = crc32_multiply(square, square);
+        length2 >>= 1;
+    }
+
+    // the first CRC's register is carried through the second region; the
+    // second CRC already accounts for the register starting at zero
+
+    return crc32_multiply(shift, ~crc1) ^ crc2;
 }
 
 
@@ -151,76 +866,391 @@ static void sha256_reset(fpk_context_t* ctx)
 }
 
 
-static void sha256_transform(fpk_context_t* ctx)
+// The message schedule is kept as a rolling window of its last sixteen
+// words, each computed just before the round that needs it.
+
+static void sha256_transform_generic(fpk_context_t* ctx, const uint8_t* data,
+        size_t n_blocks)
 {
     uint32_t* state = ctx->sha256_state;
-    uint32_t* m = ctx->sha256_m;
-    uint8_t* buffer = ctx->sha256_buffer;
+    uint32_t m[16];
     uint32_t a, b, c, d, e, f, g, h, i, j, t1, t2;
     
-    for (i = 0, j = 0; i < 16; ++i, j += 4)
+    for (; n_blocks > 0; n_blocks--, data += 64)
     {
-        m[i] = (buffer[j] << 24) | (buffer[j + 1] << 16) |
-                (buffer[j + 2] << 8) | (buffer[j + 3]);
+        for (i = 0, j = 0; i < 16; ++i, j += 4)
+        {
+            m[i] = ((uint32_t) data[j] << 24) | (data[j + 1] << 16) |
+                    (data[j + 2] << 8) | (data[j + 3]);
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; i += 16)
+        {
+            for (j = 0; j < 16; ++j)
+            {
+                if ( i > 0 )
+                {
+                    m[j] += SIG1(m[(j + 14) & 15]) + m[(j + 9) & 15] +
+                            SIG0(m[(j + 1) & 15]);
+                }
+
+                t1 = h + EP1(e) + CH(e,f,g) + k[i + j] + m[j];
+                t2 = EP0(a) + MAJ(a,b,c);
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
     }
+}
+
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+#define SSE_ROTRIGHT(x,n) \
+    _mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+#define SSE_SIG0(x) _mm_xor_si128(_mm_xor_si128(SSE_ROTRIGHT((x), 7), \
+    SSE_ROTRIGHT((x), 18)), _mm_srli_epi32((x), 3))
+
+#define SSE_SIG1(x) _mm_xor_si128(_mm_xor_si128(SSE_ROTRIGHT((x), 17), \
+    SSE_ROTRIGHT((x), 19)), _mm_srli_epi32((x), 10))
+
+
+// Computes the message schedule four words at a time with SSSE3 and leaves
+// only the compression rounds to scalar code.
+
+__attribute__((target("ssse3")))
+static void sha256_transform_ssse3(fpk_context_t* ctx, const uint8_t* data,
+        size_t n_blocks)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+            4, 5, 6, 7, 0, 1, 2, 3);
+    uint32_t* state = ctx->sha256_state;
+    uint32_t m[64];
+    uint32_t a, b, c, d, e, f, g, h, i, t1, t2;
+    __m128i w[4];
+    __m128i s0, s1, t;
     
-    for (; i < 64; ++i)
+    for (; n_blocks > 0; n_blocks--, data += 64)
     {
-        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+        for (i = 0; i < 4; i++)
+        {
+            w[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (data + i * 16)),
+                bswap
+            );
+
+            _mm_storeu_si128((__m128i*) (m + i * 4), _mm_add_epi32(w[i],
+                    _mm_loadu_si128((const __m128i*) (k + i * 4))));
+        }
+
+        // w[0..3] hold the last sixteen schedule words; each iteration
+        // replaces the oldest four
+
+        for (i = 16; i < 64; i += 4)
+        {
+            s0 = _mm_alignr_epi8(w[1], w[0], 4);
+            t = _mm_add_epi32(w[0], SSE_SIG0(s0));
+            t = _mm_add_epi32(t, _mm_alignr_epi8(w[3], w[2], 4));
+
+            // SIG1 of m[i + 2] and m[i + 3] depends on m[i] and m[i + 1],
+            // so the upper pair has to wait for the lower one
+
+            s1 = SSE_SIG1(_mm_srli_si128(w[3], 8));
+            t = _mm_add_epi32(t, s1);
+            s1 = SSE_SIG1(_mm_slli_si128(t, 8));
+            t = _mm_add_epi32(t, _mm_and_si128(s1,
+                    _mm_set_epi32(-1, -1, 0, 0)));
+
+            w[0] = w[1];
+            w[1] = w[2];
+            w[2] = w[3];
+            w[3] = t;
+
+            _mm_storeu_si128((__m128i*) (m + i), _mm_add_epi32(t,
+                    _mm_loadu_si128((const __m128i*) (k + i))));
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; ++i)
+        {
+            t1 = h + EP1(e) + CH(e,f,g) + m[i];
+            t2 = EP0(a) + MAJ(a,b,c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+
+// Four rounds of SHA-NI. cur holds the message words for these rounds, prev
+// the ones before them and next the ones after (for which SHA256MSG1 has
+// already been applied). i is constant at every use, so the conditionals
+// fold away.
+
+#define SHANI_ROUNDS(i, cur, prev, next) \
+    do \
+    { \
+        msg = _mm_add_epi32(cur, \
+                _mm_loadu_si128((const __m128i*) (k + (i) * 4))); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+        \
+        if ( (i) >= 3 && (i) <= 14 ) \
+        { \
+            tmp = _mm_alignr_epi8(cur, prev, 4); \
+            next = _mm_add_epi32(next, tmp); \
+            next = _mm_sha256msg2_epu32(next, cur); \
+        } \
+        \
+        msg = _mm_shuffle_epi32(msg, 0x0E); \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+        \
+        if ( (i) >= 1 && (i) <= 12 ) prev = _mm_sha256msg1_epu32(prev, cur); \
+    } \
+    while (0)
+
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(fpk_context_t* ctx, const uint8_t* data,
+        size_t n_blocks)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+            4, 5, 6, 7, 0, 1, 2, 3);
+    uint32_t* state = ctx->sha256_state;
+    __m128i state0, state1, abef, cdgh;
+    __m128i msg, tmp, m0, m1, m2, m3;
+
+    // SHA256RNDS2 wants the state split as ABEF and CDGH
+
+    tmp = _mm_loadu_si128((const __m128i*) state);
+    state1 = _mm_loadu_si128((const __m128i*) (state + 4));
+
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; n_blocks > 0; n_blocks--, data += 64)
+    {
+        abef = state0;
+        cdgh = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) data), bswap);
+        m1 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (data + 16)), bswap);
+        m2 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (data + 32)), bswap);
+        m3 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (data + 48)), bswap);
+
+        SHANI_ROUNDS(0, m0, m3, m1);
+        SHANI_ROUNDS(1, m1, m0, m2);
+        SHANI_ROUNDS(2, m2, m1, m3);
+        SHANI_ROUNDS(3, m3, m2, m0);
+        SHANI_ROUNDS(4, m0, m3, m1);
+        SHANI_ROUNDS(5, m1, m0, m2);
+        SHANI_ROUNDS(6, m2, m1, m3);
+        SHANI_ROUNDS(7, m3, m2, m0);
+        SHANI_ROUNDS(8, m0, m3, m1);
+        SHANI_ROUNDS(9, m1, m0, m2);
+        SHANI_ROUNDS(10, m2, m1, m3);
+        SHANI_ROUNDS(11, m3, m2, m0);
+        SHANI_ROUNDS(12, m0, m3, m1);
+        SHANI_ROUNDS(13, m1, m0, m2);
+        SHANI_ROUNDS(14, m2, m1, m3);
+        SHANI_ROUNDS(15, m3, m2, m0);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
     }
 
-    a = state[0];
-    b = state[1];
-    c = state[2];
-    d = state[3];
-    e = state[4];
-    f = state[5];
-    g = state[6];
-    h = state[7];
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i*) state, state0);
+    _mm_storeu_si128((__m128i*) (state + 4), state1);
+}
+
+
+// Multi-buffer SHA-256: hashes one block of each of n_lanes independent
+// streams at once, a stream to a SIMD lane. Word i of lane l's state is at
+// state[i * n_lanes + l]. GCC vector types take the same round macros as
+// the scalar code.
+
+typedef uint32_t sha256_x4_t __attribute__((vector_size(16)));
+typedef uint32_t sha256_x8_t __attribute__((vector_size(32)));
+typedef uint32_t sha256_x16_t __attribute__((vector_size(64)));
+
+#define SHA256_MB_TRANSFORM(name, isa, vector_t, n_lanes) \
+    __attribute__((target(isa))) \
+    static void name(uint32_t* state, const uint8_t* const* data) \
+    { \
+        vector_t s[8], m[16]; \
+        vector_t a, b, c, d, e, f, g, h, t1, t2; \
+        unsigned i, l; \
+        \
+        for (i = 0; i < 8; i++) \
+            memcpy(&s[i], state + i * n_lanes, sizeof(vector_t)); \
+        \
+        for (i = 0; i < 16; i++) \
+        { \
+            for (l = 0; l < n_lanes; l++) \
+            { \
+                const uint8_t* p = data[l] + i * 4; \
+                m[i][l] = ((uint32_t) p[0] << 24) | (p[1] << 16) | \
+                        (p[2] << 8) | p[3]; \
+            } \
+        } \
+        \
+        a = s[0]; b = s[1]; c = s[2]; d = s[3]; \
+        e = s[4]; f = s[5]; g = s[6]; h = s[7]; \
+        \
+        for (i = 0; i < 64; i++) \
+        { \
+            if ( i >= 16 ) \
+            { \
+                m[i & 15] += SIG1(m[(i - 2) & 15]) + m[(i - 7) & 15] + \
+                        SIG0(m[(i - 15) & 15]); \
+            } \
+            \
+            t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i & 15]; \
+            t2 = EP0(a) + MAJ(a,b,c); \
+            h = g; \
+            g = f; \
+            f = e; \
+            e = d + t1; \
+            d = c; \
+            c = b; \
+            b = a; \
+            a = t1 + t2; \
+        } \
+        \
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d; \
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h; \
+        \
+        for (i = 0; i < 8; i++) \
+            memcpy(state + i * n_lanes, &s[i], sizeof(vector_t)); \
+    }
+
+SHA256_MB_TRANSFORM(sha256_transform_x4, "sse2", sha256_x4_t, 4)
+SHA256_MB_TRANSFORM(sha256_transform_x8, "avx2", sha256_x8_t, 8)
+SHA256_MB_TRANSFORM(sha256_transform_x16, "avx512f", sha256_x16_t, 16)
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
 
-    for (i = 0; i < 64; ++i)
+static void sha256_transform(fpk_context_t* ctx, const uint8_t* data,
+        size_t n_blocks)
+{
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+    uint32_t features = cpu_features();
+
+    if ( features & CPU_FEATURE_SHANI )
+    {
+        sha256_transform_shani(ctx, data, n_blocks);
+        return;
+    }
+
+    if ( features & CPU_FEATURE_SSSE3 )
     {
-        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-        t2 = EP0(a) + MAJ(a,b,c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
+        sha256_transform_ssse3(ctx, data, n_blocks);
+        return;
     }
 
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
-    state[4] += e;
-    state[5] += f;
-    state[6] += g;
-    state[7] += h;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+    sha256_transform_generic(ctx, data, n_blocks);
 }
 
 
 static void sha256_update(fpk_context_t* ctx, const uint8_t* data,
-        uint32_t length)
+        size_t length)
 {
     uint8_t* buffer = ctx->sha256_buffer;
-    const uint8_t* i = data;
-    const uint8_t* e = data + length;
+    size_t n_blocks;
     
-    while (i != e)
+    if ( ctx->sha256_buffer_in > 0 )
     {
-        buffer[ctx->sha256_buffer_in++] = *i++;
-        
-        if ( ctx->sha256_buffer_in >= 64 )
-        {
-            sha256_transform(ctx);
-            ctx->sha256_bit_len += 512;
-            ctx->sha256_buffer_in = 0;
-        }
+        size_t n = 64 - ctx->sha256_buffer_in;
+
+        if ( n > length ) n = length;
+
+        memcpy(buffer + ctx->sha256_buffer_in, data, n);
+        ctx->sha256_buffer_in += n;
+        data += n;
+        length -= n;
+
+        if ( ctx->sha256_buffer_in < 64 ) return;
+
+        sha256_transform(ctx, buffer, 1);
+        ctx->sha256_bit_len += 512;
+        ctx->sha256_buffer_in = 0;
+    }
+
+    // whole blocks are hashed straight out of the caller's buffer
+
+    n_blocks = length / 64;
+
+    if ( n_blocks > 0 )
+    {
+        sha256_transform(ctx, data, n_blocks);
+        ctx->sha256_bit_len += (uint64_t) n_blocks * 512;
+        data += n_blocks * 64;
+        length -= n_blocks * 64;
     }
+
+    memcpy(buffer, data, length);
+    ctx->sha256_buffer_in = length;
 }
 
 
@@ -240,7 +1270,7 @@ static void sha256_digest(fpk_context_t* ctx, uint8_t* hash)
     {
         buffer[in++] = 0x80;
         while (in < 64) buffer[in++] = 0x00;
-        sha256_transform(ctx);
+        sha256_transform(ctx, buffer, 1);
         
         for (in = 0; in < 56; in++) buffer[in] = 0x00;
     }
@@ -256,7 +1286,7 @@ static void sha256_digest(fpk_context_t* ctx, uint8_t* hash)
     buffer[57] = bit_len >> 48;
     buffer[56] = bit_len >> 56;
     
-    sha256_transform(ctx);
+    sha256_transform(ctx, buffer, 1);
     
     for (uint8_t i = 0; i < 4; ++i)
     {
@@ -272,70 +1302,56 @@ static void sha256_digest(fpk_context_t* ctx, uint8_t* hash)
 }
 
 
-static void hmac_reset(fpk_context_t* ctx, const uint8_t* key)
+// Hashes the 64-byte HMAC pad derived from key, leaving the resulting
+// midstate in sha256_state.
+
+static void hmac_pad(fpk_context_t* ctx, const uint8_t* key, uint8_t pad)
 {
-    uint8_t i_key[8];
+    uint8_t block[64];
+
+    for (uint8_t i = 0; i < 32; i++) block[i] = key[i] ^ pad;
+
+    memset(block + 32, pad, 32);
     
     sha256_reset(ctx);
-    
-    for (uint8_t i = 0; i < 32; i += 8)
-    {
-        i_key[0] = key[i] ^ 0x36;
-        i_key[1] = key[i + 1] ^ 0x36;
-        i_key[2] = key[i + 2] ^ 0x36;
-        i_key[3] = key[i + 3] ^ 0x36;
-        i_key[4] = key[i + 4] ^ 0x36;
-        i_key[5] = key[i + 5] ^ 0x36;
-        i_key[6] = key[i + 6] ^ 0x36;
-        i_key[7] = key[i + 7] ^ 0x36;
-        
-        sha256_update(ctx, i_key, 8);
-    }
-    
-    memset(i_key, 0x36, 8);
-    
-    for (uint8_t i = 0; i < 4; i++)
-    {
-        sha256_update(ctx, i_key, 8);
-    }
+    sha256_update(ctx, block, 64);
 }
 
 
-static void hmac_update(fpk_context_t* ctx, const uint8_t* data,
-        uint32_t length)
+static void hmac_reset(fpk_context_t* ctx, const uint8_t* key)
+{
+    hmac_pad(ctx, key, 0x5C);
+    memcpy(ctx->hmac_outer_state, ctx->sha256_state, 32);
+
+    hmac_pad(ctx, key, 0x36);
+}
+
+
+static void hmac_reset_prepared(fpk_context_t* ctx, const fpk_key_t* key)
+{
+    memcpy(ctx->hmac_outer_state, key->u.hmac_sha256.outer_state, 32);
+    memcpy(ctx->sha256_state, key->u.hmac_sha256.inner_state, 32);
+
+    ctx->sha256_buffer_in = 0;
+    ctx->sha256_bit_len = 512;
+}
+
+
+static void hmac_update(fpk_context_t* ctx, const uint8_t* data,
+        size_t length)
 {
     sha256_update(ctx, data, length);
 }
 
 
-static void hmac_digest(fpk_context_t* ctx, const uint8_t* key, uint8_t* hash)
+static void hmac_digest(fpk_context_t* ctx, uint8_t* hash)
 {
-    uint8_t o_key[8];
-    
     sha256_digest(ctx, hash);
-    sha256_reset(ctx);
-    
-    for (uint8_t i = 0; i < 32; i += 8)
-    {
-        o_key[0] = key[i] ^ 0x5C;
-        o_key[1] = key[i + 1] ^ 0x5C;
-        o_key[2] = key[i + 2] ^ 0x5C;
-        o_key[3] = key[i + 3] ^ 0x5C;
-        o_key[4] = key[i + 4] ^ 0x5C;
-        o_key[5] = key[i + 5] ^ 0x5C;
-        o_key[6] = key[i + 6] ^ 0x5C;
-        o_key[7] = key[i + 7] ^ 0x5C;
-        
-        sha256_update(ctx, o_key, 8);
-    }
-    
-    memset(o_key, 0x5C, 8);
-    
-    for (uint8_t i = 0; i < 4; i++)
-    {
-        sha256_update(ctx, o_key, 8);
-    }
-    
+
+    memcpy(ctx->sha256_state, ctx->hmac_outer_state, 32);
+    ctx->sha256_buffer_in = 0;
+    ctx->sha256_bit_len = 512;
+
     sha256_update(ctx, hash, 32);
     sha256_digest(ctx, hash);
 }
@@ -437,9 +1453,8 @@ static const uint8_t AES128_RCON[11] =
 };
 
 
-static void aes128_key_expansion(fpk_context_t* ctx, const uint8_t* key)
+static void aes128_key_expansion(uint8_t* round_key, const uint8_t* key)
 {
-    uint8_t* round_key = ctx->aes128_round_key;
     uint32_t i, k;
     uint8_t tempa[4];
 
@@ -482,9 +1497,9 @@ static void aes128_key_expansion(fpk_context_t* ctx, const uint8_t* key)
 }
 
 
-static void aes128_add_round_key(fpk_context_t* ctx, uint8_t round)
+static void aes128_add_round_key(fpk_context_t* ctx, aes128_state_t* state,
+        uint8_t round)
 {
-    aes128_state_t* state = ctx->aes128_state;
     uint8_t* round_key = ctx->aes128_round_key;
     uint8_t i;
     uint8_t j;
@@ -517,9 +1532,8 @@ static uint8_t aes128_multiply(uint8_t x, uint8_t y)
 }
 
 
-static void aes128_inv_mix_columns(fpk_context_t* ctx)
+static void aes128_inv_mix_columns(aes128_state_t* state)
 {
-    aes128_state_t* state = ctx->aes128_state;
     int i;
     uint8_t a, b, c, d;
 
@@ -545,9 +1559,8 @@ static void aes128_inv_mix_columns(fpk_context_t* ctx)
 }
 
 
-static void aes128_inv_sub_bytes(fpk_context_t* ctx)
+static void aes128_inv_sub_bytes(aes128_state_t* state)
 {
-    aes128_state_t* state = ctx->aes128_state;
     uint8_t i;
     uint8_t j;
 
@@ -561,9 +1574,8 @@ static void aes128_inv_sub_bytes(fpk_context_t* ctx)
 }
 
 
-static void aes128_inv_shift_rows(fpk_context_t* ctx)
+static void aes128_inv_shift_rows(aes128_state_t* state)
 {
-    aes128_state_t* state = ctx->aes128_state;
     uint8_t temp;
 
     temp = (*state)[3][1];
@@ -588,525 +1600,3205 @@ static void aes128_inv_shift_rows(fpk_context_t* ctx)
 }
 
 
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+__attribute__((target("aes")))
+static void aes128_init_aesni(uint8_t* dec_key, const uint8_t* round_key)
+{
+    __m128i k;
+
+    // AESDEC implements the equivalent inverse cipher, which expects the
+    // round keys in reverse order with InvMixColumns applied to the inner
+    // ones
+
+    memcpy(dec_key, round_key + AES128_NR * 16, 16);
+
+    for (uint8_t round = 1; round < AES128_NR; round++)
+    {
+        k = _mm_loadu_si128(
+            (const __m128i*) (round_key + (AES128_NR - round) * 16)
+        );
+
+        _mm_storeu_si128((__m128i*) (dec_key + round * 16),
+                _mm_aesimc_si128(k));
+    }
+
+    memcpy(dec_key + AES128_NR * 16, round_key, 16);
+}
+
+
+__attribute__((target("aes")))
+static void aes128_decrypt_cbc_aesni(fpk_context_t* ctx, uint8_t* out,
+        const uint8_t* in, uint32_t n_blocks, uint8_t* chain)
+{
+    const __m128i* dec_key = (const __m128i*) ctx->aes128_round_key;
+    __m128i k[AES128_NR + 1];
+    __m128i iv;
+    __m128i c[8];
+    __m128i b[8];
+    uint8_t i;
+    uint8_t round;
+
+    for (round = 0; round <= AES128_NR; round++)
+    {
+        k[round] = _mm_loadu_si128(dec_key + round);
+    }
+
+    iv = _mm_loadu_si128((const __m128i*) chain);
+
+    // blocks are independent of each other when decrypting CBC, so keep
+    // eight of them in flight to hide the latency of AESDEC
+
+    while (n_blocks >= 8)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            c[i] = _mm_loadu_si128((const __m128i*) (in + i * 16));
+            b[i] = _mm_xor_si128(c[i], k[0]);
+        }
+
+        for (round = 1; round < AES128_NR; round++)
+        {
+            for (i = 0; i < 8; i++) b[i] = _mm_aesdec_si128(b[i], k[round]);
+        }
+
+        for (i = 0; i < 8; i++)
+        {
+            b[i] = _mm_aesdeclast_si128(b[i], k[AES128_NR]);
+            b[i] = _mm_xor_si128(b[i], i ? c[i - 1] : iv);
+            _mm_storeu_si128((__m128i*) (out + i * 16), b[i]);
+        }
+
+        iv = c[7];
+        in += 128;
+        out += 128;
+        n_blocks -= 8;
+    }
+
+    while (n_blocks > 0)
+    {
+        c[0] = _mm_loadu_si128((const __m128i*) in);
+        b[0] = _mm_xor_si128(c[0], k[0]);
+
+        for (round = 1; round < AES128_NR; round++)
+        {
+            b[0] = _mm_aesdec_si128(b[0], k[round]);
+        }
+
+        b[0] = _mm_aesdeclast_si128(b[0], k[AES128_NR]);
+        _mm_storeu_si128((__m128i*) out, _mm_xor_si128(b[0], iv));
+
+        iv = c[0];
+        in += 16;
+        out += 16;
+        n_blocks--;
+    }
+
+    _mm_storeu_si128((__m128i*) chain, iv);
+}
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+// The context keeps just the one key schedule that its decryption uses:
+// the round keys, or with AES-NI the decryption keys derived from them.
+
 static void aes128_init(fpk_context_t* ctx, const uint8_t* key,
         const uint8_t* iv)
 {
-    aes128_key_expansion(ctx, key);
     memcpy(ctx->aes128_iv, iv, AES128_KEY_LEN);
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    if ( cpu_features() & CPU_FEATURE_AESNI )
+    {
+        uint8_t round_key[AES128_KEY_EXP_SIZE];
+
+        aes128_key_expansion(round_key, key);
+        aes128_init_aesni(ctx->aes128_round_key, round_key);
+        ctx->flags |= FLAG_AESNI;
+
+        return;
+    }
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+    aes128_key_expansion(ctx->aes128_round_key, key);
+}
+
+
+static void aes128_init_prepared(fpk_context_t* ctx, const fpk_key_t* key,
+        const uint8_t* iv)
+{
+    memcpy(ctx->aes128_iv, iv, AES128_KEY_LEN);
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    if ( key->u.aes128_cbc.aesni && (cpu_features() & CPU_FEATURE_AESNI) )
+    {
+        memcpy(ctx->aes128_round_key, key->u.aes128_cbc.dec_key,
+                AES128_KEY_EXP_SIZE);
+        ctx->flags |= FLAG_AESNI;
+
+        return;
+    }
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+    memcpy(ctx->aes128_round_key, key->u.aes128_cbc.round_key,
+            AES128_KEY_EXP_SIZE);
 }
 
 
 static void aes128_decrypt_block(fpk_context_t* ctx, uint8_t* block)
 {
+    aes128_state_t* state = (aes128_state_t*) block;
     uint8_t round;
 
-    ctx->aes128_state = (aes128_state_t*) block;
-
-    aes128_add_round_key(ctx, AES128_NR);
+    aes128_add_round_key(ctx, state, AES128_NR);
 
     for (round = (AES128_NR - 1); round > 0; --round)
     {
-        aes128_inv_shift_rows(ctx);
-        aes128_inv_sub_bytes(ctx);
-        aes128_add_round_key(ctx, round);
-        aes128_inv_mix_columns(ctx);
+        aes128_inv_shift_rows(state);
+        aes128_inv_sub_bytes(state);
+        aes128_add_round_key(ctx, state, round);
+        aes128_inv_mix_columns(state);
     }
 
-    aes128_inv_shift_rows(ctx);
-    aes128_inv_sub_bytes(ctx);
-    aes128_add_round_key(ctx, 0);
+    aes128_inv_shift_rows(state);
+    aes128_inv_sub_bytes(state);
+    aes128_add_round_key(ctx, state, 0);
 }
 
 
-static void aes128_decrypt_cbc(fpk_context_t* ctx, uint8_t* block)
+// Deciphers n_blocks from in to out, which may be the same buffer. chain
+// holds the ciphertext block preceding in, and is left holding the last
+// one in in. Only the key is taken from ctx, so separate runs of a stream
+// can be deciphered at the same time, each with its own chain.
+
+static void aes128_decrypt_run(fpk_context_t* ctx, uint8_t* out,
+        const uint8_t* in, uint32_t n_blocks, uint8_t* chain)
 {
     uint8_t temp[AES128_KEY_LEN];
-    uint8_t* iv = ctx->aes128_iv;
+    uint8_t* iv = chain;
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    if ( ctx->flags & FLAG_AESNI )
+    {
+        aes128_decrypt_cbc_aesni(ctx, out, in, n_blocks, chain);
+        return;
+    }
+#endif /* FPK_ENABLE_X86_ACCELERATION */
     
-    memcpy(temp, iv, AES128_KEY_LEN);
-    memcpy(iv, block, AES128_KEY_LEN);
+    while (n_blocks--)
+    {
+        memcpy(temp, iv, AES128_KEY_LEN);
+        memcpy(iv, in, AES128_KEY_LEN);
+        memmove(out, in, AES128_KEY_LEN);
     
-    aes128_decrypt_block(ctx, block);
+        aes128_decrypt_block(ctx, out);
     
-    for (uint8_t i = 0; i < AES128_KEY_LEN; i++)
-    {
-        block[i] ^= temp[i];
+        for (uint8_t i = 0; i < AES128_KEY_LEN; i++)
+        {
+            out[i] ^= temp[i];
+        }
+
+        in += AES128_KEY_LEN;
+        out += AES128_KEY_LEN;
     }
 }
 
+
+static void aes128_decrypt_cbc(fpk_context_t* ctx, uint8_t* out,
+        const uint8_t* in, uint32_t n_blocks)
+{
+    aes128_decrypt_run(ctx, out, in, n_blocks, ctx->aes128_iv);
+}
+
 #endif /* FPK_ENABLE_AES128_CBC */
 
 
 /* ==== HOOK WRAPPERS ====================================================== */
 
 static fpk_result_t read_file(fpk_context_t* ctx, uint8_t* buffer,
-        uint8_t n_bytes)
+        size_t n_bytes)
 {
+    if ( ctx->hooks->read_file_bulk )
+    {
+        fpk_result_t result;
+        STATS_BEGIN(ctx);
+
+        result = ctx->hooks->read_file_bulk(buffer, n_bytes, ctx->user_data);
+
+        STATS_END(ctx, read_file, n_bytes);
+        return result;
+    }
+
     if ( !ctx->hooks->read_file ) return FPK_RESULT_MANDATORY_HOOK_MISSING;
-    return ctx->hooks->read_file(buffer, n_bytes, ctx->user_data);
+
+    // read_file can only take a uint8_t length, so a large read buffer is
+    // filled with several calls of at most FPK_INPUT_BUFFER_SIZE each
+
+    while (n_bytes > 0)
+    {
+        fpk_result_t result;
+        size_t n = n_bytes;
+
+        if ( n > FPK_INPUT_BUFFER_SIZE ) n = FPK_INPUT_BUFFER_SIZE;
+
+        STATS_BEGIN(ctx);
+        result = ctx->hooks->read_file(buffer, n, ctx->user_data);
+        STATS_END(ctx, read_file, n);
+
+        if ( result != FPK_RESULT_OK ) return result;
+
+        buffer += n;
+        n_bytes -= n;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+// Picks the buffer that input is read (and deciphered) into. A buffer from
+// the read_buffer hook is used if it can hold at least one block, otherwise
+// the FPK_INPUT_BUFFER_SIZE byte scratch on the caller's stack.
+
+static void select_input_buffer(fpk_context_t* ctx, uint8_t* scratch)
+{
+    uint8_t* buffer = NULL;
+    size_t size = 0;
+
+    if ( ctx->hooks->read_buffer )
+        buffer = ctx->hooks->read_buffer(&size, ctx->user_data);
+
+    size &= ~(size_t) 15;
+
+    if ( buffer && size > 0 )
+    {
+        ctx->input_buffer = buffer;
+        ctx->input_buffer_size = size;
+    }
+    else
+    {
+        ctx->input_buffer = scratch;
+        ctx->input_buffer_size = FPK_INPUT_BUFFER_SIZE;
+        ctx->flags |= FLAG_SCRATCH_INPUT;
+    }
 }
 
 
 static fpk_result_t seek_file(fpk_context_t* ctx, uint32_t position)
 {
+    fpk_result_t result;
+
+    if ( ctx->source )
+    {
+        if ( position > ctx->source_length )
+            return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+        ctx->source_position = position;
+        return FPK_RESULT_OK;
+    }
+
     if ( !ctx->hooks->seek_file ) return FPK_RESULT_MANDATORY_HOOK_MISSING;
-    return ctx->hooks->seek_file(position, ctx->user_data);
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->seek_file(position, ctx->user_data);
+
+    STATS_END(ctx, seek_file, 0);
+    return result;
 }
 
 
 static fpk_result_t prepare_memory(fpk_context_t* ctx, const char* id,
         uint32_t size)
 {
+    fpk_result_t result;
+
     if ( !ctx->hooks->prepare_memory ) return FPK_RESULT_OK;
-    return ctx->hooks->prepare_memory(id, size, ctx->user_data);
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->prepare_memory(id, size, ctx->user_data);
+
+    STATS_END(ctx, prepare_memory, 0);
+    return result;
 }
 
 
 static fpk_result_t program_memory(fpk_context_t* ctx, const char* id,
         const uint8_t* data, uint8_t length)
 {
+    fpk_result_t result;
+
     if ( !ctx->hooks->program_memory ) return FPK_RESULT_PROGRAM_ERROR;
-    return ctx->hooks->program_memory(id, data, length, ctx->user_data);
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->program_memory(id, data, length, ctx->user_data);
+
+    STATS_END(ctx, program_memory, length);
+    return result;
 }
 
 
-static fpk_result_t finalize_memory(fpk_context_t* ctx, const char* id)
+static uint8_t* program_buffer(fpk_context_t* ctx, size_t* page_size)
 {
-    if ( !ctx->hooks->finalize_memory ) return FPK_RESULT_OK;
-    return ctx->hooks->finalize_memory(id, ctx->user_data);
+    if ( !ctx->hooks->program_buffer ) return NULL;
+    return ctx->hooks->program_buffer(page_size, ctx->user_data);
 }
 
 
-#ifdef FPK_ENABLE_HMAC_SHA256
-
-static const uint8_t* authentication_key(fpk_context_t* ctx,
-        fpk_authentication_type_t type)
+static fpk_result_t program_page(fpk_context_t* ctx, const char* id,
+        uint32_t offset, const uint8_t* data, size_t length)
 {
-    if ( !ctx->hooks->authentication_key ) return NULL;
-    return ctx->hooks->authentication_key(type, ctx->user_data);
-}
+    fpk_result_t result;
+    STATS_BEGIN(ctx);
 
-#endif /* FPK_ENABLE_HMAC_SHA256 */
+    result = ctx->hooks->program_page(id, offset, data, length,
+            ctx->user_data);
 
+    STATS_END(ctx, program_memory, length);
+    return result;
+}
 
-#ifdef FPK_ENABLE_AES128_CBC
 
-static const uint8_t* cipher_key(fpk_context_t* ctx, fpk_cipher_type_t type)
+static fpk_result_t program_tail(fpk_context_t* ctx, const char* id,
+        uint32_t offset, const uint8_t* data, size_t length)
 {
-    if ( !ctx->hooks->cipher_key ) return NULL;
-    return ctx->hooks->cipher_key(type, ctx->user_data);
+    fpk_result_t result;
+
+    if ( !ctx->hooks->program_tail )
+        return program_page(ctx, id, offset, data, length);
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->program_tail(id, offset, data, length,
+            ctx->user_data);
+
+    STATS_END(ctx, program_memory, length);
+    return result;
 }
 
-#endif /* FPK_ENABLE_AES128_CBC */
 
+// With program_page_async, pages are assembled in ctx->slot of the
+// FPK_PROGRAM_SLOTS slots at ctx->slots while those with their bit set in
+// ctx->slots_busy are being written.
 
-static fpk_result_t handle_metadata(fpk_context_t* ctx, const char* key,
-        const char* value)
+static fpk_result_t program_page_async(fpk_context_t* ctx, const char* id,
+        uint32_t offset, size_t length)
 {
-    return ctx->hooks->handle_metadata(key, value, ctx->user_data);
-}
+    fpk_result_t result;
+    STATS_BEGIN(ctx);
 
+    result = ctx->hooks->program_page_async(id, offset, ctx->page, length,
+            ctx->slot, ctx->user_data);
 
-/* ==== INPUT PARSING ====================================================== */
+    STATS_END(ctx, program_memory, length);
+    return result;
+}
 
-#define FLAG_CAPTURE_CRC32      (1 << 0)
-#define FLAG_CAPTURE_AUTH       (1 << 1)
-#define FLAG_DECIPHER           (1 << 2)
 
+// Waits for one page to be written and frees its slot. A slot that isn't
+// busy can't be handed back, so that fails and gives up on the rest.
 
-static fpk_result_t read_block(fpk_context_t* ctx)
+static fpk_result_t wait_page(fpk_context_t* ctx)
 {
     fpk_result_t result;
-    uint8_t flags = ctx->flags;
+    unsigned slot = FPK_PROGRAM_SLOTS;
+    STATS_BEGIN(ctx);
 
-    result = read_file(ctx, ctx->input, 16);
-    if ( result != FPK_RESULT_OK ) return result;
+    result = ctx->hooks->wait_program(&slot, ctx->user_data);
 
-    if ( flags & FLAG_CAPTURE_CRC32 ) crc32_update(ctx, ctx->input, 16);
+    STATS_END(ctx, program_wait, 0);
 
-#ifdef FPK_ENABLE_HMAC_SHA256
-    if ( flags & FLAG_CAPTURE_AUTH ) hmac_update(ctx, ctx->input, 16);
-#endif /* FPK_ENABLE_HMAC_SHA256 */
+    if ( slot >= FPK_PROGRAM_SLOTS || !(ctx->slots_busy & (1 << slot)) )
+    {
+        ctx->slots_busy = 0;
+        return (result != FPK_RESULT_OK) ? result :
+                FPK_RESULT_PROGRAM_ERROR;
+    }
 
-#ifdef FPK_ENABLE_AES128_CBC
-    if ( flags & FLAG_DECIPHER ) aes128_decrypt_cbc(ctx, ctx->input);
-#endif /* FPK_ENABLE_AES128_CBC */
+    ctx->slots_busy &= (uint8_t) ~(1 << slot);
 
     return result;
 }
 
 
-static fpk_result_t read_input(fpk_context_t* ctx, uint8_t* buffer,
-        uint32_t length)
+// Waits for every page started, returning the first failure.
+
+static fpk_result_t wait_pages(fpk_context_t* ctx)
 {
-    uint8_t* input = ctx->input;
-    uint8_t* i = buffer;
-    uint8_t* e = buffer + length;
-    
-    while (i != e)
+    fpk_result_t result = FPK_RESULT_OK;
+
+    while (ctx->slots_busy)
     {
-        if ( ctx->cursor == 0 )
-        {
-            fpk_result_t result;
-            
-            if ( ctx->n_blocks == 0 )
-                return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
-            
-            result = read_block(ctx);
-            if ( result != FPK_RESULT_OK ) return result;
-            
-            ctx->n_blocks--;
-        }
-        
-        *i++ = input[ctx->cursor];
-        
-        ctx->cursor = (ctx->cursor + 1) & 15;
+        fpk_result_t wait_result = wait_page(ctx);
+        if ( result == FPK_RESULT_OK ) result = wait_result;
     }
-    
-    return FPK_RESULT_OK;
+
+    return result;
 }
 
 
-static uint16_t parse_u16(const uint8_t* buffer)
+// Starts writing the page assembled in the current slot and moves on to
+// the first free one, waiting for one to come free if they are all busy.
+
+static fpk_result_t start_page(fpk_context_t* ctx, const char* id,
+        uint32_t offset, size_t length)
 {
-    return buffer[0] | (buffer[1] << 8);
-}
+    fpk_result_t result;
 
+    result = program_page_async(ctx, id, offset, length);
+    if ( result != FPK_RESULT_OK ) return result;
 
-static uint32_t parse_u32(const uint8_t* buffer)
-{
-    return (uint32_t) buffer[0] | ( (uint32_t) buffer[1] << 8) |
-            ( (uint32_t) buffer[2] << 16) | ( (uint32_t) buffer[3] << 24);
-}
+    ctx->slots_busy |= (uint8_t) (1 << ctx->slot);
 
+    while (ctx->slots_busy == (1 << FPK_PROGRAM_SLOTS) - 1)
+    {
+        result = wait_page(ctx);
+        if ( result != FPK_RESULT_OK ) return result;
+    }
 
-/* ==== API ================================================================ */
+    ctx->slot = 0;
+    while (ctx->slots_busy & (1 << ctx->slot)) ctx->slot++;
 
+    ctx->page = ctx->slots + ctx->slot * ctx->page_size;
 
-#ifdef FPK_ENABLE_RESULT_TO_STRING
+    return FPK_RESULT_OK;
+}
 
-const char* fpk_result_to_string(fpk_result_t result)
+
+static fpk_result_t program_view(fpk_context_t* ctx, const char* id,
+        uint32_t offset, const uint8_t* data, size_t length)
 {
-    switch(result)
-    {
-    case FPK_RESULT_OK:
-        return "OK";
+    fpk_result_t result;
+    STATS_BEGIN(ctx);
 
-    case FPK_RESULT_READ_ERROR:
-        return "Read error";
+    result = ctx->hooks->program_view(id, offset, data, length,
+            ctx->user_data);
 
-    case FPK_RESULT_UNEXPECTED_END_OF_INPUT:
-        return "Unexpected end of input";
+    STATS_END(ctx, program_memory, length);
+    return result;
+}
 
-    case FPK_RESULT_ERASE_ERROR:
-        return "Erase error";
 
-    case FPK_RESULT_PROGRAM_ERROR:
-        return "Program error";
+static fpk_result_t finalize_memory(fpk_context_t* ctx, const char* id)
+{
+    fpk_result_t result;
 
-    case FPK_RESULT_UNKNOWN_ID:
-        return "Unknown id";
+    if ( !ctx->hooks->finalize_memory ) return FPK_RESULT_OK;
 
-    case FPK_RESULT_CRC_MISMATCH:
-        return "CRC mismatch";
+    STATS_BEGIN(ctx);
 
-    case FPK_RESULT_INVALID_SIGNATURE:
-        return "Invalid signature";
-        
-    case FPK_RESULT_SIGNATURE_MISSING:
+    result = ctx->hooks->finalize_memory(id, ctx->user_data);
+
+    STATS_END(ctx, finalize_memory, 0);
+    return result;
+}
+
+
+static fpk_result_t commit_memory(fpk_context_t* ctx)
+{
+    fpk_result_t result;
+
+    if ( !ctx->hooks->commit_memory ) return FPK_RESULT_OK;
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->commit_memory(ctx->user_data);
+
+    STATS_END(ctx, commit_memory, 0);
+    return result;
+}
+
+
+static void abort_memory(fpk_context_t* ctx, fpk_result_t result)
+{
+    if ( ctx->hooks->abort_memory ) ctx->hooks->abort_memory(result,
+            ctx->user_data);
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static const uint8_t* authentication_key(fpk_context_t* ctx,
+        fpk_authentication_type_t type)
+{
+    if ( !ctx->hooks->authentication_key ) return NULL;
+    return ctx->hooks->authentication_key(type, ctx->user_data);
+}
+
+
+static const fpk_key_t* prepared_authentication_key(fpk_context_t* ctx,
+        fpk_authentication_type_t type)
+{
+    if ( !ctx->hooks->prepared_authentication_key ) return NULL;
+    return ctx->hooks->prepared_authentication_key(type, ctx->user_data);
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+static const uint8_t* cipher_key(fpk_context_t* ctx, fpk_cipher_type_t type)
+{
+    if ( !ctx->hooks->cipher_key ) return NULL;
+    return ctx->hooks->cipher_key(type, ctx->user_data);
+}
+
+
+static const fpk_key_t* prepared_cipher_key(fpk_context_t* ctx,
+        fpk_cipher_type_t type)
+{
+    if ( !ctx->hooks->prepared_cipher_key ) return NULL;
+    return ctx->hooks->prepared_cipher_key(type, ctx->user_data);
+}
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+static fpk_result_t handle_metadata(fpk_context_t* ctx, const char* key,
+        const char* value)
+{
+    fpk_result_t result;
+
+    if ( !ctx->hooks->handle_metadata ) return FPK_RESULT_OK;
+
+    STATS_BEGIN(ctx);
+
+    result = ctx->hooks->handle_metadata(key, value, ctx->user_data);
+
+    STATS_END(ctx, handle_metadata, 0);
+    return result;
+}
+
+
+/* ==== PARALLEL PROCESSING ================================================ */
+
+#ifdef FPK_ENABLE_THREADS
+
+// With more than one verify thread, the HMAC runs on a worker thread that
+// takes runs of input from a single-producer single-consumer ring, while
+// large runs have their CRC32 split between tasks and stitched back
+// together with crc32_combine. Only the ring indices are shared without
+// the lock; it is only taken to sleep and wake. Large runs are deciphered
+// in parts too, as each CBC block only depends on the ciphertext before
+// it.
+
+#define TASK_MIN_CHUNK          65536
+#define MAX_TASKS               16
+
+
+typedef struct
+{
+    void (*task) (void* arg);
+    void* arg;
+
+} thread_start_t;
+
+
+typedef struct
+{
+    fpk_context_t* ctx;
+    const uint8_t* data;
+    size_t length;
+    uint32_t crc;
+
+} crc32_task_t;
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+typedef struct
+{
+    fpk_context_t* ctx;
+    uint8_t* out;
+    const uint8_t* in;
+    uint32_t n_blocks;
+    uint8_t chain[AES128_KEY_LEN];
+
+} aes128_task_t;
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+static void* thread_main(void* arg)
+{
+    thread_start_t start = *(thread_start_t*) arg;
+
+    free(arg);
+    start.task(start.arg);
+
+    return NULL;
+}
+
+
+static int submit_task(fpk_context_t* ctx, void (*task) (void*), void* arg)
+{
+    thread_start_t* start;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int error;
+
+    if ( ctx->hooks->submit_task )
+        return ctx->hooks->submit_task(task, arg, ctx->user_data);
+
+    start = malloc(sizeof(*start));
+    if ( !start ) return -1;
+
+    start->task = task;
+    start->arg = arg;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    error = pthread_create(&thread, &attr, thread_main, start);
+    pthread_attr_destroy(&attr);
+
+    if ( error ) free(start);
+
+    return error;
+}
+
+
+static int uses_threads(fpk_context_t* ctx)
+{
+    return ctx->n_threads > 1 || (ctx->options & FPK_OPTION_PIPELINE);
+}
+
+
+static void threads_begin(fpk_context_t* ctx)
+{
+    unsigned n = 0;
+
+    if ( ctx->hooks->verify_threads )
+        n = ctx->hooks->verify_threads(ctx->user_data);
+
+    ctx->n_threads = n;
+    ctx->hash_active = 0;
+
+    if ( uses_threads(ctx) )
+    {
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_cond_init(&ctx->wake, NULL);
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+        // detect now rather than racing to do so in the tasks
+        cpu_features();
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+    }
+}
+
+
+// How many tasks to split length bytes of work between, if it's worth it.
+
+static size_t count_tasks(fpk_context_t* ctx, size_t length)
+{
+    size_t n_tasks = ctx->n_threads;
+
+    if ( n_tasks > MAX_TASKS ) n_tasks = MAX_TASKS;
+    if ( n_tasks > length / TASK_MIN_CHUNK ) n_tasks = length / TASK_MIN_CHUNK;
+
+    return n_tasks;
+}
+
+
+static void end_task(fpk_context_t* ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pending_tasks--;
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+static void wait_tasks(fpk_context_t* ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    while (ctx->pending_tasks > 0)
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+static void crc32_task(void* arg)
+{
+    crc32_task_t* task = arg;
+
+    task->crc = ~crc32_compute(0, task->data, task->length);
+    end_task(task->ctx);
+}
+
+
+static void crc32_update_parallel(fpk_context_t* ctx, const uint8_t* data,
+        size_t length)
+{
+    crc32_task_t tasks[MAX_TASKS];
+    size_t n_tasks = count_tasks(ctx, length);
+    size_t chunk;
+
+    if ( n_tasks < 2 )
+    {
+        crc32_update(ctx, data, length);
+        return;
+    }
+
+    chunk = (length / n_tasks) & ~(size_t) 63;
+    ctx->pending_tasks = (uint32_t) n_tasks - 1;
+
+    for (size_t i = 1; i < n_tasks; i++)
+    {
+        tasks[i].ctx = ctx;
+        tasks[i].data = data + i * chunk;
+        tasks[i].length = (i == n_tasks - 1) ? length - i * chunk : chunk;
+
+        if ( submit_task(ctx, crc32_task, &tasks[i]) != 0 )
+            crc32_task(&tasks[i]);
+    }
+
+    crc32_update(ctx, data, chunk);
+    wait_tasks(ctx);
+
+    for (size_t i = 1; i < n_tasks; i++)
+    {
+        ctx->crc32 = crc32_combine(ctx->crc32, tasks[i].crc, tasks[i].length);
+    }
+}
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+static void aes128_task(void* arg)
+{
+    aes128_task_t* task = arg;
+
+    aes128_decrypt_run(task->ctx, task->out, task->in, task->n_blocks,
+            task->chain);
+    end_task(task->ctx);
+}
+
+
+static void aes128_decrypt_cbc_parallel(fpk_context_t* ctx, uint8_t* out,
+        const uint8_t* in, uint32_t n_blocks)
+{
+    aes128_task_t tasks[MAX_TASKS];
+    uint8_t next_iv[AES128_KEY_LEN];
+    size_t n_tasks = count_tasks(ctx, (size_t) n_blocks * 16);
+    uint32_t chunk;
+
+    if ( n_tasks < 2 )
+    {
+        aes128_decrypt_cbc(ctx, out, in, n_blocks);
+        return;
+    }
+
+    chunk = n_blocks / (uint32_t) n_tasks;
+
+    // when deciphering in place, the ciphertext each part chains from is
+    // overwritten by the part before it, so take copies up front
+
+    for (size_t i = 1; i < n_tasks; i++)
+    {
+        size_t offset = i * chunk * 16;
+
+        tasks[i].ctx = ctx;
+        tasks[i].out = out + offset;
+        tasks[i].in = in + offset;
+        tasks[i].n_blocks = (i == n_tasks - 1) ? n_blocks - i * chunk : chunk;
+
+        memcpy(tasks[i].chain, in + offset - 16, AES128_KEY_LEN);
+    }
+
+    memcpy(next_iv, in + ((size_t) n_blocks - 1) * 16, AES128_KEY_LEN);
+    ctx->pending_tasks = (uint32_t) n_tasks - 1;
+
+    for (size_t i = 1; i < n_tasks; i++)
+    {
+        if ( submit_task(ctx, aes128_task, &tasks[i]) != 0 )
+            aes128_task(&tasks[i]);
+    }
+
+    aes128_decrypt_cbc(ctx, out, in, chunk);
+    wait_tasks(ctx);
+
+    memcpy(ctx->aes128_iv, next_iv, AES128_KEY_LEN);
+}
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+// Waits for the other side of the hash ring to move *index on from value.
+// The waiter counts itself in hash_waiting before its last look at the
+// index, and the other side only takes the lock to wake it if it sees that
+// count after its own update, so neither side locks while the ring moves.
+
+static void hash_wait(fpk_context_t* ctx, const uint32_t* index,
+        uint32_t value)
+{
+    pthread_mutex_lock(&ctx->lock);
+    __atomic_add_fetch(&ctx->hash_waiting, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value)
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+
+    __atomic_sub_fetch(&ctx->hash_waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+static void hash_signal(fpk_context_t* ctx, uint32_t* index, uint32_t value)
+{
+    __atomic_store_n(index, value, __ATOMIC_SEQ_CST);
+
+    if ( __atomic_load_n(&ctx->hash_waiting, __ATOMIC_SEQ_CST) > 0 )
+    {
+        pthread_mutex_lock(&ctx->lock);
+        pthread_cond_broadcast(&ctx->wake);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+
+// Hashes spans from the ring in order until it takes an empty one. The
+// worker's last touch of the context is clearing hash_active under the
+// lock, which is what hash_stop waits for before the lock can be
+// destroyed and the context reused.
+
+static void hash_task(void* arg)
+{
+    fpk_context_t* ctx = arg;
+    uint32_t tail = ctx->hash_tail;
+
+    for (;;)
+    {
+        fpk_span_t span;
+
+        while (__atomic_load_n(&ctx->hash_head, __ATOMIC_ACQUIRE) == tail)
+            hash_wait(ctx, &ctx->hash_head, tail);
+
+        span = ctx->hash_ring[tail % FPK_HASH_RING_SIZE];
+
+        if ( !span.data ) break;
+
+        sha256_update(ctx, span.data, span.length);
+
+        tail++;
+        hash_signal(ctx, &ctx->hash_tail, tail);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->hash_active = 0;
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+static void hash_push(fpk_context_t* ctx, const uint8_t* data, size_t length)
+{
+    uint32_t head = ctx->hash_head;
+
+    while (head - __atomic_load_n(&ctx->hash_tail, __ATOMIC_ACQUIRE) ==
+        FPK_HASH_RING_SIZE)
+    {
+        hash_wait(ctx, &ctx->hash_tail, head - FPK_HASH_RING_SIZE);
+    }
+
+    ctx->hash_ring[head % FPK_HASH_RING_SIZE].data = data;
+    ctx->hash_ring[head % FPK_HASH_RING_SIZE].length = length;
+
+    hash_signal(ctx, &ctx->hash_head, head + 1);
+}
+
+
+// Waits for the hash worker to finish with everything pushed so far, after
+// which the memory it was given can be reused.
+
+static void hash_drain(fpk_context_t* ctx)
+{
+    uint32_t tail;
+
+    if ( !ctx->hash_active ) return;
+
+    while ((tail = __atomic_load_n(&ctx->hash_tail, __ATOMIC_ACQUIRE)) !=
+        ctx->hash_head)
+    {
+        hash_wait(ctx, &ctx->hash_tail, tail);
+    }
+}
+
+
+static void hash_start(fpk_context_t* ctx)
+{
+    if ( ctx->n_threads < 2 ) return;
+
+    ctx->hash_head = 0;
+    ctx->hash_tail = 0;
+    ctx->hash_waiting = 0;
+
+    // set first, as the worker clears it itself when it stops
+    ctx->hash_active = 1;
+
+    if ( submit_task(ctx, hash_task, ctx) != 0 ) ctx->hash_active = 0;
+}
+
+
+// Stops the hash worker, leaving the HMAC state as if it had been updated
+// on this thread.
+
+static void hash_stop(fpk_context_t* ctx)
+{
+    if ( !ctx->hash_active ) return;
+
+    hash_push(ctx, NULL, 0);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    while (ctx->hash_active)
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+static void threads_end(fpk_context_t* ctx)
+{
+    if ( !uses_threads(ctx) ) return;
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+    hash_stop(ctx);
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    pthread_cond_destroy(&ctx->wake);
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+#endif /* FPK_ENABLE_THREADS */
+
+
+static void capture_crc32(fpk_context_t* ctx, const uint8_t* data,
+        size_t length)
+{
+#ifdef FPK_ENABLE_THREADS
+    if ( ctx->n_threads > 1 )
+    {
+        crc32_update_parallel(ctx, data, length);
+        return;
+    }
+#endif /* FPK_ENABLE_THREADS */
+
+    crc32_update(ctx, data, length);
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static void capture_auth(fpk_context_t* ctx, const uint8_t* data,
+        size_t length)
+{
+#ifdef FPK_ENABLE_THREADS
+    if ( ctx->hash_active )
+    {
+        hash_push(ctx, data, length);
+        return;
+    }
+#endif /* FPK_ENABLE_THREADS */
+
+    hmac_update(ctx, data, length);
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+static void decipher(fpk_context_t* ctx, uint8_t* out, const uint8_t* in,
+        uint32_t n_blocks)
+{
+#ifdef FPK_ENABLE_THREADS
+    if ( ctx->n_threads > 1 )
+    {
+        aes128_decrypt_cbc_parallel(ctx, out, in, n_blocks);
+        return;
+    }
+#endif /* FPK_ENABLE_THREADS */
+
+    aes128_decrypt_cbc(ctx, out, in, n_blocks);
+}
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+/* ==== INPUT PARSING ====================================================== */
+
+// Brings in the next n_blocks of input and points *data at them. Input
+// from the read hooks lands in buffer, whereas input from memory is used
+// where it lies.
+
+static fpk_result_t fetch_blocks(fpk_context_t* ctx, uint8_t* buffer,
+        uint32_t n_blocks, const uint8_t** data)
+{
+    size_t n_bytes = (size_t) n_blocks * 16;
+
+    if ( ctx->source )
+    {
+        if ( ctx->source_length - ctx->source_position < n_bytes )
+            return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+        *data = ctx->source + ctx->source_position;
+        ctx->source_position += n_bytes;
+    }
+    else
+    {
+        fpk_result_t result = read_file(ctx, buffer, n_bytes);
+        if ( result != FPK_RESULT_OK ) return result;
+
+        *data = buffer;
+    }
+
+#ifdef FPK_ENABLE_STATISTICS
+    ctx->stats.bytes_read += n_bytes;
+#endif /* FPK_ENABLE_STATISTICS */
+
+    return FPK_RESULT_OK;
+}
+
+
+// Passes n_blocks of fetched input through whichever of the CRC32, HMAC
+// and cipher are active and returns where the result is, which is buffer
+// if it had to be deciphered.
+
+static const uint8_t* filter_blocks(fpk_context_t* ctx, uint8_t* buffer,
+        const uint8_t* data, uint32_t n_blocks)
+{
+    uint16_t flags = ctx->flags;
+    size_t n_bytes = (size_t) n_blocks * 16;
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+    if ( flags & FLAG_CAPTURE_AUTH )
+    {
+        STATS_BEGIN(ctx);
+        capture_auth(ctx, data, n_bytes);
+        STATS_END(ctx, authentication, n_bytes);
+    }
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    if ( flags & FLAG_CAPTURE_CRC32 )
+    {
+        STATS_BEGIN(ctx);
+        capture_crc32(ctx, data, n_bytes);
+        STATS_END(ctx, crc32, n_bytes);
+    }
+
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_HMAC_SHA256)
+    // the buffer is about to be deciphered in place or refilled
+    if ( !ctx->source ) hash_drain(ctx);
+#endif /* FPK_ENABLE_THREADS && FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+    if ( flags & FLAG_DECIPHER )
+    {
+        STATS_BEGIN(ctx);
+        decipher(ctx, buffer, data, n_blocks);
+        STATS_END(ctx, cipher, n_bytes);
+
+        data = buffer;
+    }
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    return data;
+}
+
+
+// Brings in and filters the next n_blocks of input, leaving ctx->input_data
+// pointing at the result.
+
+static fpk_result_t read_blocks(fpk_context_t* ctx, uint32_t n_blocks)
+{
+    const uint8_t* data;
+    fpk_result_t result;
+
+    result = fetch_blocks(ctx, ctx->input_buffer, n_blocks, &data);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    ctx->input_data = filter_blocks(ctx, ctx->input_buffer, data, n_blocks);
+
+    return FPK_RESULT_OK;
+}
+
+
+// Limits n_blocks to what a single read_blocks call can take. That is
+// bounded by the size of the input buffer unless the input is in memory
+// and doesn't need deciphering.
+
+static uint32_t max_blocks(fpk_context_t* ctx, uint32_t n_blocks)
+{
+    uint32_t limit = ctx->input_buffer_size / 16;
+
+    if ( ctx->source && !(ctx->flags & FLAG_DECIPHER) ) return n_blocks;
+    if ( n_blocks > limit ) n_blocks = limit;
+
+    return n_blocks;
+}
+
+
+/* ==== PAYLOAD PARSING ==================================================== */
+
+// The payload is parsed incrementally from whatever runs of (deciphered)
+// input arrive, so fields and image data may be split across calls at any
+// point. Short fields are collected in the key or data buffer until
+// complete.
+
+static void expect_field(fpk_context_t* ctx, uint8_t payload_state,
+        uint8_t length)
+{
+    ctx->payload_state = payload_state;
+    ctx->field_length = length;
+    ctx->field_fill = 0;
+}
+
+
+// Returns non-zero once the field being collected into buffer is complete.
+
+static int gather_field(fpk_context_t* ctx, uint8_t* buffer,
+        const uint8_t** data, size_t* length)
+{
+    size_t n = ctx->field_length - ctx->field_fill;
+
+    if ( n > *length ) n = *length;
+
+    memcpy(buffer + ctx->field_fill, *data, n);
+
+    ctx->field_fill += (uint8_t) n;
+    *data += n;
+    *length -= n;
+
+    return ctx->field_fill == ctx->field_length;
+}
+
+
+static void next_metadata(fpk_context_t* ctx)
+{
+    if ( ctx->n_objects > 0 )
+    {
+        ctx->n_objects--;
+        expect_field(ctx, PAYLOAD_META_KEY_LENGTH, 1);
+    }
+    else
+    {
+        expect_field(ctx, PAYLOAD_IMAGE_COUNT, 2);
+    }
+}
+
+
+static void next_image(fpk_context_t* ctx)
+{
+    if ( ctx->n_objects > 0 )
+    {
+        ctx->n_objects--;
+        expect_field(ctx, PAYLOAD_IMAGE_ID_LENGTH, 1);
+    }
+    else
+    {
+        ctx->payload_state = PAYLOAD_DONE;
+    }
+}
+
+
+// Where the next block of the body lies in the package.
+
+static uint32_t body_position(fpk_context_t* ctx)
+{
+    return 16 + (ctx->n_body_blocks - ctx->n_blocks) * 16;
+}
+
+
+// Records the image about to start in the index, length bytes before the
+// end of the current run of input.
+
+static void index_image(fpk_context_t* ctx, size_t length)
+{
+    fpk_image_entry_t* entry;
+
+    if ( ctx->n_indexed < ctx->index_size )
+    {
+        entry = &ctx->index[ctx->n_indexed];
+
+        memcpy(entry->id, ctx->key_buffer, FPK_KEY_BUFFER_SIZE);
+        entry->offset = body_position(ctx) - (uint32_t) length;
+        entry->length = ctx->image_remaining;
+    }
+
+    ctx->n_indexed++;
+}
+
+
+// With image_destination, ctx->page is the segment being filled and
+// ctx->segments the one after it.
+
+static void fill_segment(fpk_context_t* ctx, size_t length)
+{
+    ctx->page_fill += length;
+    ctx->image_offset += (uint32_t) length;
+    ctx->image_remaining -= (uint32_t) length;
+
+    while (ctx->page_fill == ctx->page_size && ctx->image_remaining > 0)
+    {
+        ctx->page = ctx->segments->data;
+        ctx->page_size = ctx->segments->length;
+        ctx->page_fill = 0;
+        ctx->segments++;
+    }
+}
+
+
+static fpk_result_t begin_segments(fpk_context_t* ctx, const char* id)
+{
+    const fpk_segment_t* segments;
+    unsigned n_segments = 0;
+    size_t size = 0;
+
+    STATS_BEGIN(ctx);
+
+    segments = ctx->hooks->image_destination(id, ctx->image_remaining,
+            &n_segments, ctx->user_data);
+
+    STATS_END(ctx, prepare_memory, 0);
+
+    if ( !segments ) return FPK_RESULT_OK;
+
+    for (unsigned i = 0; i < n_segments; i++)
+    {
+        if ( segments[i].length > ctx->image_remaining - size )
+        {
+            size = ctx->image_remaining;
+            break;
+        }
+
+        size += segments[i].length;
+    }
+
+    if ( size < ctx->image_remaining ) return FPK_RESULT_PROGRAM_ERROR;
+
+    ctx->segments = segments;
+    ctx->page_size = 0;
+    fill_segment(ctx, 0);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t begin_image(fpk_context_t* ctx, size_t length)
+{
+    const char* id = (const char*) ctx->key_buffer;
+    fpk_result_t result;
+
+    ctx->image_remaining = parse_u32(ctx->data_buffer);
+    ctx->image_offset = 0;
+    ctx->page_fill = 0;
+
+    if ( ctx->flags & FLAG_INDEX )
+    {
+        index_image(ctx, length);
+
+        ctx->payload_state = PAYLOAD_IMAGE_SKIP;
+        return FPK_RESULT_OK;
+    }
+
+    if ( ctx->hooks->select_image &&
+        !ctx->hooks->select_image(id, ctx->image_remaining, ctx->user_data) )
+    {
+        ctx->payload_state = PAYLOAD_IMAGE_SKIP;
+        return FPK_RESULT_OK;
+    }
+
+    result = prepare_memory(ctx, id, ctx->image_remaining);
+
+    if ( result != FPK_RESULT_OK ) return result;
+
+    ctx->segments = NULL;
+
+    if ( ctx->hooks->image_destination )
+    {
+        result = begin_segments(ctx, id);
+        if ( result != FPK_RESULT_OK ) return result;
+    }
+
+    if ( !ctx->segments &&
+        (ctx->hooks->program_page || ctx->hooks->program_page_async) )
+    {
+        ctx->page_size = 0;
+        ctx->page = program_buffer(ctx, &ctx->page_size);
+
+        if ( !ctx->page || ctx->page_size == 0 )
+            return FPK_RESULT_MANDATORY_HOOK_MISSING;
+
+        if ( ctx->hooks->program_page_async && !ctx->hooks->wait_program )
+            return FPK_RESULT_MANDATORY_HOOK_MISSING;
+
+        ctx->slots = ctx->page;
+        ctx->slot = 0;
+    }
+
+    ctx->payload_state = PAYLOAD_IMAGE_DATA;
+
+    return FPK_RESULT_OK;
+}
+
+
+// Copies image data into the segments from image_destination, for what
+// couldn't be read straight into them.
+
+static fpk_result_t store_segments(fpk_context_t* ctx, const uint8_t** data,
+        size_t* length)
+{
+    while (ctx->image_remaining > 0 && *length > 0)
+    {
+        size_t n = ctx->page_size - ctx->page_fill;
+
+        if ( n > ctx->image_remaining ) n = ctx->image_remaining;
+        if ( n > *length ) n = *length;
+
+        memcpy(ctx->page + ctx->page_fill, *data, n);
+
+        fill_segment(ctx, n);
+        *data += n;
+        *length -= n;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+// Hands image data to program_view where it lies.
+
+static fpk_result_t program_views(fpk_context_t* ctx, const uint8_t** data,
+        size_t* length)
+{
+    fpk_result_t result;
+    size_t n = *length;
+
+    if ( n > ctx->image_remaining ) n = ctx->image_remaining;
+    if ( n == 0 ) return FPK_RESULT_OK;
+
+    result = program_view(ctx, (const char*) ctx->key_buffer,
+            ctx->image_offset, *data, n);
+
+    *data += n;
+    *length -= n;
+    ctx->image_offset += (uint32_t) n;
+    ctx->image_remaining -= (uint32_t) n;
+
+    return result;
+}
+
+
+// Hands image data to program_memory in chunks of FPK_DATA_BUFFER_SIZE
+// bytes (bar the last), passing them straight from the input when they
+// lie there whole and collecting them in the data buffer otherwise.
+
+static fpk_result_t program_chunks(fpk_context_t* ctx, const uint8_t** data,
+        size_t* length)
+{
+    const char* id = (const char*) ctx->key_buffer;
+
+    while (ctx->image_remaining > 0 && *length > 0)
+    {
+        fpk_result_t result;
+        uint32_t chunk = ctx->image_remaining;
+
+        if ( chunk > FPK_DATA_BUFFER_SIZE ) chunk = FPK_DATA_BUFFER_SIZE;
+
+        if ( ctx->page_fill == 0 && *length >= chunk )
+        {
+            result = program_memory(ctx, id, *data, chunk);
+
+            *data += chunk;
+            *length -= chunk;
+        }
+        else
+        {
+            size_t n = chunk - ctx->page_fill;
+
+            if ( n > *length ) n = *length;
+
+            memcpy(ctx->data_buffer + ctx->page_fill, *data, n);
+
+            ctx->page_fill += n;
+            *data += n;
+            *length -= n;
+
+            if ( ctx->page_fill < chunk ) break;
+
+            result = program_memory(ctx, id, ctx->data_buffer, chunk);
+            ctx->page_fill = 0;
+        }
+
+        if ( result != FPK_RESULT_OK ) return result;
+
+        ctx->image_remaining -= chunk;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+// Hands image data to program_page one whole page at a time, followed by
+// any partial page at the end to program_tail. Pages are assembled in the
+// buffer from the program_buffer hook, except when a whole page already
+// lies in the input at an address at least as aligned as that buffer (up
+// to 64 bytes), in which case it is passed on directly. With
+// program_page_async every page is assembled in a slot and started there.
+
+static fpk_result_t program_pages(fpk_context_t* ctx, const uint8_t** data,
+        size_t* length)
+{
+    const char* id = (const char*) ctx->key_buffer;
+    uintptr_t align_mask;
+
+    // the lowest set bit of the buffer's address, capped at 64
+    align_mask = (uintptr_t) ctx->page & (0 - (uintptr_t) ctx->page);
+    if ( align_mask == 0 || align_mask > 64 ) align_mask = 64;
+    align_mask -= 1;
+
+    while (ctx->image_remaining > 0 && *length > 0)
+    {
+        fpk_result_t result;
+        size_t span = ctx->page_size;
+
+        if ( span > ctx->image_remaining ) span = ctx->image_remaining;
+
+        if ( ctx->page_fill == 0 && span == ctx->page_size &&
+            *length >= span && ((uintptr_t) *data & align_mask) == 0 &&
+            !ctx->hooks->program_page_async )
+        {
+            result = program_page(ctx, id, ctx->image_offset, *data, span);
+
+            *data += span;
+            *length -= span;
+        }
+        else
+        {
+            size_t n = span - ctx->page_fill;
+
+            if ( n > *length ) n = *length;
+
+            memcpy(ctx->page + ctx->page_fill, *data, n);
+
+            ctx->page_fill += n;
+            *data += n;
+            *length -= n;
+
+            if ( ctx->page_fill < span ) break;
+
+            if ( ctx->hooks->program_page_async )
+            {
+                result = start_page(ctx, id, ctx->image_offset, span);
+            }
+            else if ( span == ctx->page_size )
+            {
+                result = program_page(ctx, id, ctx->image_offset, ctx->page,
+                        span);
+            }
+            else
+            {
+                result = program_tail(ctx, id, ctx->image_offset, ctx->page,
+                        span);
+            }
+
+            ctx->page_fill = 0;
+        }
+
+        if ( result != FPK_RESULT_OK ) return result;
+
+        ctx->image_offset += span;
+        ctx->image_remaining -= span;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+// Feeds a run of payload bytes through the parser, calling the metadata
+// and programming hooks as things complete. Anything after the last image
+// is padding and ignored.
+
+static fpk_result_t parse_payload(fpk_context_t* ctx, const uint8_t* data,
+        size_t length)
+{
+    fpk_result_t result;
+    uint8_t* key_buffer = ctx->key_buffer;
+    uint8_t* data_buffer = ctx->data_buffer;
+    size_t n;
+
+    for (;;)
+    {
+        switch (ctx->payload_state)
+        {
+        case PAYLOAD_META_COUNT:
+            if ( !gather_field(ctx, data_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            ctx->n_objects = parse_u16(data_buffer);
+            next_metadata(ctx);
+            break;
+
+        case PAYLOAD_META_KEY_LENGTH:
+            if ( !gather_field(ctx, key_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            if ( key_buffer[0] >= FPK_KEY_BUFFER_SIZE )
+                return FPK_RESULT_INVALID_METADATA;
+
+            expect_field(ctx, PAYLOAD_META_KEY, key_buffer[0]);
+            break;
+
+        case PAYLOAD_META_KEY:
+            if ( !gather_field(ctx, key_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            key_buffer[ctx->field_length] = 0;
+            expect_field(ctx, PAYLOAD_META_VALUE_LENGTH, 1);
+            break;
+
+        case PAYLOAD_META_VALUE_LENGTH:
+            if ( !gather_field(ctx, data_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            if ( data_buffer[0] >= FPK_DATA_BUFFER_SIZE )
+                return FPK_RESULT_INVALID_METADATA;
+
+            expect_field(ctx, PAYLOAD_META_VALUE, data_buffer[0]);
+            break;
+
+        case PAYLOAD_META_VALUE:
+            if ( !gather_field(ctx, data_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            data_buffer[ctx->field_length] = 0;
+
+            result = handle_metadata(
+                ctx,
+                (const char*) key_buffer,
+                (const char*) data_buffer
+            );
+
+            if ( result != FPK_RESULT_OK ) return result;
+
+            next_metadata(ctx);
+            break;
+
+        case PAYLOAD_IMAGE_COUNT:
+            // a probe stops short of the images
+            if ( ctx->flags & FLAG_PROBE ) return FPK_RESULT_OK;
+
+            if ( !gather_field(ctx, data_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            ctx->n_objects = parse_u16(data_buffer);
+            next_image(ctx);
+            break;
+
+        case PAYLOAD_IMAGE_ID_LENGTH:
+            if ( !gather_field(ctx, key_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            if ( key_buffer[0] >= FPK_KEY_BUFFER_SIZE )
+                return FPK_RESULT_INVALID_IMAGE;
+
+            expect_field(ctx, PAYLOAD_IMAGE_ID, key_buffer[0]);
+            break;
+
+        case PAYLOAD_IMAGE_ID:
+            if ( !gather_field(ctx, key_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            key_buffer[ctx->field_length] = 0;
+            expect_field(ctx, PAYLOAD_IMAGE_LENGTH, 4);
+            break;
+
+        case PAYLOAD_IMAGE_LENGTH:
+            if ( !gather_field(ctx, data_buffer, &data, &length) )
+                return FPK_RESULT_OK;
+
+            result = begin_image(ctx, length);
+            if ( result != FPK_RESULT_OK ) return result;
+            break;
+
+        case PAYLOAD_IMAGE_DATA:
+            if ( ctx->segments )
+                result = store_segments(ctx, &data, &length);
+            else if ( ctx->hooks->program_view )
+                result = program_views(ctx, &data, &length);
+            else if ( ctx->hooks->program_page ||
+                ctx->hooks->program_page_async )
+                result = program_pages(ctx, &data, &length);
+            else
+                result = program_chunks(ctx, &data, &length);
+
+            if ( result != FPK_RESULT_OK ) return result;
+            if ( ctx->image_remaining > 0 ) return FPK_RESULT_OK;
+
+            result = wait_pages(ctx);
+            if ( result != FPK_RESULT_OK ) return result;
+
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_HMAC_SHA256)
+            // the hash worker may still be reading the segments
+            if ( ctx->segments ) hash_drain(ctx);
+#endif /* FPK_ENABLE_THREADS && FPK_ENABLE_HMAC_SHA256 */
+
+            result = finalize_memory(ctx, (const char*) key_buffer);
+            if ( result != FPK_RESULT_OK ) return result;
+
+            next_image(ctx);
+            break;
+
+        case PAYLOAD_IMAGE_SKIP:
+            n = (length < ctx->image_remaining) ? length :
+                    ctx->image_remaining;
+
+            data += n;
+            length -= n;
+            ctx->image_remaining -= (uint32_t) n;
+
+            if ( ctx->image_remaining > 0 ) return FPK_RESULT_OK;
+
+            next_image(ctx);
+            break;
+
+        default:
+            return FPK_RESULT_OK;
+        }
+    }
+}
+
+
+/* ==== PIPELINE =========================================================== */
+
+#ifdef FPK_ENABLE_THREADS
+
+// With FPK_OPTION_PIPELINE the body is fetched by read_task, filtered by
+// filter_task and parsed by the calling thread, all at once. Chunks of the
+// read buffer go round from the free ring to the read ring to the ready
+// ring and back. Each ring has a slot for every chunk, so pushing never
+// has to wait.
+
+#define CHUNK_BLOCKS(ctx) \
+        ((uint32_t) ((ctx)->input_buffer_size / FPK_PIPELINE_CHUNKS / 16))
+
+
+static void ring_push(fpk_context_t* ctx, fpk_ring_t* ring,
+        fpk_chunk_t* chunk)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    ring->slots[ring->head++ % FPK_PIPELINE_CHUNKS] = chunk;
+
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+// Waits for the next chunk on ring, or returns NULL if the pipeline is
+// being stopped.
+
+static fpk_chunk_t* ring_pop(fpk_context_t* ctx, fpk_ring_t* ring)
+{
+    fpk_chunk_t* chunk = NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    while (ring->head == ring->tail && !ctx->pipeline_stop)
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+
+    if ( !ctx->pipeline_stop )
+        chunk = ring->slots[ring->tail++ % FPK_PIPELINE_CHUNKS];
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return chunk;
+}
+
+
+static void end_stage(fpk_context_t* ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pipeline_stages--;
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+// Fetches ctx->pipeline_blocks of input into free chunks. The last chunk,
+// or the first to fail, is marked as such.
+
+static void read_task(void* arg)
+{
+    fpk_context_t* ctx = arg;
+    uint32_t remaining = ctx->pipeline_blocks;
+    uint32_t chunk_blocks = CHUNK_BLOCKS(ctx);
+    fpk_chunk_t* chunk;
+
+    while ((chunk = ring_pop(ctx, &ctx->free_chunks)))
+    {
+        uint8_t last;
+
+        chunk->n_blocks = (remaining < chunk_blocks) ? remaining :
+                chunk_blocks;
+        chunk->result = fetch_blocks(ctx, chunk->buffer, chunk->n_blocks,
+                &chunk->data);
+
+        remaining -= chunk->n_blocks;
+        last = (remaining == 0 || chunk->result != FPK_RESULT_OK);
+        chunk->last = last;
+
+        ring_push(ctx, &ctx->read_chunks, chunk);
+        if ( last ) break;
+    }
+
+    end_stage(ctx);
+}
+
+
+static void filter_task(void* arg)
+{
+    fpk_context_t* ctx = arg;
+    fpk_chunk_t* chunk;
+
+    while ((chunk = ring_pop(ctx, &ctx->read_chunks)))
+    {
+        uint8_t last = chunk->last;
+
+        if ( chunk->result == FPK_RESULT_OK )
+        {
+            chunk->data = filter_blocks(ctx, chunk->buffer, chunk->data,
+                    chunk->n_blocks);
+        }
+
+        ring_push(ctx, &ctx->ready_chunks, chunk);
+        if ( last ) break;
+    }
+
+    end_stage(ctx);
+}
+
+
+// Tells the stages to stop and waits until they have.
+
+static void stop_pipeline(fpk_context_t* ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    ctx->pipeline_stop = 1;
+    pthread_cond_broadcast(&ctx->wake);
+
+    while (ctx->pipeline_stages > 0)
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+// Runs the rest of the body through the pipeline, returning 0 without
+// touching it if the pipeline can't be used.
+
+static int pipeline_body(fpk_context_t* ctx, fpk_result_t* result)
+{
+    uint8_t* buffer = ctx->input_buffer;
+    size_t chunk_size = (size_t) CHUNK_BLOCKS(ctx) * 16;
+    fpk_chunk_t* chunk;
+    uint8_t last;
+
+    if ( !(ctx->options & FPK_OPTION_PIPELINE) ||
+        (ctx->flags & FLAG_PUSH) ||
+        (ctx->flags & FLAG_SCRATCH_INPUT) ||
+        chunk_size == 0 ) return 0;
+
+    ctx->free_chunks.head = 0;
+    ctx->free_chunks.tail = 0;
+    ctx->read_chunks = ctx->free_chunks;
+    ctx->ready_chunks = ctx->free_chunks;
+
+    for (size_t i = 0; i < FPK_PIPELINE_CHUNKS; i++)
+    {
+        ctx->chunks[i].buffer = buffer + i * chunk_size;
+        ctx->free_chunks.slots[ctx->free_chunks.head++] = &ctx->chunks[i];
+    }
+
+    ctx->pipeline_blocks = ctx->n_blocks;
+    ctx->pipeline_stop = 0;
+    ctx->pipeline_stages = 2;
+
+    if ( submit_task(ctx, filter_task, ctx) != 0 ) return 0;
+
+    if ( submit_task(ctx, read_task, ctx) != 0 )
+    {
+        // nothing has been read yet, so leave it to the calling thread
+        end_stage(ctx);
+        stop_pipeline(ctx);
+
+        return 0;
+    }
+
+    do
+    {
+        chunk = ring_pop(ctx, &ctx->ready_chunks);
+        last = chunk->last;
+        *result = chunk->result;
+
+        if ( *result == FPK_RESULT_OK )
+        {
+            ctx->n_blocks -= chunk->n_blocks;
+
+            if ( !(ctx->flags & FLAG_VERIFY_ONLY) )
+            {
+                *result = parse_payload(ctx, chunk->data,
+                        (size_t) chunk->n_blocks * 16);
+            }
+        }
+
+        ring_push(ctx, &ctx->free_chunks, chunk);
+
+    } while (*result == FPK_RESULT_OK && !last &&
+        !((ctx->flags & FLAG_VERIFIED) && ctx->payload_state == PAYLOAD_DONE));
+
+    stop_pipeline(ctx);
+
+    return 1;
+}
+
+#endif /* FPK_ENABLE_THREADS */
+
+
+/* ==== UNPACKING ========================================================== */
+
+// Each of the following handles the block(s) just read for the current
+// state and moves on to the next one.
+
+static fpk_result_t begin_body(fpk_context_t* ctx)
+{
+    ctx->state = STATE_BODY;
+
+    // the IV is only needed when the body is actually being deciphered
+    if ( ctx->cipher_type != FPK_CIPHER_TYPE_NONE &&
+        !(ctx->flags & FLAG_VERIFY_ONLY) )
+    {
+        if ( ctx->n_blocks == 0 ) return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+        ctx->state = STATE_IV;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static fpk_result_t reset_auth(fpk_context_t* ctx)
+{
+    const fpk_key_t* prepared;
+    const uint8_t* key;
+
+    prepared = prepared_authentication_key(ctx, ctx->auth_type);
+
+    if ( prepared )
+    {
+        if ( prepared->type != FPK_KEY_TYPE_HMAC_SHA256 )
+            return FPK_RESULT_NO_AUTHENTICATION_KEY;
+
+        hmac_reset_prepared(ctx, prepared);
+    }
+    else
+    {
+        key = authentication_key(ctx, ctx->auth_type);
+        if ( !key ) return FPK_RESULT_NO_AUTHENTICATION_KEY;
+
+        hmac_reset(ctx, key);
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t begin_auth(fpk_context_t* ctx)
+{
+    fpk_result_t result = reset_auth(ctx);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    ctx->flags |= FLAG_CAPTURE_AUTH;
+
+#ifdef FPK_ENABLE_THREADS
+    hash_start(ctx);
+#endif /* FPK_ENABLE_THREADS */
+
+    return FPK_RESULT_OK;
+}
+
+
+
+// Derives the verification cache key for the package whose header has just
+// been read into ctx->verify_key, by reading in the signature and trailer
+// and seeking back to the body. Returns 0 if it can't, as for a truncated
+// package, which is left for the verification pass to fail on.
+
+static int derive_verify_key(fpk_context_t* ctx, const uint8_t* identity,
+        size_t size)
+{
+    uint8_t header[16];
+    uint8_t buffer[48];
+    const uint8_t* tail;
+    uint32_t n_tail = 1;
+    uint64_t position = 16 + (uint64_t) ctx->n_body_blocks * 16;
+
+    if ( ctx->auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 ) n_tail = 3;
+
+    if ( position > UINT32_MAX ) return 0;
+
+    memcpy(header, ctx->input_data, 16);
+
+    if ( seek_file(ctx, (uint32_t) position) != FPK_RESULT_OK ) return 0;
+
+    if ( fetch_blocks(ctx, buffer, n_tail, &tail) != FPK_RESULT_OK ||
+        seek_file(ctx, 16) != FPK_RESULT_OK ) return 0;
+
+    if ( n_tail == 3 )
+    {
+        if ( reset_auth(ctx) != FPK_RESULT_OK ) return 0;
+    }
+    else
+    {
+        sha256_reset(ctx);
+    }
+
+    sha256_update(ctx, identity, size);
+    sha256_update(ctx, header, 16);
+    sha256_update(ctx, tail, (size_t) n_tail * 16);
+
+    if ( n_tail == 3 ) hmac_digest(ctx, ctx->verify_key);
+    else sha256_digest(ctx, ctx->verify_key);
+
+    return 1;
+}
+
+
+// Looks the package up in the verification cache before the verification
+// pass, and on a hit goes straight on to the second pass instead.
+
+static fpk_result_t check_verify_cache(fpk_context_t* ctx)
+{
+    const fpk_hooks_t* hooks = ctx->hooks;
+    const uint8_t* identity;
+    size_t size = 0;
+
+    if ( !hooks->package_identity || !hooks->lookup_verified )
+        return FPK_RESULT_OK;
+
+    identity = hooks->package_identity(&size, ctx->user_data);
+    if ( !identity ) return FPK_RESULT_OK;
+
+    // after a failure, where the input is up to is anyone's guess
+    if ( !derive_verify_key(ctx, identity, size) ) return seek_file(ctx, 16);
+
+    if ( hooks->lookup_verified(ctx->verify_key, ctx->user_data) )
+    {
+        ctx->flags &= ~(FLAG_VERIFY_ONLY | FLAG_CAPTURE_CRC32);
+        ctx->flags |= FLAG_VERIFIED;
+    }
+    else if ( hooks->store_verified )
+    {
+        ctx->flags |= FLAG_STORE_VERIFIED;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+static fpk_result_t parse_header(fpk_context_t* ctx)
+{
+    const uint8_t* input = ctx->input_data;
+
+    if ( input[0] != 0x46 ||
+        input[1] != 0x50 ||
+        input[2] != 0x4B ) return FPK_RESULT_INVALID_FPK_FILE;
+
+    if ( input[3] != 0x00 ) return FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION;
+
+    ctx->timestamp = parse_u32(input + 4);
+    ctx->n_blocks = parse_u32(input + 8);
+    ctx->n_body_blocks = ctx->n_blocks;
+
+    ctx->auth_type = input[12];
+    ctx->cipher_type = input[13];
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+    if ( ctx->auth_type == FPK_AUTHENTICATION_TYPE_NONE )
+    {
+        if ( ctx->options & FPK_OPTION_ENFORCE_AUTHENTICATION )
+        {
+            return FPK_RESULT_SIGNATURE_MISSING;
+        }
+    }
+    else if ( ctx->auth_type != FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
+    {
+        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+    }
+
+#else /* FPK_ENABLE_HMAC_SHA256 */
+
+    if ( ctx->auth_type != FPK_AUTHENTICATION_TYPE_NONE )
+    {
+        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+    }
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+    if ( ctx->cipher_type != FPK_CIPHER_TYPE_NONE &&
+        ctx->cipher_type != FPK_CIPHER_TYPE_AES128_CBC )
+    {
+        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+    }
+
+#else /* FPK_ENABLE_AES128_CBC */
+
+    if ( ctx->cipher_type != FPK_CIPHER_TYPE_NONE )
+    {
+        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+    }
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+    if ( ctx->flags & FLAG_VERIFY_ONLY )
+    {
+        fpk_result_t result = check_verify_cache(ctx);
+        if ( result != FPK_RESULT_OK ) return result;
+    }
+
+    if ( ctx->auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 &&
+        !(ctx->flags & (FLAG_PROBE | FLAG_VERIFIED)) )
+    {
+        fpk_result_t result = begin_auth(ctx);
+        if ( result != FPK_RESULT_OK ) return result;
+    }
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    return begin_body(ctx);
+}
+
+
+static fpk_result_t begin_decipher(fpk_context_t* ctx)
+{
+#ifdef FPK_ENABLE_AES128_CBC
+
+    const fpk_key_t* prepared;
+    const uint8_t* key = NULL;
+
+    prepared = prepared_cipher_key(ctx, ctx->cipher_type);
+
+    if ( prepared )
+    {
+        if ( prepared->type != FPK_KEY_TYPE_AES128_CBC )
+            return FPK_RESULT_NO_CIPHER_KEY;
+    }
+    else
+    {
+        key = cipher_key(ctx, ctx->cipher_type);
+        if ( !key ) return FPK_RESULT_NO_CIPHER_KEY;
+    }
+
+    if ( prepared ) aes128_init_prepared(ctx, prepared, ctx->input_data);
+    else aes128_init(ctx, key, ctx->input_data);
+
+    ctx->flags |= FLAG_DECIPHER;
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    ctx->n_blocks--;
+    ctx->state = STATE_BODY;
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t end_body(fpk_context_t* ctx)
+{
+    if ( !(ctx->flags & FLAG_VERIFY_ONLY) &&
+        ctx->payload_state != PAYLOAD_DONE )
+    {
+        return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+    }
+
+    if ( ctx->flags & FLAG_VERIFIED )
+    {
+        ctx->state = STATE_DONE;
+        return FPK_RESULT_OK;
+    }
+
+    ctx->flags &= ~(FLAG_DECIPHER | FLAG_CAPTURE_AUTH);
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+    if ( ctx->auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
+    {
+#ifdef FPK_ENABLE_THREADS
+        hash_stop(ctx);
+#endif /* FPK_ENABLE_THREADS */
+
+        hmac_digest(ctx, ctx->hmac);
+
+        ctx->n_blocks = 2;
+        ctx->state = STATE_SIGNATURE;
+
+        return FPK_RESULT_OK;
+    }
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    ctx->flags &= ~FLAG_CAPTURE_CRC32;
+    ctx->state = STATE_TRAILER;
+
+    return FPK_RESULT_OK;
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static fpk_result_t check_signature(fpk_context_t* ctx)
+{
+    const uint8_t* expected = ctx->hmac + (2 - ctx->n_blocks) * 16;
+
+    if ( memcmp(ctx->input_data, expected, 16) != 0 )
+        return FPK_RESULT_INVALID_SIGNATURE;
+
+    if ( --ctx->n_blocks == 0 )
+    {
+        ctx->flags &= ~FLAG_CAPTURE_CRC32;
+        ctx->state = STATE_TRAILER;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+static fpk_result_t check_trailer(fpk_context_t* ctx)
+{
+    fpk_result_t result;
+
+    if ( parse_u32(ctx->input_data) != ctx->crc32 )
+        return FPK_RESULT_CRC_MISMATCH;
+
+    if ( !(ctx->flags & FLAG_VERIFY_ONLY) )
+    {
+        ctx->state = STATE_DONE;
+        return FPK_RESULT_OK;
+    }
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+    if ( ctx->flags & FLAG_STORE_VERIFIED )
+        ctx->hooks->store_verified(ctx->verify_key, ctx->user_data);
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    // two-pass: now that the package has checked out, go back over the
+    // body to decipher and unpack it
+
+    result = seek_file(ctx, 16);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    ctx->flags = (ctx->flags & ~FLAG_VERIFY_ONLY) | FLAG_VERIFIED;
+    ctx->n_blocks = ctx->n_body_blocks;
+
+    return begin_body(ctx);
+}
+
+
+// Passes over the whole blocks of an image that isn't wanted by seeking
+// past them, which is fine once the package has been verified. With a
+// cipher, the block before the new position is read in as the IV.
+
+static fpk_result_t skip_image(fpk_context_t* ctx)
+{
+    uint32_t n_blocks = ctx->image_remaining / 16;
+    fpk_result_t result;
+
+    if ( n_blocks > ctx->n_blocks ) n_blocks = ctx->n_blocks;
+
+    ctx->n_blocks -= n_blocks;
+    ctx->image_remaining -= n_blocks * 16;
+
+#ifdef FPK_ENABLE_AES128_CBC
+    if ( ctx->flags & FLAG_DECIPHER )
+    {
+        const uint8_t* data;
+
+        result = seek_file(ctx, body_position(ctx) - 16);
+        if ( result != FPK_RESULT_OK ) return result;
+
+        result = fetch_blocks(ctx, ctx->input_buffer, 1, &data);
+        if ( result != FPK_RESULT_OK ) return result;
+
+        memcpy(ctx->aes128_iv, data, AES128_KEY_LEN);
+        return FPK_RESULT_OK;
+    }
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    result = seek_file(ctx, body_position(ctx));
+
+    return result;
+}
+
+
+// Counts the whole blocks of image data that can be read straight into the
+// current segment from image_destination. The image's data always carries
+// on at the next block, since the parser has had everything before it.
+
+static uint32_t segment_blocks(fpk_context_t* ctx)
+{
+    uint32_t n_blocks = ctx->image_remaining / 16;
+    size_t limit = (ctx->page_size - ctx->page_fill) / 16;
+
+    if ( !ctx->segments || ctx->payload_state != PAYLOAD_IMAGE_DATA ||
+        (ctx->flags & FLAG_VERIFY_ONLY) ) return 0;
+
+    if ( n_blocks > ctx->n_blocks ) n_blocks = ctx->n_blocks;
+    if ( n_blocks > limit ) n_blocks = (uint32_t) limit;
+
+    // the read hooks are never asked for more than the input buffer holds
+    if ( ctx->source )
+        limit = (ctx->source_length - ctx->source_position) / 16;
+    else
+        limit = ctx->input_buffer_size / 16;
+
+    if ( n_blocks > limit ) n_blocks = (uint32_t) limit;
+
+    return n_blocks;
+}
+
+
+// Reads and filters n_blocks of image data straight into the current
+// segment, so that they are deciphered where they are to end up.
+
+static fpk_result_t read_segment(fpk_context_t* ctx, uint32_t n_blocks)
+{
+    uint8_t* out = ctx->page + ctx->page_fill;
+    size_t n_bytes = (size_t) n_blocks * 16;
+    const uint8_t* data;
+    fpk_result_t result;
+
+    result = fetch_blocks(ctx, out, n_blocks, &data);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    data = filter_blocks(ctx, out, data, n_blocks);
+
+    // only input in memory that isn't enciphered is left where it was
+    if ( data != out ) memcpy(out, data, n_bytes);
+
+    ctx->n_blocks -= n_blocks;
+    fill_segment(ctx, n_bytes);
+
+    // an image that ends on a block boundary is finished off by the parser
+    return parse_payload(ctx, out, 0);
+}
+
+
+// Runs the state machine until the package is done with, or input runs
+// out, or something fails. Input comes from ctx->source when set and the
+// read hooks otherwise. When pushed, running out of source means
+// FPK_RESULT_NEED_MORE_INPUT rather than an error.
+
+static fpk_result_t advance(fpk_context_t* ctx)
+{
+    while (ctx->state != STATE_DONE)
+    {
+        fpk_result_t result;
+        uint32_t n_blocks = 1;
+
+        if ( ctx->state == STATE_BODY )
+        {
+            // the second pass of a two-pass unpack can stop at the padding
+            if ( ctx->n_blocks == 0 || ((ctx->flags & FLAG_VERIFIED) &&
+                ctx->payload_state == PAYLOAD_DONE) )
+            {
+                result = end_body(ctx);
+                if ( result != FPK_RESULT_OK ) return result;
+
+                continue;
+            }
+
+            if ( ctx->payload_state == PAYLOAD_IMAGE_SKIP &&
+                (ctx->flags & FLAG_VERIFIED) && ctx->image_remaining >= 16 )
+            {
+                result = skip_image(ctx);
+                if ( result != FPK_RESULT_OK ) return result;
+
+                continue;
+            }
+
+#ifdef FPK_ENABLE_THREADS
+            if ( pipeline_body(ctx, &result) )
+            {
+                if ( result != FPK_RESULT_OK ) return result;
+
+                continue;
+            }
+#endif /* FPK_ENABLE_THREADS */
+
+            n_blocks = segment_blocks(ctx);
+
+            if ( n_blocks > 0 )
+            {
+                result = read_segment(ctx, n_blocks);
+                if ( result != FPK_RESULT_OK ) return result;
+
+                continue;
+            }
+
+            // a probe reads a block at a time so as to stop as soon as the
+            // metadata is done with
+            if ( ctx->flags & FLAG_PROBE )
+            {
+                if ( ctx->payload_state >= PAYLOAD_IMAGE_COUNT )
+                {
+                    ctx->state = STATE_DONE;
+                    continue;
+                }
+
+                n_blocks = 1;
+            }
+            else
+            {
+                // read as many blocks as possible so that the CRC, HMAC
+                // and cipher get to work on a run of them at once
+                n_blocks = max_blocks(ctx, ctx->n_blocks);
+
+                // but with image_destination, fields and blocks that
+                // segment_blocks couldn't take are read one at a time, so
+                // that hardly any image data misses its segment
+                if ( ctx->hooks->image_destination &&
+                    !(ctx->flags & FLAG_VERIFY_ONLY) &&
+                    (ctx->payload_state < PAYLOAD_IMAGE_DATA ||
+                    (ctx->payload_state == PAYLOAD_IMAGE_DATA &&
+                    ctx->segments)) ) n_blocks = 1;
+            }
+        }
+
+        if ( ctx->flags & FLAG_PUSH )
+        {
+            size_t available = (ctx->source_length - ctx->source_position)
+                    / 16;
+
+            if ( available == 0 ) return FPK_RESULT_NEED_MORE_INPUT;
+            if ( n_blocks > available ) n_blocks = (uint32_t) available;
+        }
+
+        result = read_blocks(ctx, n_blocks);
+        if ( result != FPK_RESULT_OK ) return result;
+
+        switch (ctx->state)
+        {
+        case STATE_HEADER:
+            result = parse_header(ctx);
+            break;
+
+        case STATE_IV:
+            result = begin_decipher(ctx);
+            break;
+
+        case STATE_BODY:
+            ctx->n_blocks -= n_blocks;
+
+            if ( !(ctx->flags & FLAG_VERIFY_ONLY) )
+            {
+                result = parse_payload(ctx, ctx->input_data,
+                        (size_t) n_blocks * 16);
+            }
+            break;
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+        case STATE_SIGNATURE:
+            result = check_signature(ctx);
+            break;
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+        default:
+            result = check_trailer(ctx);
+            break;
+        }
+
+        if ( result != FPK_RESULT_OK ) return result;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+/* ==== BATCH VERIFICATION ================================================= */
+
+// Checks what can be checked of a package without hashing its body: the
+// header, that it is all there, and (unless it is signed, when that has to
+// wait for the signature) its CRC32. A signed package that gets through is
+// left with FPK_RESULT_OK or FPK_RESULT_CRC_MISMATCH as its result, and
+// the signature decides between that and FPK_RESULT_INVALID_SIGNATURE.
+
+static fpk_result_t check_package(const fpk_verify_item_t* item,
+        uint32_t options)
+{
+    const uint8_t* data = item->data;
+    uint64_t length;
+    uint32_t crc;
+
+    if ( item->length < 16 ) return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+    if ( data[0] != 0x46 ||
+        data[1] != 0x50 ||
+        data[2] != 0x4B ) return FPK_RESULT_INVALID_FPK_FILE;
+
+    if ( data[3] != 0x00 ) return FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION;
+
+    length = 16 + (uint64_t) parse_u32(data + 8) * 16;
+
+    if ( data[12] == FPK_AUTHENTICATION_TYPE_NONE )
+    {
+        if ( options & FPK_OPTION_ENFORCE_AUTHENTICATION )
+            return FPK_RESULT_SIGNATURE_MISSING;
+    }
+#ifdef FPK_ENABLE_HMAC_SHA256
+    else if ( data[12] == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
+    {
+        if ( !item->key || item->key->type != FPK_KEY_TYPE_HMAC_SHA256 )
+            return FPK_RESULT_NO_AUTHENTICATION_KEY;
+
+        length += 32;
+    }
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+    else
+    {
+        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+    }
+
+#ifdef FPK_ENABLE_AES128_CBC
+    if ( data[13] != FPK_CIPHER_TYPE_NONE &&
+        data[13] != FPK_CIPHER_TYPE_AES128_CBC )
+#else /* FPK_ENABLE_AES128_CBC */
+    if ( data[13] != FPK_CIPHER_TYPE_NONE )
+#endif /* FPK_ENABLE_AES128_CBC */
+    {
+        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+    }
+
+    if ( item->length - 16 < length )
+        return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+    crc = ~crc32_compute(0, data, (size_t) length);
+
+    if ( parse_u32(data + length) != crc ) return FPK_RESULT_CRC_MISMATCH;
+
+    return FPK_RESULT_OK;
+}
+
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+static int needs_signature(const fpk_verify_item_t* item)
+{
+    return (item->result == FPK_RESULT_OK ||
+        item->result == FPK_RESULT_CRC_MISMATCH) &&
+        item->data[12] == FPK_AUTHENTICATION_TYPE_HMAC_SHA256;
+}
+
+
+static size_t signed_length(const fpk_verify_item_t* item)
+{
+    return (size_t) parse_u32(item->data + 8) * 16;
+}
+
+
+// Finishes the HMAC of a package whose first n_blocks 64-byte blocks of
+// body have been hashed into state, and checks it against the signature.
+
+static void finish_signature(fpk_context_t* ctx, fpk_verify_item_t* item,
+        const uint32_t* state, size_t n_blocks)
+{
+    const uint8_t* body = item->data + 16;
+    size_t length = signed_length(item);
+    uint8_t hmac[32];
+
+    memcpy(ctx->sha256_state, state, 32);
+    memcpy(ctx->hmac_outer_state, item->key->u.hmac_sha256.outer_state, 32);
+
+    ctx->sha256_buffer_in = 0;
+    ctx->sha256_bit_len = 512 + (uint64_t) n_blocks * 512;
+
+    hmac_update(ctx, body + n_blocks * 64, length - n_blocks * 64);
+    hmac_digest(ctx, hmac);
+
+    if ( memcmp(hmac, body + length, 32) != 0 )
+        item->result = FPK_RESULT_INVALID_SIGNATURE;
+}
+
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+
+typedef void (*sha256_mb_transform_t) (uint32_t* state,
+        const uint8_t* const* data);
+
+
+// Picks the multi-buffer transform to use, returning how many lanes it
+// has, or 1 if packages are best hashed one at a time.
+
+static unsigned sha256_lanes(sha256_mb_transform_t* transform)
+{
+    uint32_t features = cpu_features();
+
+    if ( features & CPU_FEATURE_AVX512 )
+    {
+        *transform = sha256_transform_x16;
+        return 16;
+    }
+
+    if ( features & CPU_FEATURE_SHANI ) return 1;
+
+    if ( features & CPU_FEATURE_AVX2 )
+    {
+        *transform = sha256_transform_x8;
+        return 8;
+    }
+
+    if ( features & CPU_FEATURE_SSE2 )
+    {
+        *transform = sha256_transform_x4;
+        return 4;
+    }
+
+    return 1;
+}
+
+
+// Hashes the signed packages among items n_lanes at a time. Each lane
+// takes the next package as soon as its last is down to less than a
+// block, which finish_signature() deals with, and idle lanes hash a dummy
+// block.
+
+static void sign_lanes(fpk_context_t* ctx, fpk_verify_item_t* items,
+        size_t n_items, sha256_mb_transform_t transform, unsigned n_lanes)
+{
+    static const uint8_t IDLE[64];
+    uint32_t state[8 * 16];
+    uint32_t lane_state[8];
+    const uint8_t* data[16];
+    fpk_verify_item_t* lane_items[16];
+    size_t hashed[16];
+    size_t next = 0;
+    unsigned active = 0;
+
+    for (unsigned l = 0; l < n_lanes; l++)
+    {
+        lane_items[l] = NULL;
+        data[l] = IDLE;
+    }
+
+    for (;;)
+    {
+        for (unsigned l = 0; l < n_lanes; l++)
+        {
+            while (!lane_items[l] && next < n_items)
+            {
+                fpk_verify_item_t* item = &items[next++];
+                const uint32_t* inner;
+
+                if ( !needs_signature(item) ) continue;
+
+                inner = item->key->u.hmac_sha256.inner_state;
+
+                if ( signed_length(item) < 64 )
+                {
+                    finish_signature(ctx, item, inner, 0);
+                    continue;
+                }
+
+                for (unsigned i = 0; i < 8; i++)
+                    state[i * n_lanes + l] = inner[i];
+
+                lane_items[l] = item;
+                data[l] = item->data + 16;
+                hashed[l] = 0;
+                active++;
+            }
+        }
+
+        if ( active == 0 ) break;
+
+        transform(state, data);
+
+        for (unsigned l = 0; l < n_lanes; l++)
+        {
+            fpk_verify_item_t* item = lane_items[l];
+
+            if ( !item ) continue;
+
+            data[l] += 64;
+
+            if ( ++hashed[l] < signed_length(item) / 64 ) continue;
+
+            for (unsigned i = 0; i < 8; i++)
+                lane_state[i] = state[i * n_lanes + l];
+
+            finish_signature(ctx, item, lane_state, hashed[l]);
+
+            lane_items[l] = NULL;
+            data[l] = IDLE;
+            active--;
+        }
+    }
+}
+
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+
+// The reference: one package at a time, through the same code as
+// unpacking.
+
+static void sign_each(fpk_context_t* ctx, fpk_verify_item_t* items,
+        size_t n_items)
+{
+    for (size_t i = 0; i < n_items; i++)
+    {
+        if ( needs_signature(&items[i]) )
+        {
+            finish_signature(ctx, &items[i],
+                    items[i].key->u.hmac_sha256.inner_state, 0);
+        }
+    }
+}
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+
+/* ==== API ================================================================ */
+
+
+#ifdef FPK_ENABLE_RESULT_TO_STRING
+
+const char* fpk_result_to_string(fpk_result_t result)
+{
+    switch(result)
+    {
+    case FPK_RESULT_OK:
+        return "OK";
+
+    case FPK_RESULT_READ_ERROR:
+        return "Read error";
+
+    case FPK_RESULT_UNEXPECTED_END_OF_INPUT:
+        return "Unexpected end of input";
+
+    case FPK_RESULT_ERASE_ERROR:
+        return "Erase error";
+
+    case FPK_RESULT_PROGRAM_ERROR:
+        return "Program error";
+
+    case FPK_RESULT_UNKNOWN_ID:
+        return "Unknown id";
+
+    case FPK_RESULT_CRC_MISMATCH:
+        return "CRC mismatch";
+
+    case FPK_RESULT_INVALID_SIGNATURE:
+        return "Invalid signature";
+        
+    case FPK_RESULT_SIGNATURE_MISSING:
         return "Signature missing";
 
-    case FPK_RESULT_NO_AUTHENTICATION_KEY:
-        return "No authentication key";
+    case FPK_RESULT_NO_AUTHENTICATION_KEY:
+        return "No authentication key";
+
+    case FPK_RESULT_NO_CIPHER_KEY:
+        return "No cipher key";
+
+    case FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE:
+        return "Unsupported authentication type";
+
+    case FPK_RESULT_UNSUPPORTED_CIPHER_TYPE:
+        return "Unsupported cipher type";
+        
+    case FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION:
+        return "Unsupported FPK file version";
+        
+    case FPK_RESULT_INVALID_FPK_FILE:
+        return "Invalid FPK file";
+        
+    case FPK_RESULT_INVALID_METADATA:
+        return "Invalid metadata";
+        
+    case FPK_RESULT_INVALID_IMAGE:
+        return "Invalid image";
+        
+    case FPK_RESULT_IMAGE_TOO_LARGE:
+        return "Image too large";
+        
+    case FPK_RESULT_MANDATORY_HOOK_MISSING:
+        return "Mandatory hook missing";
+        
+    case FPK_RESULT_UNSUPPORTED_KEY_TYPE:
+        return "Unsupported key type";
+
+    case FPK_RESULT_NEED_MORE_INPUT:
+        return "Need more input";
+
+    case FPK_RESULT_INVALID_RANGE:
+        return "Invalid range";
+
+    case FPK_RESULT_WRITE_ERROR:
+        return "Write error";
+
+    case FPK_RESULT_OUT_OF_MEMORY:
+        return "Out of memory";
+        
+    default:
+        return "Undefined result";
+    }
+}
+
+#endif /* FPK_ENABLE_RESULT_TO_STRING */
+
+
+static void begin(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data, uint8_t* scratch)
+{
+    ctx->options = options;
+    ctx->hooks = hooks;
+    ctx->user_data = user_data;
+    ctx->flags = FLAG_CAPTURE_CRC32;
+    ctx->state = STATE_HEADER;
+    ctx->block_fill = 0;
+    ctx->slots_busy = 0;
+
+    expect_field(ctx, PAYLOAD_META_COUNT, 2);
+
+#ifdef FPK_ENABLE_STATISTICS
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif /* FPK_ENABLE_STATISTICS */
+
+#ifdef FPK_ENABLE_THREADS
+    threads_begin(ctx);
+#endif /* FPK_ENABLE_THREADS */
+
+    select_input_buffer(ctx, scratch);
+    crc32_reset(ctx);
+}
+
+
+static fpk_result_t complete(fpk_context_t* ctx, fpk_result_t result)
+{
+    fpk_result_t pages_result;
+
+#ifdef FPK_ENABLE_THREADS
+    threads_end(ctx);
+#endif /* FPK_ENABLE_THREADS */
+
+    // a failure can leave pages still being written
+    pages_result = wait_pages(ctx);
+    if ( result == FPK_RESULT_OK ) result = pages_result;
+
+    if ( result == FPK_RESULT_OK ) result = commit_memory(ctx);
+    else abort_memory(ctx, result);
+
+    ctx->result = result;
+
+    return result;
+}
+
+
+static fpk_result_t unpack(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data)
+{
+    uint8_t scratch[FPK_INPUT_BUFFER_SIZE];
+
+    if ( (options & FPK_OPTION_SINGLE_PASS) && !hooks->commit_memory )
+        return FPK_RESULT_MANDATORY_HOOK_MISSING;
+
+    begin(ctx, options, hooks, user_data, scratch);
+
+    if ( !(options & FPK_OPTION_SINGLE_PASS) )
+        ctx->flags |= FLAG_VERIFY_ONLY;
+
+    return complete(ctx, advance(ctx));
+}
+
+
+fpk_result_t fpk_unpack(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data)
+{
+    ctx->source = NULL;
+
+    return unpack(ctx, options, hooks, user_data);
+}
 
-    case FPK_RESULT_NO_CIPHER_KEY:
-        return "No cipher key";
 
-    case FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE:
-        return "Unsupported authentication type";
+fpk_result_t fpk_unpack_buffer(fpk_context_t* ctx, const uint8_t* data,
+        size_t length, uint32_t options, const fpk_hooks_t* hooks,
+        void* user_data)
+{
+    if ( !data ) return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
 
-    case FPK_RESULT_UNSUPPORTED_CIPHER_TYPE:
-        return "Unsupported cipher type";
-        
-    case FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION:
-        return "Unsupported FPK file version";
-        
-    case FPK_RESULT_INVALID_FPK_FILE:
-        return "Invalid FPK file";
-        
-    case FPK_RESULT_INVALID_METADATA:
-        return "Invalid metadata";
-        
-    case FPK_RESULT_INVALID_IMAGE:
-        return "Invalid image";
-        
-    case FPK_RESULT_IMAGE_TOO_LARGE:
-        return "Image too large";
-        
-    case FPK_RESULT_MANDATORY_HOOK_MISSING:
-        return "Mandatory hook missing";
-        
-    default:
-        return "Undefined result";
-    }
-}
+    ctx->source = data;
+    ctx->source_length = length;
+    ctx->source_position = 0;
 
-#endif /* FPK_ENABLE_RESULT_TO_STRING */
+    return unpack(ctx, options, hooks, user_data);
+}
 
 
-fpk_result_t fpk_unpack(fpk_context_t* ctx, uint32_t options,
+fpk_result_t fpk_begin(fpk_context_t* ctx, uint32_t options,
         const fpk_hooks_t* hooks, void* user_data)
 {
-    fpk_result_t result;
-    uint8_t* input = ctx->input;
-    uint8_t auth_type;
-    uint8_t cipher_type;
-    uint16_t n_objects;
-    uint8_t* key_buffer = ctx->key_buffer;
-    uint8_t* data_buffer = ctx->data_buffer;
-    
-#if defined(FPK_ENABLE_HMAC_SHA256) || defined(FPK_ENABLE_AES128_CBC)
-    const uint8_t* key = NULL;
-#endif
-    
-    ctx->options = options;
-    ctx->hooks = hooks;
-    ctx->user_data = user_data;
-    ctx->cursor = 0;
-    ctx->flags = FLAG_CAPTURE_CRC32;
+    ctx->source = NULL;
 
-    crc32_reset(ctx);
+    if ( !hooks->commit_memory )
+    {
+        ctx->result = FPK_RESULT_MANDATORY_HOOK_MISSING;
+        return ctx->result;
+    }
 
-    result = read_block(ctx);
-    if ( result != FPK_RESULT_OK ) return result;
+    // the scratch is only set up on each call of fpk_feed
+    begin(ctx, options | FPK_OPTION_SINGLE_PASS, hooks, user_data, NULL);
+    ctx->flags |= FLAG_PUSH;
+    ctx->result = FPK_RESULT_NEED_MORE_INPUT;
 
-    if ( input[0] != 0x46 ||
-        input[1] != 0x50 ||
-        input[2] != 0x4B ) return FPK_RESULT_INVALID_FPK_FILE;
+    return FPK_RESULT_OK;
+}
 
-    if ( input[3] != 0x00 ) return FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION;
 
-    ctx->timestamp = parse_u32(input + 4);
-    ctx->n_blocks = parse_u32(input + 8);
+fpk_result_t fpk_feed(fpk_context_t* ctx, const uint8_t* data, size_t length)
+{
+    fpk_result_t result = ctx->result;
+    uint8_t scratch[FPK_INPUT_BUFFER_SIZE];
 
-    auth_type = input[12];
-    cipher_type = input[13];
+    if ( result != FPK_RESULT_NEED_MORE_INPUT ) return result;
 
-#ifdef FPK_ENABLE_HMAC_SHA256
+    if ( ctx->flags & FLAG_SCRATCH_INPUT ) ctx->input_buffer = scratch;
 
-    if ( auth_type == FPK_AUTHENTICATION_TYPE_NONE )
+    while (length > 0 && result == FPK_RESULT_NEED_MORE_INPUT)
     {
-        if ( ctx->options & FPK_OPTION_ENFORCE_AUTHENTICATION )
+        size_t n;
+
+        // whole blocks are used where they lie; anything less is gathered
+        // in ctx->block until a full one has arrived
+
+        if ( ctx->block_fill > 0 || length < 16 )
         {
-            return FPK_RESULT_SIGNATURE_MISSING;
+            n = 16 - ctx->block_fill;
+            if ( n > length ) n = length;
+
+            memcpy(ctx->block + ctx->block_fill, data, n);
+
+            ctx->block_fill += (uint8_t) n;
+            data += n;
+            length -= n;
+
+            if ( ctx->block_fill < 16 ) break;
+
+            ctx->block_fill = 0;
+            ctx->source = ctx->block;
+            ctx->source_length = 16;
         }
-    }
-    else if ( auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
-    {
-        key = authentication_key(ctx, auth_type);
-        if ( !key ) return FPK_RESULT_NO_AUTHENTICATION_KEY;
+        else
+        {
+            n = length & ~(size_t) 15;
 
-        hmac_reset(ctx, key);
+            ctx->source = data;
+            ctx->source_length = n;
 
-        ctx->flags |= FLAG_CAPTURE_AUTH;
-    }
-    else
-    {
-        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
-    }
+            data += n;
+            length -= n;
+        }
 
-#else /* FPK_ENABLE_HMAC_SHA256 */
+        ctx->source_position = 0;
+        result = advance(ctx);
 
-    if ( auth_type != FPK_AUTHENTICATION_TYPE_NONE )
-    {
-        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+#if defined(FPK_ENABLE_THREADS) && defined(FPK_ENABLE_HMAC_SHA256)
+        // the hash worker mustn't be left holding the caller's data
+        hash_drain(ctx);
+#endif /* FPK_ENABLE_THREADS && FPK_ENABLE_HMAC_SHA256 */
     }
 
-#endif /* FPK_ENABLE_HMAC_SHA256 */
+    ctx->source = NULL;
 
-#ifdef FPK_ENABLE_AES128_CBC
+    if ( result == FPK_RESULT_NEED_MORE_INPUT ) return result;
 
-    if ( cipher_type != FPK_CIPHER_TYPE_NONE &&
-        cipher_type != FPK_CIPHER_TYPE_AES128_CBC )
-    {
-        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
-    }
+    return complete(ctx, result);
+}
 
-#else /* FPK_ENABLE_AES128_CBC */
 
-    if ( cipher_type != FPK_CIPHER_TYPE_NONE )
+fpk_result_t fpk_finish(fpk_context_t* ctx)
+{
+    if ( ctx->result != FPK_RESULT_NEED_MORE_INPUT ) return ctx->result;
+
+    return complete(ctx, FPK_RESULT_UNEXPECTED_END_OF_INPUT);
+}
+
+
+fpk_result_t fpk_index(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data,
+        fpk_image_entry_t* entries, uint16_t max_entries,
+        uint16_t* n_entries)
+{
+    uint8_t scratch[FPK_INPUT_BUFFER_SIZE];
+    fpk_result_t result;
+
+    ctx->source = NULL;
+
+    begin(ctx, options & ~(FPK_OPTION_SINGLE_PASS | FPK_OPTION_PIPELINE),
+            hooks, user_data, scratch);
+
+    ctx->flags |= FLAG_VERIFY_ONLY | FLAG_INDEX;
+    ctx->index = entries;
+    ctx->index_size = max_entries;
+    ctx->n_indexed = 0;
+
+    result = advance(ctx);
+
+#ifdef FPK_ENABLE_THREADS
+    threads_end(ctx);
+#endif /* FPK_ENABLE_THREADS */
+
+    *n_entries = ctx->n_indexed;
+    ctx->result = result;
+
+    return result;
+}
+
+
+fpk_result_t fpk_read_range(fpk_context_t* ctx, const char* id,
+        uint32_t offset, uint32_t length, uint8_t* buffer)
+{
+    const fpk_image_entry_t* entry = NULL;
+    uint8_t scratch[FPK_INPUT_BUFFER_SIZE];
+    uint32_t position;
+    size_t skip;
+    fpk_result_t result;
+
+    if ( ctx->result == FPK_RESULT_OK && (ctx->flags & FLAG_INDEX) )
     {
-        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+        uint16_t n = ctx->n_indexed;
+
+        if ( n > ctx->index_size ) n = ctx->index_size;
+
+        for (uint16_t i = 0; i < n && !entry; i++)
+        {
+            if ( strcmp(ctx->index[i].id, id) == 0 ) entry = &ctx->index[i];
+        }
     }
 
+    if ( !entry ) return FPK_RESULT_UNKNOWN_ID;
+
+    if ( offset > entry->length || length > entry->length - offset )
+        return FPK_RESULT_INVALID_RANGE;
+
+    position = entry->offset + offset;
+    skip = position & 15;
+    position -= (uint32_t) skip;
+
+#ifdef FPK_ENABLE_AES128_CBC
+    // the ciphertext block before the first one wanted is its IV
+    if ( ctx->flags & FLAG_DECIPHER ) position -= 16;
 #endif /* FPK_ENABLE_AES128_CBC */
 
-    for (uint32_t i = ctx->n_blocks; i--;)
+    result = seek_file(ctx, position);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    select_input_buffer(ctx, scratch);
+
+#ifdef FPK_ENABLE_AES128_CBC
+    if ( ctx->flags & FLAG_DECIPHER )
     {
-        result = read_block(ctx);
+        result = read_file(ctx, ctx->aes128_iv, AES128_KEY_LEN);
         if ( result != FPK_RESULT_OK ) return result;
     }
-    
-    ctx->flags &= ~FLAG_CAPTURE_AUTH;
-
-#ifdef FPK_ENABLE_HMAC_SHA256
+#endif /* FPK_ENABLE_AES128_CBC */
 
-    if ( auth_type == FPK_AUTHENTICATION_TYPE_HMAC_SHA256 )
+    while (length > 0)
     {
-        hmac_digest(ctx, key, ctx->hmac);
-        
-        result = read_block(ctx);
-        if ( result != FPK_RESULT_OK ) return result;
+        size_t n_bytes = (skip + length + 15) & ~(size_t) 15;
+        size_t n;
 
-        if ( memcmp(input, ctx->hmac, 16) != 0 )
-            return FPK_RESULT_INVALID_SIGNATURE;
+        if ( n_bytes > ctx->input_buffer_size )
+            n_bytes = ctx->input_buffer_size;
 
-        result = read_block(ctx);
+        result = read_file(ctx, ctx->input_buffer, n_bytes);
         if ( result != FPK_RESULT_OK ) return result;
-        
-        if ( memcmp(input, ctx->hmac + 16, 16) != 0 )
-            return FPK_RESULT_INVALID_SIGNATURE;
+
+#ifdef FPK_ENABLE_AES128_CBC
+        if ( ctx->flags & FLAG_DECIPHER )
+        {
+            aes128_decrypt_cbc(ctx, ctx->input_buffer, ctx->input_buffer,
+                    (uint32_t) (n_bytes / 16));
+        }
+#endif /* FPK_ENABLE_AES128_CBC */
+
+        n = n_bytes - skip;
+        if ( n > length ) n = length;
+
+        memcpy(buffer, ctx->input_buffer + skip, n);
+
+        buffer += n;
+        length -= (uint32_t) n;
+        skip = 0;
     }
 
-#endif /* FPK_ENABLE_HMAC_SHA256 */
+    return FPK_RESULT_OK;
+}
 
-    ctx->flags &= ~FLAG_CAPTURE_CRC32;
 
-    result = read_block(ctx);
-    if ( result != FPK_RESULT_OK ) return result;
-    
-    if ( parse_u32(input) != ctx->crc32 )
-        return FPK_RESULT_CRC_MISMATCH;
+fpk_result_t fpk_probe(fpk_context_t* ctx, const fpk_hooks_t* hooks,
+        void* user_data, fpk_probe_t* probe)
+{
+    uint8_t scratch[FPK_INPUT_BUFFER_SIZE];
+    fpk_result_t result;
 
-    result = seek_file(ctx, 16);
-    if ( result != FPK_RESULT_OK ) return result;
+    ctx->source = NULL;
 
-#ifdef FPK_ENABLE_AES128_CBC
+    begin(ctx, 0, hooks, user_data, scratch);
+    ctx->flags = FLAG_PROBE;
 
-    if ( cipher_type == FPK_CIPHER_TYPE_AES128_CBC )
-    {
-        key = cipher_key(ctx, cipher_type);
-        if ( !key ) return FPK_RESULT_NO_CIPHER_KEY;
+    result = advance(ctx);
 
-        result = read_block(ctx);
-        if ( result != FPK_RESULT_OK ) return result;
+#ifdef FPK_ENABLE_THREADS
+    threads_end(ctx);
+#endif /* FPK_ENABLE_THREADS */
 
-        aes128_init(ctx, key, input);
+    memset(probe, 0, sizeof(*probe));
+    probe->unauthenticated = 1;
 
-        ctx->flags |= FLAG_DECIPHER;
-        ctx->n_blocks--;
+    if ( ctx->state != STATE_HEADER )
+    {
+        probe->timestamp = ctx->timestamp;
+        probe->n_blocks = ctx->n_body_blocks;
+        probe->auth_type = (fpk_authentication_type_t) ctx->auth_type;
+        probe->cipher_type = (fpk_cipher_type_t) ctx->cipher_type;
     }
 
-#endif /* FPK_ENABLE_AES128_CBC */
+    ctx->result = result;
 
-    result = read_input(ctx, data_buffer, 2);
-    if ( result != FPK_RESULT_OK ) return result;
-    
-    n_objects = parse_u16(data_buffer);
-    
-    
-    for (uint8_t i = 0; i < n_objects; i++)
+    return result;
+}
+
+
+fpk_result_t fpk_verify_batch(fpk_context_t* ctx, fpk_verify_item_t* items,
+        size_t n_items, uint32_t options)
+{
+#if defined(FPK_ENABLE_HMAC_SHA256) && defined(FPK_ENABLE_X86_ACCELERATION)
+    sha256_mb_transform_t transform;
+    unsigned n_lanes;
+#endif
+
+    for (size_t i = 0; i < n_items; i++)
+        items[i].result = check_package(&items[i], options);
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+    n_lanes = sha256_lanes(&transform);
+
+    if ( n_lanes > 1 ) sign_lanes(ctx, items, n_items, transform, n_lanes);
+    else sign_each(ctx, items, n_items);
+#else /* FPK_ENABLE_X86_ACCELERATION */
+    sign_each(ctx, items, n_items);
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+    for (size_t i = 0; i < n_items; i++)
     {
-        uint8_t key_length;
-        uint8_t value_length;
-        
-        result = read_input(ctx, key_buffer, 1);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        key_length = key_buffer[0];
-        if ( key_length >= FPK_KEY_BUFFER_SIZE )
-            return FPK_RESULT_INVALID_METADATA;
-        
-        result = read_input(ctx, key_buffer, key_length);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        key_buffer[key_length] = 0;
-        
-        result = read_input(ctx, data_buffer, 1);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        value_length = data_buffer[0];
-        if ( value_length >= FPK_DATA_BUFFER_SIZE )
-            return FPK_RESULT_INVALID_METADATA;
-        
-        result = read_input(ctx, data_buffer, value_length);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        data_buffer[value_length] = 0;
-        
-        result = handle_metadata(
-            ctx,
-            (const char*) key_buffer,
-            (const char*) data_buffer
-        );
-        
-        if ( result != FPK_RESULT_OK ) return result;
+        if ( items[i].result != FPK_RESULT_OK ) return items[i].result;
     }
-    
-    result = read_input(ctx, data_buffer, 2);
-    if ( result != FPK_RESULT_OK ) return result;
-    
-    n_objects = parse_u16(data_buffer);
-    
-    for (uint16_t i = 0; i < n_objects; i++)
+
+    return FPK_RESULT_OK;
+}
+
+
+fpk_result_t fpk_key_init(fpk_key_t* key, fpk_key_type_t type,
+        const uint8_t* data)
+{
+    switch(type)
     {
-        uint8_t id_length;
-        uint32_t image_length;
-        
-        result = read_input(ctx, key_buffer, 1);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        id_length = key_buffer[0];
-        if ( id_length >= FPK_KEY_BUFFER_SIZE )
-            return FPK_RESULT_INVALID_IMAGE;
-        
-        result = read_input(ctx, key_buffer, id_length);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        key_buffer[id_length] = 0;
-        
-        result = read_input(ctx, data_buffer, 4);
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        image_length = parse_u32(data_buffer);
-        
-        result = prepare_memory(
-            ctx,
-            (const char*) key_buffer,
-            image_length
-        );
-        
-        if ( result != FPK_RESULT_OK ) return result;
-        
-        while (image_length > 0)
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+    case FPK_KEY_TYPE_HMAC_SHA256:
+    {
+        fpk_context_t scratch;
+
+        hmac_reset(&scratch, data);
+
+        memcpy(key->u.hmac_sha256.inner_state, scratch.sha256_state, 32);
+        memcpy(key->u.hmac_sha256.outer_state, scratch.hmac_outer_state, 32);
+        break;
+    }
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+    case FPK_KEY_TYPE_AES128_CBC:
+        aes128_key_expansion(key->u.aes128_cbc.round_key, data);
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+        key->u.aes128_cbc.aesni = 0;
+
+        if ( cpu_features() & CPU_FEATURE_AESNI )
         {
-            uint32_t remaining = image_length;
-            
-            if ( remaining > FPK_DATA_BUFFER_SIZE )
-                remaining = FPK_DATA_BUFFER_SIZE;
-            
-            result = read_input(ctx, data_buffer, remaining);
-            if ( result != FPK_RESULT_OK ) return result;
-            
-            result = program_memory(
-                ctx,
-                (const char*) key_buffer,
-                data_buffer,
-                remaining
-            );
-            
-            if ( result != FPK_RESULT_OK ) return result;
-            
-            image_length -= remaining;
+            aes128_init_aesni(key->u.aes128_cbc.dec_key,
+                    key->u.aes128_cbc.round_key);
+            key->u.aes128_cbc.aesni = 1;
         }
-        
-        result = finalize_memory(
-            ctx,
-            (const char*) key_buffer
-        );
-        
-        if ( result != FPK_RESULT_OK ) return result;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+        break;
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+    default:
+        return FPK_RESULT_UNSUPPORTED_KEY_TYPE;
     }
 
+    key->type = type;
+
     return FPK_RESULT_OK;
 }
+
+
+#ifdef FPK_ENABLE_STATISTICS
+
+const fpk_stats_t* fpk_get_stats(const fpk_context_t* ctx)
+{
+    return &ctx->stats;
+}
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+
+uint32_t fpk_crc32(uint32_t crc, const uint8_t* data, size_t length)
+{
+    return ~crc32_compute(~crc, data, length);
+}
+
+
+uint32_t fpk_crc32_combine(uint32_t crc1, uint32_t crc2, size_t length2)
+{
+    return crc32_combine(crc1, crc2, length2);
+}
@@ -32,6 +32,30 @@
 #define FPK_ENABLE_RESULT_TO_STRING
 #define FPK_ENABLE_HMAC_SHA256
 #define FPK_ENABLE_AES128_CBC
+#define FPK_ENABLE_CRC32_SLICING
+#define FPK_ENABLE_X86_ACCELERATION
+#define FPK_ENABLE_STATISTICS
+
+// Multi-threaded verification with POSIX threads. It changes the layout of
+// fpk_context_t, so it is only ever switched on here, where everything
+// that includes this header sees it; the CMake build follows this line.
+// #define FPK_ENABLE_THREADS
+
+#ifdef FPK_ENABLE_THREADS
+#include <pthread.h>
+#endif /* FPK_ENABLE_THREADS */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+
+// Hardware acceleration relies on GCC/Clang intrinsics and is selected at
+// runtime, so it is quietly dropped on anything that isn't an x86 build.
+#if defined(FPK_ENABLE_X86_ACCELERATION) && \
+    !((defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__))
+#undef FPK_ENABLE_X86_ACCELERATION
+#endif
 
 
 typedef enum
@@ -54,7 +78,12 @@ typedef enum
     FPK_RESULT_INVALID_METADATA,
     FPK_RESULT_INVALID_IMAGE,
     FPK_RESULT_IMAGE_TOO_LARGE,
-    FPK_RESULT_MANDATORY_HOOK_MISSING
+    FPK_RESULT_MANDATORY_HOOK_MISSING,
+    FPK_RESULT_UNSUPPORTED_KEY_TYPE,
+    FPK_RESULT_NEED_MORE_INPUT,
+    FPK_RESULT_INVALID_RANGE,
+    FPK_RESULT_WRITE_ERROR,
+    FPK_RESULT_OUT_OF_MEMORY
 
 } fpk_result_t;
 
@@ -75,11 +104,89 @@ typedef enum
 } fpk_cipher_type_t;
 
 
+typedef enum
+{
+    FPK_KEY_TYPE_NONE,
+    FPK_KEY_TYPE_HMAC_SHA256,
+    FPK_KEY_TYPE_AES128_CBC
+
+} fpk_key_type_t;
+
+
+// A key with its per-key setup already done (HMAC pad midstates, AES round
+// keys), so that unpacking many packages with the same key doesn't repeat
+// it. Initialise with fpk_key_init() and hand out through the
+// prepared_*_key hooks.
+
+typedef struct
+{
+    fpk_key_type_t type;
+
+    union
+    {
+#ifdef FPK_ENABLE_HMAC_SHA256
+
+        struct
+        {
+            uint32_t inner_state[8];
+            uint32_t outer_state[8];
+
+        } hmac_sha256;
+
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+
+        struct
+        {
+            uint8_t round_key[176];
+
+#ifdef FPK_ENABLE_X86_ACCELERATION
+            uint8_t dec_key[176];
+            uint8_t aesni;
+#endif /* FPK_ENABLE_X86_ACCELERATION */
+
+        } aes128_cbc;
+
+#endif /* FPK_ENABLE_AES128_CBC */
+
+        uint8_t unused;
+
+    } u;
+
+} fpk_key_t;
+
+
+// A piece of the caller's memory that image data is written into, see
+// image_destination.
+
+typedef struct
+{
+    uint8_t* data;
+    size_t length;
+
+} fpk_segment_t;
+
+
 typedef struct
 {
     fpk_result_t (*read_file) (uint8_t* buffer, uint8_t n_bytes,
             void* user_data);
 
+    // Used instead of read_file when set. Must read exactly n_bytes, which
+    // can be as large as the buffer returned by read_buffer.
+
+    fpk_result_t (*read_file_bulk) (uint8_t* buffer, size_t n_bytes,
+            void* user_data);
+
+    // Optionally supplies a larger buffer for reading ahead (its size is
+    // rounded down to a multiple of 16 bytes). It must stay valid until
+    // the unpack returns. Without it, an FPK_INPUT_BUFFER_SIZE byte buffer
+    // on the stack of each call into the library is used, so one buffer
+    // per thread can serve every context that thread unpacks.
+
+    uint8_t* (*read_buffer) (size_t* size, void* user_data);
+
     fpk_result_t (*seek_file) (uint32_t position, void* user_data);
 
     fpk_result_t (*prepare_memory) (const char* id, uint32_t size,
@@ -90,6 +197,23 @@ typedef struct
     
     fpk_result_t (*finalize_memory) (const char* id, void* user_data);
 
+    // When program_page is set it is used instead of program_memory, and
+    // image data is coalesced into whole pages of the size returned by
+    // program_buffer (which is mandatory in that case). Every call covers
+    // one page at an offset that is a multiple of the page size, except
+    // for the final partial page of an image, which goes to program_tail
+    // (or to program_page if program_tail isn't set). data is either the
+    // program_buffer or a pointer into the input that is at least as
+    // aligned as it, up to 64 bytes.
+
+    uint8_t* (*program_buffer) (size_t* page_size, void* user_data);
+
+    fpk_result_t (*program_page) (const char* id, uint32_t offset,
+            const uint8_t* data, size_t length, void* user_data);
+
+    fpk_result_t (*program_tail) (const char* id, uint32_t offset,
+            const uint8_t* data, size_t length, void* user_data);
+
     const uint8_t* (*authentication_key) (fpk_authentication_type_t type,
             void* user_data);
 
@@ -98,11 +222,240 @@ typedef struct
     fpk_result_t (*handle_metadata) (const char* key, const char* value,
             void* user_data);
 
+    fpk_result_t (*commit_memory) (void* user_data);
+
+    void (*abort_memory) (fpk_result_t result, void* user_data);
+
+    // Take precedence over authentication_key and cipher_key when set and
+    // returning non-NULL.
+
+    const fpk_key_t* (*prepared_authentication_key) (
+            fpk_authentication_type_t type, void* user_data);
+
+    const fpk_key_t* (*prepared_cipher_key) (fpk_cipher_type_t type,
+            void* user_data);
+
+    // Optional monotonic clock, in whatever units suit the caller, used to
+    // time hooks and crypto stages when FPK_ENABLE_STATISTICS is defined.
+
+    uint64_t (*read_clock) (void* user_data);
+
+    // Used when FPK_ENABLE_THREADS is defined. verify_threads returns how
+    // many threads the CRC32, HMAC and deciphering of the input may be
+    // spread over (0 or 1 keeps them on the calling thread). submit_task
+    // runs task(arg) on another thread, e.g. from a pool, returning
+    // non-zero if it can't; without it a thread is created for each task.
+    // Tasks block until the unpack is done with them, so a pool needs at
+    // least verify_threads threads free (two more with
+    // FPK_OPTION_PIPELINE) to avoid deadlock.
+
+    unsigned (*verify_threads) (void* user_data);
+
+    int (*submit_task) (void (*task) (void* arg), void* arg,
+            void* user_data);
+
+    // Optional. Returning zero skips the image: it isn't passed to
+    // prepare_memory or any of the programming hooks. Where the package
+    // has already been verified (the second pass of a two-pass unpack),
+    // the image's data is also passed over with seek_file rather than
+    // being read and deciphered, unless FPK_OPTION_PIPELINE is in use.
+
+    int (*select_image) (const char* id, uint32_t size, void* user_data);
+
+    // Optional verification cache for two-pass unpacks, used when
+    // FPK_ENABLE_HMAC_SHA256 is defined. package_identity returns size
+    // bytes that the caller vouches change whenever the package's content
+    // may have, e.g. the device, inode, size and mtime of its file. The
+    // identity, header, signature and trailer are hashed into a
+    // FPK_VERIFY_KEY_SIZE byte key, with HMAC-SHA256 under the package's
+    // authentication key if it has one. If lookup_verified then returns
+    // non-zero the verification pass is skipped and the package is
+    // deciphered and unpacked straight away; otherwise store_verified is
+    // given the key once the package checks out.
+    //
+    // A hit skips the CRC32 and signature checks altogether, so whatever
+    // can change a package without changing its identity, or add keys to
+    // the store, must be trusted as much as the package itself. Nothing
+    // needs invalidating: a changed identity, header, trailer or key gives
+    // a different key, and old ones can be evicted whenever suits.
+
+    const uint8_t* (*package_identity) (size_t* size, void* user_data);
+
+    int (*lookup_verified) (const uint8_t* key, void* user_data);
+
+    void (*store_verified) (const uint8_t* key, void* user_data);
+
+    // Optional asynchronous programming, used instead of program_page and
+    // program_tail when set, so that the next page can be deciphered while
+    // the last is being written. wait_program is mandatory with it, and
+    // program_buffer must return room for FPK_PROGRAM_SLOTS pages back to
+    // back (page_size is still that of one). Each page is assembled in a
+    // free slot and handed to program_page_async, which starts writing it
+    // and owns the slot until wait_program returns it: wait_program blocks
+    // until any page started has been written, then returns its slot and
+    // result. The library only waits when it needs a slot back, and waits
+    // for every page before calling finalize_memory, commit_memory or
+    // abort_memory. data is always the slot's page, never the input; if
+    // program_page_async fails, the slot is taken as never started.
+
+    fpk_result_t (*program_page_async) (const char* id, uint32_t offset,
+            const uint8_t* data, size_t length, unsigned slot,
+            void* user_data);
+
+    fpk_result_t (*wait_program) (unsigned* slot, void* user_data);
+
+    // Optional zero-copy programming, used in preference to the other
+    // programming hooks. program_view is handed image data where it lies
+    // once deciphered: in the input buffer, or in the caller's own memory
+    // with fpk_unpack_buffer and fpk_feed when there is no cipher. Each run
+    // is as long as the input allows, runs come at consecutive offsets and
+    // data is only valid during the call.
+    //
+    // image_destination instead says where an image is to end up, e.g. a
+    // mapped flash window or DMA buffers, as a scatter list of n_segments
+    // pieces of memory that are filled in order, add up to at least size
+    // bytes and stay valid until finalize_memory. Returning NULL leaves the
+    // image to the other hooks. Whole blocks of image data are read and
+    // deciphered straight into the segments; only the few bytes sharing a
+    // block with other fields, blocks that straddle two segments, and all
+    // data with FPK_OPTION_PIPELINE are copied in.
+
+    fpk_result_t (*program_view) (const char* id, uint32_t offset,
+            const uint8_t* data, size_t length, void* user_data);
+
+    const fpk_segment_t* (*image_destination) (const char* id,
+            uint32_t size, unsigned* n_segments, void* user_data);
+
 } fpk_hooks_t;
 
 
+#ifdef FPK_ENABLE_STATISTICS
+
+// time is in read_clock units and stays 0 without that hook. For crypto
+// stages, calls counts the runs of input passed through the stage.
+
+typedef struct
+{
+    uint32_t calls;
+    uint64_t bytes;
+    uint64_t time;
+
+} fpk_stat_t;
+
+
+typedef struct
+{
+    uint64_t bytes_read;
+    fpk_stat_t read_file;
+    fpk_stat_t seek_file;
+    fpk_stat_t prepare_memory;
+    fpk_stat_t program_memory;
+    fpk_stat_t program_wait;
+    fpk_stat_t finalize_memory;
+    fpk_stat_t handle_metadata;
+    fpk_stat_t commit_memory;
+    fpk_stat_t crc32;
+    fpk_stat_t authentication;
+    fpk_stat_t cipher;
+
+} fpk_stats_t;
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+
 #define FPK_KEY_BUFFER_SIZE         16
 #define FPK_DATA_BUFFER_SIZE        64
+#define FPK_INPUT_BUFFER_SIZE       128
+#define FPK_VERIFY_KEY_SIZE         32
+
+// Pages in flight with program_page_async, counting the one being
+// assembled (at most 8).
+#define FPK_PROGRAM_SLOTS           2
+
+
+// What fpk_probe found in a package's header. None of it has been checked
+// against the package's CRC32 or signature; unauthenticated is always set
+// to say so.
+
+typedef struct
+{
+    uint32_t timestamp;
+    uint32_t n_blocks;
+    fpk_authentication_type_t auth_type;
+    fpk_cipher_type_t cipher_type;
+    uint8_t unauthenticated;
+
+} fpk_probe_t;
+
+
+// Where an image's data lies in a package, as recorded by fpk_index.
+// offset is from the start of the package file.
+
+typedef struct
+{
+    char id[FPK_KEY_BUFFER_SIZE];
+    uint32_t offset;
+    uint32_t length;
+
+} fpk_image_entry_t;
+
+
+// A package in memory for fpk_verify_batch(). key is the
+// FPK_KEY_TYPE_HMAC_SHA256 key its signature is checked against, if it has
+// one.
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t length;
+    const fpk_key_t* key;
+    fpk_result_t result;
+
+} fpk_verify_item_t;
+
+
+#if (FPK_INPUT_BUFFER_SIZE % 16) != 0 || FPK_INPUT_BUFFER_SIZE > 240
+#error "FPK_INPUT_BUFFER_SIZE must be a multiple of 16, no greater than 240"
+#endif
+
+
+#ifdef FPK_ENABLE_THREADS
+
+#define FPK_HASH_RING_SIZE          8
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t length;
+
+} fpk_span_t;
+
+
+// FPK_OPTION_PIPELINE splits the read buffer into this many chunks, which
+// are passed between the pipeline stages through the rings.
+
+#define FPK_PIPELINE_CHUNKS         4
+
+typedef struct
+{
+    uint8_t* buffer;
+    const uint8_t* data;
+    uint32_t n_blocks;
+    fpk_result_t result;
+    uint8_t last;
+
+} fpk_chunk_t;
+
+
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    fpk_chunk_t* slots[FPK_PIPELINE_CHUNKS];
+
+} fpk_ring_t;
+
+#endif /* FPK_ENABLE_THREADS */
 
 
 typedef struct 
@@ -110,23 +463,51 @@ typedef struct
     uint32_t options;
     const fpk_hooks_t* hooks;
     void* user_data;
-    uint8_t input[16];
+    const uint8_t* source;
+    size_t source_length;
+    size_t source_position;
+    uint8_t* input_buffer;
+    size_t input_buffer_size;
+    const uint8_t* input_data;
     uint8_t key_buffer[FPK_KEY_BUFFER_SIZE];
     uint8_t data_buffer[FPK_DATA_BUFFER_SIZE];
-    uint8_t cursor;
-    uint8_t flags;
+    uint8_t block[16];
+    uint8_t block_fill;
+    uint16_t flags;
+    uint8_t state;
+    uint8_t payload_state;
+    uint8_t field_length;
+    uint8_t field_fill;
+    uint16_t n_objects;
+    uint32_t image_remaining;
+    uint32_t image_offset;
+    uint8_t* page;
+    size_t page_size;
+    size_t page_fill;
+    uint8_t* slots;
+    uint8_t slot;
+    uint8_t slots_busy;
+    const fpk_segment_t* segments;
+    fpk_result_t result;
     uint32_t crc32;
     uint32_t timestamp;
     uint32_t n_blocks;
+    uint32_t n_body_blocks;
+    fpk_image_entry_t* index;
+    uint16_t index_size;
+    uint16_t n_indexed;
+    uint8_t auth_type;
+    uint8_t cipher_type;
     
 #ifdef FPK_ENABLE_HMAC_SHA256
     
+    uint64_t sha256_bit_len;
     uint8_t sha256_buffer[64];
-    uint32_t sha256_m[64];
     uint32_t sha256_state[8];
     uint8_t sha256_buffer_in;
-    uint64_t sha256_bit_len;
     uint8_t hmac[32];
+    uint32_t hmac_outer_state[8];
+    uint8_t verify_key[FPK_VERIFY_KEY_SIZE];
     
 #endif /* FPK_ENABLE_HMAC_SHA256 */
 
@@ -134,24 +515,182 @@ typedef struct
 
     uint8_t aes128_round_key[176];
     uint8_t aes128_iv[16];
-    uint8_t (*aes128_state)[4][4];
-    
+
 #endif /* FPK_ENABLE_AES128_CBC */
+
+#ifdef FPK_ENABLE_STATISTICS
+
+    fpk_stats_t stats;
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+#ifdef FPK_ENABLE_THREADS
+
+    unsigned n_threads;
+    uint8_t hash_active;
+    uint32_t hash_head;
+    uint32_t hash_tail;
+    uint32_t hash_waiting;
+    uint32_t pending_tasks;
+    fpk_span_t hash_ring[FPK_HASH_RING_SIZE];
+    fpk_chunk_t chunks[FPK_PIPELINE_CHUNKS];
+    fpk_ring_t free_chunks;
+    fpk_ring_t read_chunks;
+    fpk_ring_t ready_chunks;
+    uint32_t pipeline_blocks;
+    uint8_t pipeline_stop;
+    uint8_t pipeline_stages;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+#endif /* FPK_ENABLE_THREADS */
     
 } fpk_context_t;
 
 
 #define FPK_OPTION_ENFORCE_AUTHENTICATION       (1 << 0)
 
+// Decrypts, parses and programs images in the same pass that verifies the
+// CRC32 and signature, so the input is read exactly once and seek_file is
+// never called. Images (and metadata) are handed to the hooks before they
+// have been verified; commit_memory is mandatory in this mode and is only
+// called once the whole package has checked out. If anything fails,
+// abort_memory is called instead and the caller must discard whatever was
+// programmed.
+#define FPK_OPTION_SINGLE_PASS                  (1 << 1)
+
+// Runs the body of the package through three stages at once: one task
+// reads it, another passes it through the CRC32, HMAC and cipher, and the
+// calling thread parses it and programs the images, so that a slow read,
+// cipher or flash write doesn't hold up the other two. The read buffer is
+// shared out between the stages in FPK_PIPELINE_CHUNKS chunks, so read_buffer
+// must be set and should be large. The read hooks are then called from a
+// task (through submit_task, if set) and read_clock from several threads
+// at once; all other hooks stay on the calling thread. Ignored unless
+// FPK_ENABLE_THREADS is defined, and by the push API.
+#define FPK_OPTION_PIPELINE                     (1 << 2)
+
 
 fpk_result_t fpk_unpack(fpk_context_t* ctx, uint32_t options,
         const fpk_hooks_t* hooks, void* user_data);
 
 
+// Unpacks a package that is already in memory. read_file and seek_file are
+// not used; the CRC32 and HMAC are computed over the buffer in place and,
+// for unenciphered packages, program_memory is handed pointers straight
+// into it. data must stay valid and unmodified until this returns.
+
+fpk_result_t fpk_unpack_buffer(fpk_context_t* ctx, const uint8_t* data,
+        size_t length, uint32_t options, const fpk_hooks_t* hooks,
+        void* user_data);
+
+
+// Push-style unpacking, for callers that receive a package a piece at a
+// time (from a socket, say) and can't block in read_file. After fpk_begin,
+// pass each piece to fpk_feed as it arrives; pieces can be any size. It
+// returns FPK_RESULT_NEED_MORE_INPUT until the whole package has arrived
+// and checked out, then calls commit_memory and returns its result.
+// Anything following the package is ignored. Call fpk_finish when the
+// input ends; it returns the final result, and a package that was cut
+// short fails with FPK_RESULT_UNEXPECTED_END_OF_INPUT. A failure calls
+// abort_memory and is returned again by any later call.
+//
+// Packages are always unpacked as if with FPK_OPTION_SINGLE_PASS, so
+// commit_memory is mandatory. read_file and seek_file are not used, and
+// data only needs to remain valid for the duration of each fpk_feed.
+
+fpk_result_t fpk_begin(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data);
+
+fpk_result_t fpk_feed(fpk_context_t* ctx, const uint8_t* data,
+        size_t length);
+
+fpk_result_t fpk_finish(fpk_context_t* ctx);
+
+
+// Reads a package's header into probe and passes its metadata to
+// handle_metadata, reading (and deciphering) only as far as the end of the
+// metadata. Nothing is verified, so the metadata may have been tampered
+// with and must only be used to decide which packages to look at further,
+// e.g. with fpk_unpack, which checks everything. Only read_file (or
+// read_file_bulk), cipher_key (or prepared_cipher_key, for enciphered
+// packages) and handle_metadata are used; no authentication key is needed.
+
+fpk_result_t fpk_probe(fpk_context_t* ctx, const fpk_hooks_t* hooks,
+        void* user_data, fpk_probe_t* probe);
+
+
+// Verifies a package, as the first pass of a two-pass unpack does, then
+// walks its image headers using seek_file to pass over the image data,
+// recording where each image lies in entries. Up to max_entries images
+// are recorded; n_entries is set to the number in the package, which may
+// be more. Metadata is passed to handle_metadata if set, but no image is
+// programmed and neither commit_memory nor abort_memory is called.
+// FPK_OPTION_SINGLE_PASS and FPK_OPTION_PIPELINE are ignored.
+
+fpk_result_t fpk_index(fpk_context_t* ctx, uint32_t options,
+        const fpk_hooks_t* hooks, void* user_data,
+        fpk_image_entry_t* entries, uint16_t max_entries,
+        uint16_t* n_entries);
+
+
+// Reads length bytes from offset within image id of a package indexed
+// by fpk_index into buffer, deciphering only the blocks that cover them.
+// The hooks, user_data and entries given to fpk_index must still be
+// valid; the input is repositioned with seek_file as needed. Fails with
+// FPK_RESULT_UNKNOWN_ID if the image isn't in the index and
+// FPK_RESULT_INVALID_RANGE if the range isn't within it.
+
+fpk_result_t fpk_read_range(fpk_context_t* ctx, const char* id,
+        uint32_t offset, uint32_t length, uint8_t* buffer);
+
+
+// Checks the CRC32 and signature of n_items packages in memory, as the
+// verification pass of a two-pass unpack would, setting the result of
+// each. Signatures are computed several packages at a time, one to each
+// SIMD lane (16 with AVX-512, 8 with AVX2 and 4 with SSE2, unless SHA-NI
+// is quicker on one), with a lane moving on to the next package as soon as
+// it is done with one. Only FPK_OPTION_ENFORCE_AUTHENTICATION applies, and
+// ctx is only used as scratch. Returns FPK_RESULT_OK if every package
+// checked out, and the first item's failure otherwise.
+
+fpk_result_t fpk_verify_batch(fpk_context_t* ctx, fpk_verify_item_t* items,
+        size_t n_items, uint32_t options);
+
+
+fpk_result_t fpk_key_init(fpk_key_t* key, fpk_key_type_t type,
+        const uint8_t* data);
+
+
+// Computes the CRC32 used by fpack files. Start from 0xFFFFFFFF and pass
+// the result of each call into the next. fpk_crc32_combine returns the CRC
+// of two regions back to back given the CRC of each (both started from
+// 0xFFFFFFFF) and the length of the second.
+
+uint32_t fpk_crc32(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t fpk_crc32_combine(uint32_t crc1, uint32_t crc2, size_t length2);
+
+
+#ifdef FPK_ENABLE_STATISTICS
+
+// Returns the counters for the most recent unpack on ctx. program_memory
+// also covers program_page, program_tail, program_page_async and
+// program_view, and program_wait is the time spent in wait_program.
+
+const fpk_stats_t* fpk_get_stats(const fpk_context_t* ctx);
+
+#endif /* FPK_ENABLE_STATISTICS */
+
+
 #ifdef FPK_ENABLE_RESULT_TO_STRING
 
 const char* fpk_result_to_string(fpk_result_t result);
 
 #endif /* FPK_ENABLE_RESULT_TO_STRING */
 
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* _FPACK_H_ */
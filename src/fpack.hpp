@@ -0,0 +1,419 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _FPACK_HPP_
+#define _FPACK_HPP_
+
+#include <functional>
+#include <type_traits>
+
+#include "fpack.h"
+
+
+// Header-only C++17 front end, a type-safe way of binding hooks rather
+// than a faster one. fpk::unpacker<Auth, Cipher, Hooks> unpacks packages of
+// one authentication and cipher type with hooks that are member functions
+// of Hooks, named and typed as in fpk_hooks_t less the trailing user_data.
+// The table of hooks handed to the library is a constant built at compile
+// time: each hook Hooks has is bound to a thunk that calls it, each it
+// lacks is left NULL so the library takes the path it would for a C caller
+// without it, and the key hooks are only bound for the types in use. The
+// compiled library still calls every hook through the table, so each call
+// costs what a C hook does plus the thunk's call of the member function.
+// fpk::unpack and fpk::unpack_buffer pick the unpacker for a package from
+// its header.
+
+namespace fpk
+{
+
+enum class auth : uint8_t
+{
+    none = FPK_AUTHENTICATION_TYPE_NONE,
+    hmac_sha256 = FPK_AUTHENTICATION_TYPE_HMAC_SHA256
+};
+
+
+enum class cipher : uint8_t
+{
+    none = FPK_CIPHER_TYPE_NONE,
+    aes128_cbc = FPK_CIPHER_TYPE_AES128_CBC
+};
+
+
+namespace detail
+{
+
+#ifdef FPK_ENABLE_HMAC_SHA256
+constexpr bool hmac_sha256_enabled = true;
+#else /* FPK_ENABLE_HMAC_SHA256 */
+constexpr bool hmac_sha256_enabled = false;
+#endif /* FPK_ENABLE_HMAC_SHA256 */
+
+#ifdef FPK_ENABLE_AES128_CBC
+constexpr bool aes128_cbc_enabled = true;
+#else /* FPK_ENABLE_AES128_CBC */
+constexpr bool aes128_cbc_enabled = false;
+#endif /* FPK_ENABLE_AES128_CBC */
+
+
+// Calls member function Fn of the Hooks that user_data points at, where
+// Signature is the hook's C type without user_data.
+
+template <typename Hooks, typename Signature>
+struct thunk;
+
+template <typename Hooks, typename R, typename... Args>
+struct thunk<Hooks, R (Args...)>
+{
+    template <auto Fn>
+    static R call(Args... args, void* user_data)
+    {
+        return std::invoke(Fn, *static_cast<Hooks*>(user_data), args...);
+    }
+};
+
+
+// has_<hook><Hooks>::value says whether Hooks has a member named <hook>,
+// and bind_<hook>(table) points the table's slot at it if so.
+
+#define FPK_HOOK(name, signature) \
+    template <typename Hooks, typename = void> \
+    struct has_##name : std::false_type {}; \
+    \
+    template <typename Hooks> \
+    struct has_##name<Hooks, std::void_t<decltype(&Hooks::name)>> : \
+            std::true_type {}; \
+    \
+    template <typename Hooks> \
+    constexpr void bind_##name(fpk_hooks_t& table) \
+    { \
+        if constexpr ( has_##name<Hooks>::value ) \
+        { \
+            table.name = &thunk<Hooks, signature>::template \
+                    call<&Hooks::name>; \
+        } \
+    }
+
+FPK_HOOK(read_file, fpk_result_t (uint8_t*, uint8_t))
+FPK_HOOK(read_file_bulk, fpk_result_t (uint8_t*, size_t))
+FPK_HOOK(read_buffer, uint8_t* (size_t*))
+FPK_HOOK(seek_file, fpk_result_t (uint32_t))
+FPK_HOOK(prepare_memory, fpk_result_t (const char*, uint32_t))
+FPK_HOOK(program_memory, fpk_result_t (const char*, const uint8_t*, uint8_t))
+FPK_HOOK(finalize_memory, fpk_result_t (const char*))
+FPK_HOOK(program_buffer, uint8_t* (size_t*))
+FPK_HOOK(program_page,
+        fpk_result_t (const char*, uint32_t, const uint8_t*, size_t))
+FPK_HOOK(program_tail,
+        fpk_result_t (const char*, uint32_t, const uint8_t*, size_t))
+FPK_HOOK(authentication_key,
+        const uint8_t* (fpk_authentication_type_t))
+FPK_HOOK(cipher_key, const uint8_t* (fpk_cipher_type_t))
+FPK_HOOK(handle_metadata, fpk_result_t (const char*, const char*))
+FPK_HOOK(commit_memory, fpk_result_t ())
+FPK_HOOK(abort_memory, void (fpk_result_t))
+FPK_HOOK(prepared_authentication_key,
+        const fpk_key_t* (fpk_authentication_type_t))
+FPK_HOOK(prepared_cipher_key, const fpk_key_t* (fpk_cipher_type_t))
+FPK_HOOK(read_clock, uint64_t ())
+FPK_HOOK(verify_threads, unsigned ())
+FPK_HOOK(submit_task, int (void (*) (void*), void*))
+FPK_HOOK(select_image, int (const char*, uint32_t))
+FPK_HOOK(package_identity, const uint8_t* (size_t*))
+FPK_HOOK(lookup_verified, int (const uint8_t*))
+FPK_HOOK(store_verified, void (const uint8_t*))
+FPK_HOOK(program_page_async,
+        fpk_result_t (const char*, uint32_t, const uint8_t*, size_t, unsigned))
+FPK_HOOK(wait_program, fpk_result_t (unsigned*))
+FPK_HOOK(program_view,
+        fpk_result_t (const char*, uint32_t, const uint8_t*, size_t))
+FPK_HOOK(image_destination,
+        const fpk_segment_t* (const char*, uint32_t, unsigned*))
+
+#undef FPK_HOOK
+
+
+template <typename Hooks>
+constexpr bool can_authenticate = hmac_sha256_enabled &&
+        (has_authentication_key<Hooks>::value ||
+        has_prepared_authentication_key<Hooks>::value);
+
+template <typename Hooks>
+constexpr bool can_decipher = aes128_cbc_enabled &&
+        (has_cipher_key<Hooks>::value ||
+        has_prepared_cipher_key<Hooks>::value);
+
+
+// Checks that data starts with the header of a package the library can at
+// least recognise, in which case bytes 12 and 13 are its types, failing as
+// the library would otherwise.
+
+inline fpk_result_t check_header(const uint8_t* data, size_t length)
+{
+    if ( length < 16 ) return FPK_RESULT_UNEXPECTED_END_OF_INPUT;
+
+    if ( data[0] != 0x46 ||
+        data[1] != 0x50 ||
+        data[2] != 0x4B ) return FPK_RESULT_INVALID_FPK_FILE;
+
+    if ( data[3] != 0x00 ) return FPK_RESULT_UNSUPPORTED_FPK_FILE_VERSION;
+
+    return FPK_RESULT_OK;
+}
+
+} // namespace detail
+
+
+template <auth Auth, cipher Cipher, typename Hooks>
+class unpacker
+{
+public:
+
+    static_assert(Auth == auth::none || detail::hmac_sha256_enabled,
+            "FPK_ENABLE_HMAC_SHA256 is not defined");
+    static_assert(Cipher == cipher::none || detail::aes128_cbc_enabled,
+            "FPK_ENABLE_AES128_CBC is not defined");
+    static_assert(Auth == auth::none || detail::can_authenticate<Hooks>,
+            "Hooks has no authentication key hook");
+    static_assert(Cipher == cipher::none || detail::can_decipher<Hooks>,
+            "Hooks has no cipher key hook");
+
+    // Signed packages are always unpacked with
+    // FPK_OPTION_ENFORCE_AUTHENTICATION.
+
+    static constexpr uint32_t required_options = Auth == auth::none ? 0 :
+            FPK_OPTION_ENFORCE_AUTHENTICATION;
+
+    unpacker(fpk_context_t& ctx, Hooks& hooks) :
+        m_ctx(ctx),
+        m_hooks(hooks)
+    {
+    }
+
+    // As fpk_unpack. A package of another type than the unpacker's is
+    // caught by its missing key hook or FPK_OPTION_ENFORCE_AUTHENTICATION,
+    // except that an unenciphered one is still unpacked by an
+    // cipher::aes128_cbc unpacker.
+
+    fpk_result_t unpack(uint32_t options = 0)
+    {
+        return fpk_unpack(&m_ctx, options | required_options, &TABLE,
+                &m_hooks);
+    }
+
+    // As fpk_unpack_buffer, failing with
+    // FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE or
+    // FPK_RESULT_UNSUPPORTED_CIPHER_TYPE if the package is of another type
+    // than the unpacker's.
+
+    fpk_result_t unpack_buffer(const uint8_t* data, size_t length,
+            uint32_t options = 0)
+    {
+        if ( detail::check_header(data, length) == FPK_RESULT_OK )
+        {
+            if ( data[12] != static_cast<uint8_t>(Auth) )
+                return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+
+            if ( data[13] != static_cast<uint8_t>(Cipher) )
+                return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+        }
+
+        return fpk_unpack_buffer(&m_ctx, data, length,
+                options | required_options, &TABLE, &m_hooks);
+    }
+
+    // As fpk_begin, fpk_feed and fpk_finish.
+
+    fpk_result_t begin(uint32_t options = 0)
+    {
+        return fpk_begin(&m_ctx, options | required_options, &TABLE,
+                &m_hooks);
+    }
+
+    fpk_result_t feed(const uint8_t* data, size_t length)
+    {
+        return fpk_feed(&m_ctx, data, length);
+    }
+
+    fpk_result_t finish()
+    {
+        return fpk_finish(&m_ctx);
+    }
+
+    static const fpk_hooks_t* hooks()
+    {
+        return &TABLE;
+    }
+
+private:
+
+    static constexpr fpk_hooks_t make_table()
+    {
+        fpk_hooks_t table = {};
+
+        detail::bind_read_file<Hooks>(table);
+        detail::bind_read_file_bulk<Hooks>(table);
+        detail::bind_read_buffer<Hooks>(table);
+        detail::bind_seek_file<Hooks>(table);
+        detail::bind_prepare_memory<Hooks>(table);
+        detail::bind_program_memory<Hooks>(table);
+        detail::bind_finalize_memory<Hooks>(table);
+        detail::bind_program_buffer<Hooks>(table);
+        detail::bind_program_page<Hooks>(table);
+        detail::bind_program_tail<Hooks>(table);
+        detail::bind_handle_metadata<Hooks>(table);
+        detail::bind_commit_memory<Hooks>(table);
+        detail::bind_abort_memory<Hooks>(table);
+        detail::bind_read_clock<Hooks>(table);
+        detail::bind_verify_threads<Hooks>(table);
+        detail::bind_submit_task<Hooks>(table);
+        detail::bind_select_image<Hooks>(table);
+        detail::bind_package_identity<Hooks>(table);
+        detail::bind_lookup_verified<Hooks>(table);
+        detail::bind_store_verified<Hooks>(table);
+        detail::bind_program_page_async<Hooks>(table);
+        detail::bind_wait_program<Hooks>(table);
+        detail::bind_program_view<Hooks>(table);
+        detail::bind_image_destination<Hooks>(table);
+
+        if constexpr ( Auth != auth::none )
+        {
+            detail::bind_authentication_key<Hooks>(table);
+            detail::bind_prepared_authentication_key<Hooks>(table);
+        }
+
+        if constexpr ( Cipher != cipher::none )
+        {
+            detail::bind_cipher_key<Hooks>(table);
+            detail::bind_prepared_cipher_key<Hooks>(table);
+        }
+
+        return table;
+    }
+
+    static constexpr fpk_hooks_t TABLE = make_table();
+
+    fpk_context_t& m_ctx;
+    Hooks& m_hooks;
+};
+
+
+namespace detail
+{
+
+// Runs f with the unpacker for a package of the given types, or fails as
+// the library would if the types aren't supported or Hooks lacks a key
+// hook they need. Only the unpackers Hooks can support are instantiated.
+
+template <typename Hooks, typename F>
+fpk_result_t dispatch(fpk_context_t& ctx, Hooks& hooks, uint8_t auth_type,
+        uint8_t cipher_type, F&& f)
+{
+    constexpr bool can_auth = can_authenticate<Hooks>;
+    constexpr bool can_decrypt = can_decipher<Hooks>;
+
+    if ( auth_type > FPK_AUTHENTICATION_TYPE_HMAC_SHA256 ||
+        (auth_type != FPK_AUTHENTICATION_TYPE_NONE && !hmac_sha256_enabled) )
+        return FPK_RESULT_UNSUPPORTED_AUTHENTICATION_TYPE;
+
+    if ( cipher_type > FPK_CIPHER_TYPE_AES128_CBC ||
+        (cipher_type != FPK_CIPHER_TYPE_NONE && !aes128_cbc_enabled) )
+        return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+
+    if ( auth_type != FPK_AUTHENTICATION_TYPE_NONE && !can_auth )
+        return FPK_RESULT_NO_AUTHENTICATION_KEY;
+
+    if ( cipher_type != FPK_CIPHER_TYPE_NONE && !can_decrypt )
+        return FPK_RESULT_NO_CIPHER_KEY;
+
+    if ( auth_type == FPK_AUTHENTICATION_TYPE_NONE )
+    {
+        if ( cipher_type == FPK_CIPHER_TYPE_NONE )
+            return f(unpacker<auth::none, cipher::none, Hooks>(ctx, hooks));
+
+        if constexpr ( can_decrypt )
+        {
+            return f(unpacker<auth::none, cipher::aes128_cbc, Hooks>(ctx,
+                    hooks));
+        }
+    }
+    else if constexpr ( can_auth )
+    {
+        if ( cipher_type == FPK_CIPHER_TYPE_NONE )
+        {
+            return f(unpacker<auth::hmac_sha256, cipher::none, Hooks>(ctx,
+                    hooks));
+        }
+
+        if constexpr ( can_decrypt )
+        {
+            return f(unpacker<auth::hmac_sha256, cipher::aes128_cbc,
+                    Hooks>(ctx, hooks));
+        }
+    }
+
+    return FPK_RESULT_UNSUPPORTED_CIPHER_TYPE;
+}
+
+} // namespace detail
+
+
+// Unpacks a package through Hooks' read hooks with the unpacker for its
+// types, given its first 16 bytes, which the caller has read itself.
+// Reading must then start again from the beginning of the package.
+
+template <typename Hooks>
+fpk_result_t unpack(fpk_context_t& ctx, const uint8_t* header,
+        Hooks& hooks, uint32_t options = 0)
+{
+    fpk_result_t result = detail::check_header(header, 16);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    return detail::dispatch(ctx, hooks, header[12], header[13],
+            [options](auto&& unpacker)
+            {
+                return unpacker.unpack(options);
+            });
+}
+
+
+// Unpacks a package in memory with the unpacker for its types.
+
+template <typename Hooks>
+fpk_result_t unpack_buffer(fpk_context_t& ctx, const uint8_t* data,
+        size_t length, Hooks& hooks, uint32_t options = 0)
+{
+    fpk_result_t result = detail::check_header(data, length);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    return detail::dispatch(ctx, hooks, data[12], data[13],
+            [=](auto&& unpacker)
+            {
+                return unpacker.unpack_buffer(data, length, options);
+            });
+}
+
+} // namespace fpk
+
+#endif /* _FPACK_HPP_ */
@@ -0,0 +1,471 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _FPACK_ASYNC_HPP_
+#define _FPACK_ASYNC_HPP_
+
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "fpack.hpp"
+
+
+// C++20 coroutine front end to the push API, for callers whose reads and
+// flash writes are asynchronous. fpk::async_unpack reads the package with
+// co_await backend.read() and feeds it to the context; the pages that the
+// feed would have programmed are copied aside and written afterwards with
+// co_await backend.program(), and so on for the other memory hooks. Any
+// number of unpacks can then be interleaved on one thread by whatever
+// executor resumes the backend's awaitables.
+//
+// Backend has these members; each awaitable yields an fpk_result_t:
+//
+//   read(uint8_t* buffer, size_t size, size_t* length)   awaitable
+//   program(const char* id, uint32_t offset, const uint8_t* data,
+//           size_t length)                                awaitable
+//   commit()                                              awaitable
+//   prepare(const char* id, uint32_t size)                optional, awaitable
+//   finalize(const char* id)                              optional, awaitable
+//   abort(fpk_result_t result)                            optional
+//
+// read sets length to the number of bytes read, 0 at the end of the
+// input. Like fpk_unpack's hooks, the key hooks, handle_metadata and
+// select_image are called synchronously if Backend has them. As with
+// fpk_begin, images are written before the package has been verified;
+// commit is only awaited once it has, and abort is called instead if it
+// fails, or if a write does.
+
+#ifndef FPK_ASYNC_READ_SIZE
+#define FPK_ASYNC_READ_SIZE         4096
+#endif
+
+#ifndef FPK_ASYNC_PAGE_SIZE
+#define FPK_ASYNC_PAGE_SIZE         4096
+#endif
+
+
+namespace fpk
+{
+
+// A lazily started coroutine returning an fpk_result_t. Awaiting it runs
+// it and resumes the awaiter when it is done; a top-level task is run
+// with start() and its result read with result() once done().
+
+class task
+{
+public:
+
+    struct promise_type
+    {
+        fpk_result_t result = FPK_RESULT_OK;
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        task get_return_object()
+        {
+            return task(handle_t::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct final_awaiter
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(handle_t handle)
+                        noexcept
+                {
+                    return handle.promise().continuation;
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+
+            return final_awaiter{};
+        }
+
+        void return_value(fpk_result_t value)
+        {
+            result = value;
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    using handle_t = std::coroutine_handle<promise_type>;
+
+    task(task&& other) noexcept :
+        m_handle(std::exchange(other.m_handle, nullptr))
+    {
+    }
+
+    task& operator=(task&& other) noexcept
+    {
+        if ( this != &other )
+        {
+            if ( m_handle ) m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+
+        return *this;
+    }
+
+    ~task()
+    {
+        if ( m_handle ) m_handle.destroy();
+    }
+
+    void start()
+    {
+        m_handle.resume();
+    }
+
+    bool done() const
+    {
+        return m_handle.done();
+    }
+
+    fpk_result_t result() const
+    {
+        return m_handle.promise().result;
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+            noexcept
+    {
+        m_handle.promise().continuation = awaiter;
+        return m_handle;
+    }
+
+    fpk_result_t await_resume() const noexcept
+    {
+        return m_handle.promise().result;
+    }
+
+private:
+
+    explicit task(handle_t handle) :
+        m_handle(handle)
+    {
+    }
+
+    handle_t m_handle;
+};
+
+
+namespace detail
+{
+
+template <typename Backend, typename = void>
+struct has_prepare : std::false_type {};
+
+template <typename Backend>
+struct has_prepare<Backend, std::void_t<decltype(&Backend::prepare)>> :
+        std::true_type {};
+
+template <typename Backend, typename = void>
+struct has_finalize : std::false_type {};
+
+template <typename Backend>
+struct has_finalize<Backend, std::void_t<decltype(&Backend::finalize)>> :
+        std::true_type {};
+
+template <typename Backend, typename = void>
+struct has_abort : std::false_type {};
+
+template <typename Backend>
+struct has_abort<Backend, std::void_t<decltype(&Backend::abort)>> :
+        std::true_type {};
+
+
+// What a feed asked of the memory hooks, to be done once it returns.
+// Page data is copied into the session's arena, since it may point into
+// input that the feed has finished with.
+
+struct memory_op
+{
+    enum kind_t { PREPARE, PROGRAM, FINALIZE, COMMIT } kind;
+    char id[FPK_KEY_BUFFER_SIZE];
+    uint32_t offset;
+    uint32_t size;
+    size_t data;
+};
+
+
+template <typename Backend>
+struct session
+{
+    Backend& backend;
+    std::vector<memory_op> ops;
+    std::vector<uint8_t> arena;
+    uint8_t page[FPK_ASYNC_PAGE_SIZE];
+
+    memory_op& push(memory_op::kind_t kind, const char* id)
+    {
+        memory_op& op = ops.emplace_back();
+
+        op.kind = kind;
+        op.id[0] = '\0';
+
+        if ( id ) std::strncat(op.id, id, sizeof(op.id) - 1);
+
+        return op;
+    }
+
+    static session& from(void* user_data)
+    {
+        return *static_cast<session*>(user_data);
+    }
+
+    static fpk_result_t prepare_memory(const char* id, uint32_t size,
+            void* user_data)
+    {
+        from(user_data).push(memory_op::PREPARE, id).size = size;
+        return FPK_RESULT_OK;
+    }
+
+    static uint8_t* program_buffer(size_t* page_size, void* user_data)
+    {
+        *page_size = FPK_ASYNC_PAGE_SIZE;
+        return from(user_data).page;
+    }
+
+    static fpk_result_t program_page(const char* id, uint32_t offset,
+            const uint8_t* data, size_t length, void* user_data)
+    {
+        session& s = from(user_data);
+        memory_op& op = s.push(memory_op::PROGRAM, id);
+
+        op.offset = offset;
+        op.size = static_cast<uint32_t>(length);
+        op.data = s.arena.size();
+
+        s.arena.insert(s.arena.end(), data, data + length);
+
+        return FPK_RESULT_OK;
+    }
+
+    static fpk_result_t finalize_memory(const char* id, void* user_data)
+    {
+        from(user_data).push(memory_op::FINALIZE, id);
+        return FPK_RESULT_OK;
+    }
+
+    static fpk_result_t commit_memory(void* user_data)
+    {
+        from(user_data).push(memory_op::COMMIT, nullptr);
+        return FPK_RESULT_OK;
+    }
+
+    // The synchronous hooks go straight to Backend.
+
+    static const uint8_t* authentication_key(fpk_authentication_type_t type,
+            void* user_data)
+    {
+        return from(user_data).backend.authentication_key(type);
+    }
+
+    static const fpk_key_t* prepared_authentication_key(
+            fpk_authentication_type_t type, void* user_data)
+    {
+        return from(user_data).backend.prepared_authentication_key(type);
+    }
+
+    static const uint8_t* cipher_key(fpk_cipher_type_t type, void* user_data)
+    {
+        return from(user_data).backend.cipher_key(type);
+    }
+
+    static const fpk_key_t* prepared_cipher_key(fpk_cipher_type_t type,
+            void* user_data)
+    {
+        return from(user_data).backend.prepared_cipher_key(type);
+    }
+
+    static fpk_result_t handle_metadata(const char* key, const char* value,
+            void* user_data)
+    {
+        return from(user_data).backend.handle_metadata(key, value);
+    }
+
+    static int select_image(const char* id, uint32_t size, void* user_data)
+    {
+        return from(user_data).backend.select_image(id, size);
+    }
+
+    static constexpr fpk_hooks_t make_table()
+    {
+        fpk_hooks_t table = {};
+
+        table.prepare_memory = prepare_memory;
+        table.program_buffer = program_buffer;
+        table.program_page = program_page;
+        table.finalize_memory = finalize_memory;
+        table.commit_memory = commit_memory;
+
+        if constexpr ( has_authentication_key<Backend>::value )
+            table.authentication_key = authentication_key;
+
+        if constexpr ( has_prepared_authentication_key<Backend>::value )
+            table.prepared_authentication_key = prepared_authentication_key;
+
+        if constexpr ( has_cipher_key<Backend>::value )
+            table.cipher_key = cipher_key;
+
+        if constexpr ( has_prepared_cipher_key<Backend>::value )
+            table.prepared_cipher_key = prepared_cipher_key;
+
+        if constexpr ( has_handle_metadata<Backend>::value )
+            table.handle_metadata = handle_metadata;
+
+        if constexpr ( has_select_image<Backend>::value )
+            table.select_image = select_image;
+
+        return table;
+    }
+
+    static constexpr fpk_hooks_t TABLE = make_table();
+};
+
+
+// Carries out the memory ops of one feed, given what the feed returned,
+// and returns the result of the unpack so far. Nothing is written once the
+// feed has failed; that or a failed write calls Backend's abort, whereas a
+// failed commit doesn't, as with commit_memory.
+
+template <typename Backend>
+task run_ops(session<Backend>& s, fpk_result_t result)
+{
+    Backend& backend = s.backend;
+
+    for (const memory_op& op : s.ops)
+    {
+        if ( result != FPK_RESULT_OK &&
+            result != FPK_RESULT_NEED_MORE_INPUT ) break;
+
+        switch (op.kind)
+        {
+        case memory_op::PREPARE:
+            if constexpr ( has_prepare<Backend>::value )
+            {
+                fpk_result_t r = co_await backend.prepare(op.id, op.size);
+                if ( r != FPK_RESULT_OK ) result = r;
+            }
+            break;
+
+        case memory_op::PROGRAM:
+        {
+            fpk_result_t r = co_await backend.program(op.id, op.offset,
+                    s.arena.data() + op.data, op.size);
+            if ( r != FPK_RESULT_OK ) result = r;
+            break;
+        }
+
+        case memory_op::FINALIZE:
+            if constexpr ( has_finalize<Backend>::value )
+            {
+                fpk_result_t r = co_await backend.finalize(op.id);
+                if ( r != FPK_RESULT_OK ) result = r;
+            }
+            break;
+
+        case memory_op::COMMIT:
+            s.ops.clear();
+            s.arena.clear();
+            co_return co_await backend.commit();
+        }
+    }
+
+    s.ops.clear();
+    s.arena.clear();
+
+    if ( result != FPK_RESULT_OK && result != FPK_RESULT_NEED_MORE_INPUT )
+    {
+        if constexpr ( has_abort<Backend>::value ) backend.abort(result);
+    }
+
+    co_return result;
+}
+
+} // namespace detail
+
+
+// Unpacks the package that backend.read() yields. ctx must stay valid
+// until the task completes; options are as for fpk_begin.
+
+template <typename Backend>
+task async_unpack(fpk_context_t& ctx, Backend& backend, uint32_t options = 0)
+{
+    detail::session<Backend> s{backend, {}, {}, {}};
+    uint8_t buffer[FPK_ASYNC_READ_SIZE];
+    fpk_result_t result;
+
+    result = fpk_begin(&ctx, options, &detail::session<Backend>::TABLE, &s);
+    if ( result != FPK_RESULT_OK ) co_return result;
+
+    do
+    {
+        size_t length = 0;
+
+        result = co_await backend.read(buffer, sizeof(buffer), &length);
+
+        if ( result == FPK_RESULT_OK )
+        {
+            if ( length > 0 ) result = fpk_feed(&ctx, buffer, length);
+            else result = fpk_finish(&ctx);
+        }
+
+        result = co_await detail::run_ops(s, result);
+    }
+    while (result == FPK_RESULT_NEED_MORE_INPUT);
+
+    // winds up the context if the read or a write failed first
+    fpk_finish(&ctx);
+
+    co_return result;
+}
+
+} // namespace fpk
+
+#endif /* _FPACK_ASYNC_HPP_ */
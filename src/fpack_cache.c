@@ -0,0 +1,875 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fpack_cache.h"
+
+
+#define IMAGE_ALIGNMENT         64
+
+// Each image is a single allocation: the fpk_cache_image_t, padded so that
+// the data after it is aligned for program_page, then the data and a copy
+// of the package identity.
+#define IMAGE_HEADER_SIZE       ((sizeof(fpk_cache_image_t) + \
+                                IMAGE_ALIGNMENT - 1) & \
+                                ~(size_t) (IMAGE_ALIGNMENT - 1))
+
+
+// State for unpacking a package into the cache. The caller's hooks are
+// called through forwarders, as the hooks given to fpk_unpack get this as
+// their user_data. Images are staged until the package has verified.
+
+typedef struct
+{
+    fpk_cache_t* cache;
+    const fpk_hooks_t* hooks;
+    void* user_data;
+    fpk_hooks_t fill_hooks;
+    const uint8_t* identity;
+    size_t identity_size;
+    const char* id;
+    int too_large;
+    fpk_cache_image_t* staged;
+    fpk_cache_image_t* image;
+    fpk_cache_image_t* wanted;
+    fpk_segment_t segment;
+
+} fill_t;
+
+
+/* ==== IMAGES ============================================================= */
+
+static uint32_t hash_key(const uint8_t* identity, size_t identity_size,
+        const char* id)
+{
+    uint32_t hash = 2166136261UL;
+
+    for (size_t i = 0; i < identity_size; i++)
+        hash = (hash ^ identity[i]) * 16777619UL;
+
+    for (; *id; id++) hash = (hash ^ (uint8_t) *id) * 16777619UL;
+
+    return hash;
+}
+
+
+static size_t image_size(size_t identity_size, uint32_t length)
+{
+    return IMAGE_HEADER_SIZE + length + identity_size;
+}
+
+
+static fpk_cache_image_t* find_image(fpk_cache_t* cache, uint32_t hash,
+        const uint8_t* identity, size_t identity_size, const char* id)
+{
+    fpk_cache_image_t* image = cache->buckets[hash % FPK_CACHE_BUCKETS];
+
+    while (image)
+    {
+        if ( image->hash == hash &&
+            image->identity_size == identity_size &&
+            memcmp(image->identity, identity, identity_size) == 0 &&
+            strcmp(image->id, id) == 0 ) return image;
+
+        image = image->next;
+    }
+
+    return NULL;
+}
+
+
+static void unlink_image(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    fpk_cache_image_t** link = &cache->buckets[image->hash %
+            FPK_CACHE_BUCKETS];
+
+    while (*link != image) link = &(*link)->next;
+    *link = image->next;
+
+    if ( image->newer ) image->newer->older = image->older;
+    else cache->newest = image->older;
+
+    if ( image->older ) image->older->newer = image->newer;
+    else cache->oldest = image->newer;
+
+    image->next = image->newer = image->older = NULL;
+}
+
+
+static void link_newest(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    image->newer = NULL;
+    image->older = cache->newest;
+
+    if ( cache->newest ) cache->newest->newer = image;
+    else cache->oldest = image;
+
+    cache->newest = image;
+}
+
+
+static void touch_image(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    if ( cache->newest == image ) return;
+
+    image->newer->older = image->older;
+
+    if ( image->older ) image->older->newer = image->newer;
+    else cache->oldest = image->newer;
+
+    link_newest(cache, image);
+}
+
+
+static void free_image(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    if ( image->charged ) cache->size -= image->size;
+
+    free(image);
+}
+
+
+// Takes an image out of the cache. One still in use is freed when it is
+// released, and counts against the capacity until then.
+
+static void evict_image(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    unlink_image(cache, image);
+    image->evicted = 1;
+
+    if ( image->refs == 0 ) free_image(cache, image);
+}
+
+
+// Adds a staged image to the cache, in place of any image already cached
+// under its key, evicting the least recently used to make room. Returns 0
+// if it doesn't fit.
+
+static int insert_image(fpk_cache_t* cache, fpk_cache_image_t* image)
+{
+    fpk_cache_image_t* cached = find_image(cache, image->hash,
+            image->identity, image->identity_size, image->id);
+
+    if ( image->size > cache->capacity ) return 0;
+
+    if ( cached ) evict_image(cache, cached);
+
+    while (cache->size + image->size > cache->capacity && cache->oldest)
+    {
+        evict_image(cache, cache->oldest);
+        cache->evictions++;
+    }
+
+    if ( cache->size + image->size > cache->capacity ) return 0;
+
+    image->next = cache->buckets[image->hash % FPK_CACHE_BUCKETS];
+    cache->buckets[image->hash % FPK_CACHE_BUCKETS] = image;
+
+    link_newest(cache, image);
+
+    image->evicted = 0;
+    image->charged = 1;
+    cache->size += image->size;
+
+    return 1;
+}
+
+
+static void free_staged(fill_t* fill)
+{
+    while (fill->staged)
+    {
+        fpk_cache_image_t* image = fill->staged;
+
+        fill->staged = image->next;
+        free(image);
+    }
+
+    fill->image = NULL;
+}
+
+
+/* ==== FILLING ============================================================ */
+
+static fpk_result_t read_file_cb(uint8_t* buffer, uint8_t n_bytes,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->read_file(buffer, n_bytes, fill->user_data);
+}
+
+
+static fpk_result_t read_file_bulk_cb(uint8_t* buffer, size_t n_bytes,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->read_file_bulk(buffer, n_bytes, fill->user_data);
+}
+
+
+static uint8_t* read_buffer_cb(size_t* size, void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->read_buffer(size, fill->user_data);
+}
+
+
+static fpk_result_t seek_file_cb(uint32_t position, void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->seek_file(position, fill->user_data);
+}
+
+
+static const uint8_t* authentication_key_cb(fpk_authentication_type_t type,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->authentication_key(type, fill->user_data);
+}
+
+
+static const uint8_t* cipher_key_cb(fpk_cipher_type_t type, void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->cipher_key(type, fill->user_data);
+}
+
+
+static fpk_result_t handle_metadata_cb(const char* key, const char* value,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->handle_metadata(key, value, fill->user_data);
+}
+
+
+static const fpk_key_t* prepared_authentication_key_cb(
+        fpk_authentication_type_t type, void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->prepared_authentication_key(type, fill->user_data);
+}
+
+
+static const fpk_key_t* prepared_cipher_key_cb(fpk_cipher_type_t type,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->prepared_cipher_key(type, fill->user_data);
+}
+
+
+static uint64_t read_clock_cb(void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->read_clock(fill->user_data);
+}
+
+
+static unsigned verify_threads_cb(void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->verify_threads(fill->user_data);
+}
+
+
+static int submit_task_cb(void (*task) (void* arg), void* arg,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->submit_task(task, arg, fill->user_data);
+}
+
+
+// The verification cache, if the caller has one, is keyed by the same
+// identity as this one.
+
+static const uint8_t* package_identity_cb(size_t* size, void* user_data)
+{
+    fill_t* fill = user_data;
+
+    *size = fill->identity_size;
+    return fill->identity;
+}
+
+
+static int lookup_verified_cb(const uint8_t* key, void* user_data)
+{
+    fill_t* fill = user_data;
+    return fill->hooks->lookup_verified(key, fill->user_data);
+}
+
+
+static void store_verified_cb(const uint8_t* key, void* user_data)
+{
+    fill_t* fill = user_data;
+    fill->hooks->store_verified(key, fill->user_data);
+}
+
+
+static int select_image_cb(const char* id, uint32_t size, void* user_data)
+{
+    fill_t* fill = user_data;
+
+    if ( image_size(fill->identity_size, size) <= fill->cache->capacity )
+        return 1;
+
+    if ( strcmp(id, fill->id) == 0 ) fill->too_large = 1;
+
+    return 0;
+}
+
+
+static fpk_result_t prepare_memory_cb(const char* id, uint32_t size,
+        void* user_data)
+{
+    fill_t* fill = user_data;
+    fpk_cache_image_t* image;
+    uint8_t* data;
+    void* block;
+
+    if ( posix_memalign(&block, IMAGE_ALIGNMENT,
+        image_size(fill->identity_size, size)) != 0 )
+    {
+        return FPK_RESULT_OUT_OF_MEMORY;
+    }
+
+    image = block;
+    data = (uint8_t*) block + IMAGE_HEADER_SIZE;
+
+    memset(image, 0, sizeof(*image));
+    memcpy(data + size, fill->identity, fill->identity_size);
+    strncpy(image->id, id, sizeof(image->id) - 1);
+
+    image->hash = hash_key(fill->identity, fill->identity_size, image->id);
+    image->evicted = 1;
+    image->size = image_size(fill->identity_size, size);
+    image->identity = data + size;
+    image->identity_size = fill->identity_size;
+    image->data = data;
+    image->length = size;
+
+    image->next = fill->staged;
+    fill->staged = image;
+    fill->image = image;
+
+    return FPK_RESULT_OK;
+}
+
+
+// Images are deciphered straight into the cache.
+
+static const fpk_segment_t* image_destination_cb(const char* id,
+        uint32_t size, unsigned* n_segments, void* user_data)
+{
+    fill_t* fill = user_data;
+    fpk_cache_image_t* image = fill->image;
+
+    if ( !image || image->length != size ) return NULL;
+
+    fill->segment.data = (uint8_t*) image->data;
+    fill->segment.length = size;
+    *n_segments = 1;
+
+    return &fill->segment;
+}
+
+
+static fpk_result_t finalize_memory_cb(const char* id, void* user_data)
+{
+    fill_t* fill = user_data;
+
+    fill->image = NULL;
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t commit_memory_cb(void* user_data)
+{
+    fill_t* fill = user_data;
+    fpk_cache_t* cache = fill->cache;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (fill->staged)
+    {
+        fpk_cache_image_t* image = fill->staged;
+        int inserted;
+
+        fill->staged = image->next;
+        image->next = NULL;
+
+        inserted = insert_image(cache, image);
+
+        // the image asked for is kept even if it didn't fit, until the
+        // caller releases it
+        if ( !fill->wanted && strcmp(image->id, fill->id) == 0 )
+        {
+            image->refs++;
+            fill->wanted = image;
+        }
+        else if ( !inserted )
+        {
+            free(image);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    fill->image = NULL;
+    return FPK_RESULT_OK;
+}
+
+
+static void abort_memory_cb(fpk_result_t result, void* user_data)
+{
+    free_staged(user_data);
+}
+
+
+static void set_fill_hooks(fill_t* fill)
+{
+    const fpk_hooks_t* hooks = fill->hooks;
+    fpk_hooks_t* out = &fill->fill_hooks;
+
+    memset(out, 0, sizeof(*out));
+
+    if ( hooks->read_file ) out->read_file = read_file_cb;
+    if ( hooks->read_file_bulk ) out->read_file_bulk = read_file_bulk_cb;
+    if ( hooks->read_buffer ) out->read_buffer = read_buffer_cb;
+    if ( hooks->seek_file ) out->seek_file = seek_file_cb;
+
+    if ( hooks->authentication_key )
+        out->authentication_key = authentication_key_cb;
+
+    if ( hooks->cipher_key ) out->cipher_key = cipher_key_cb;
+
+    if ( hooks->handle_metadata )
+        out->handle_metadata = handle_metadata_cb;
+
+    if ( hooks->prepared_authentication_key )
+        out->prepared_authentication_key = prepared_authentication_key_cb;
+
+    if ( hooks->prepared_cipher_key )
+        out->prepared_cipher_key = prepared_cipher_key_cb;
+
+    if ( hooks->read_clock ) out->read_clock = read_clock_cb;
+    if ( hooks->verify_threads ) out->verify_threads = verify_threads_cb;
+    if ( hooks->submit_task ) out->submit_task = submit_task_cb;
+
+    if ( hooks->lookup_verified )
+    {
+        out->package_identity = package_identity_cb;
+        out->lookup_verified = lookup_verified_cb;
+    }
+
+    if ( hooks->store_verified ) out->store_verified = store_verified_cb;
+
+    out->select_image = select_image_cb;
+    out->prepare_memory = prepare_memory_cb;
+    out->image_destination = image_destination_cb;
+    out->finalize_memory = finalize_memory_cb;
+    out->commit_memory = commit_memory_cb;
+    out->abort_memory = abort_memory_cb;
+}
+
+
+// Unpacks the package into the cache, returning image id in wanted (in
+// use, so that it can't be evicted before it is programmed).
+
+static fpk_result_t fill_cache(fpk_cache_t* cache, fpk_context_t* ctx,
+        const uint8_t* identity, size_t identity_size, const char* id,
+        uint32_t options, const fpk_hooks_t* hooks, void* user_data,
+        fpk_cache_image_t** wanted)
+{
+    fpk_result_t result;
+    fill_t* fill;
+
+    fill = malloc(sizeof(*fill));
+    if ( !fill ) return FPK_RESULT_OUT_OF_MEMORY;
+
+    fill->cache = cache;
+    fill->hooks = hooks;
+    fill->user_data = user_data;
+    fill->identity = identity;
+    fill->identity_size = identity_size;
+    fill->id = id;
+    fill->too_large = 0;
+    fill->staged = NULL;
+    fill->image = NULL;
+    fill->wanted = NULL;
+
+    set_fill_hooks(fill);
+
+    result = fpk_unpack(ctx, options, &fill->fill_hooks, fill);
+
+    if ( result == FPK_RESULT_OK && !fill->wanted )
+    {
+        if ( fill->too_large ) result = FPK_RESULT_OUT_OF_MEMORY;
+        else result = FPK_RESULT_UNKNOWN_ID;
+    }
+
+    *wanted = fill->wanted;
+
+    free_staged(fill);
+    free(fill);
+
+    return result;
+}
+
+
+/* ==== PROGRAMMING ======================================================== */
+
+// Programs the cached data with program_page_async, as an unpack would:
+// each page is copied into a free slot of the program_buffer and started
+// there, waiting for a slot to come free whenever they are all busy.
+
+static fpk_result_t program_slots(const fpk_cache_image_t* image,
+        const fpk_hooks_t* hooks, void* user_data)
+{
+    fpk_result_t result = FPK_RESULT_OK;
+    unsigned busy = 0;
+    uint32_t offset = 0;
+    size_t page_size = 0;
+    uint8_t* slots = NULL;
+
+    if ( hooks->program_buffer && hooks->wait_program )
+        slots = hooks->program_buffer(&page_size, user_data);
+
+    if ( !slots || page_size == 0 ) return FPK_RESULT_MANDATORY_HOOK_MISSING;
+
+    while (busy || (result == FPK_RESULT_OK && offset < image->length))
+    {
+        unsigned slot = 0;
+        size_t n;
+
+        if ( result != FPK_RESULT_OK || offset >= image->length ||
+            busy == (1u << FPK_PROGRAM_SLOTS) - 1 )
+        {
+            fpk_result_t wait_result;
+
+            slot = FPK_PROGRAM_SLOTS;
+            wait_result = hooks->wait_program(&slot, user_data);
+
+            if ( slot < FPK_PROGRAM_SLOTS && (busy & (1u << slot)) )
+            {
+                busy &= ~(1u << slot);
+            }
+            else
+            {
+                busy = 0;
+                if ( wait_result == FPK_RESULT_OK )
+                    wait_result = FPK_RESULT_PROGRAM_ERROR;
+            }
+
+            if ( result == FPK_RESULT_OK ) result = wait_result;
+            continue;
+        }
+
+        while (busy & (1u << slot)) slot++;
+
+        n = image->length - offset;
+        if ( n > page_size ) n = page_size;
+
+        memcpy(slots + slot * page_size, image->data + offset, n);
+
+        result = hooks->program_page_async(image->id, offset,
+                slots + slot * page_size, n, slot, user_data);
+
+        if ( result == FPK_RESULT_OK ) busy |= 1u << slot;
+        offset += (uint32_t) n;
+    }
+
+    return result;
+}
+
+
+// Copies the cached data into the segments from image_destination.
+
+static fpk_result_t store_segments(const fpk_cache_image_t* image,
+        const fpk_segment_t* segments, unsigned n_segments)
+{
+    uint32_t offset = 0;
+
+    for (unsigned i = 0; i < n_segments && offset < image->length; i++)
+    {
+        size_t n = image->length - offset;
+
+        if ( n > segments[i].length ) n = segments[i].length;
+
+        memcpy(segments[i].data, image->data + offset, n);
+        offset += (uint32_t) n;
+    }
+
+    if ( offset < image->length ) return FPK_RESULT_PROGRAM_ERROR;
+
+    return FPK_RESULT_OK;
+}
+
+
+// Hands the cached data to the caller's programming hooks the way an
+// unpack would, but without copying any of it (bar into the slots of
+// program_page_async or the segments from image_destination).
+
+static fpk_result_t program_image(const fpk_cache_image_t* image,
+        const fpk_hooks_t* hooks, void* user_data)
+{
+    fpk_result_t result = FPK_RESULT_OK;
+    const fpk_segment_t* segments = NULL;
+    unsigned n_segments = 0;
+    uint32_t offset = 0;
+
+    if ( hooks->prepare_memory )
+        result = hooks->prepare_memory(image->id, image->length, user_data);
+
+    if ( result == FPK_RESULT_OK && hooks->image_destination )
+    {
+        segments = hooks->image_destination(image->id, image->length,
+                &n_segments, user_data);
+    }
+
+    if ( segments )
+    {
+        result = store_segments(image, segments, n_segments);
+    }
+    else if ( hooks->program_view )
+    {
+        if ( result == FPK_RESULT_OK && image->length > 0 )
+        {
+            result = hooks->program_view(image->id, 0, image->data,
+                    image->length, user_data);
+        }
+    }
+    else if ( hooks->program_page_async )
+    {
+        if ( result == FPK_RESULT_OK )
+            result = program_slots(image, hooks, user_data);
+    }
+    else if ( hooks->program_page )
+    {
+        size_t page_size = 0;
+
+        if ( !hooks->program_buffer ||
+            !hooks->program_buffer(&page_size, user_data) ||
+            page_size == 0 ) return FPK_RESULT_MANDATORY_HOOK_MISSING;
+
+        while (result == FPK_RESULT_OK && offset < image->length)
+        {
+            size_t n = image->length - offset;
+
+            if ( n >= page_size )
+            {
+                n = page_size;
+                result = hooks->program_page(image->id, offset,
+                        image->data + offset, n, user_data);
+            }
+            else if ( hooks->program_tail )
+            {
+                result = hooks->program_tail(image->id, offset,
+                        image->data + offset, n, user_data);
+            }
+            else
+            {
+                result = hooks->program_page(image->id, offset,
+                        image->data + offset, n, user_data);
+            }
+
+            offset += (uint32_t) n;
+        }
+    }
+    else
+    {
+        if ( !hooks->program_memory ) return FPK_RESULT_PROGRAM_ERROR;
+
+        while (result == FPK_RESULT_OK && offset < image->length)
+        {
+            uint32_t n = image->length - offset;
+
+            if ( n > FPK_DATA_BUFFER_SIZE ) n = FPK_DATA_BUFFER_SIZE;
+
+            result = hooks->program_memory(image->id, image->data + offset,
+                    (uint8_t) n, user_data);
+
+            offset += n;
+        }
+    }
+
+    if ( result == FPK_RESULT_OK && hooks->finalize_memory )
+        result = hooks->finalize_memory(image->id, user_data);
+
+    return result;
+}
+
+
+/* ==== API ================================================================ */
+
+fpk_result_t fpk_cache_init(fpk_cache_t* cache, size_t capacity)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = capacity;
+
+    if ( pthread_mutex_init(&cache->lock, NULL) != 0 )
+        return FPK_RESULT_OUT_OF_MEMORY;
+
+    if ( pthread_cond_init(&cache->filled, NULL) != 0 )
+    {
+        pthread_mutex_destroy(&cache->lock);
+        return FPK_RESULT_OUT_OF_MEMORY;
+    }
+
+    return FPK_RESULT_OK;
+}
+
+
+void fpk_cache_destroy(fpk_cache_t* cache)
+{
+    while (cache->oldest) evict_image(cache, cache->oldest);
+
+    pthread_cond_destroy(&cache->filled);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+const fpk_cache_image_t* fpk_cache_acquire(fpk_cache_t* cache,
+        const uint8_t* identity, size_t identity_size, const char* id)
+{
+    uint32_t hash = hash_key(identity, identity_size, id);
+    fpk_cache_image_t* image;
+
+    pthread_mutex_lock(&cache->lock);
+
+    image = find_image(cache, hash, identity, identity_size, id);
+
+    if ( image )
+    {
+        image->refs++;
+        touch_image(cache, image);
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return image;
+}
+
+
+void fpk_cache_release(fpk_cache_t* cache, const fpk_cache_image_t* image)
+{
+    fpk_cache_image_t* released = (fpk_cache_image_t*) image;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if ( --released->refs == 0 && released->evicted )
+        free_image(cache, released);
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+static int filling(const fpk_cache_t* cache, const uint8_t* identity,
+        size_t identity_size)
+{
+    const fpk_cache_fill_t* fill;
+
+    for (fill = cache->fills; fill; fill = fill->next)
+    {
+        if ( fill->identity_size == identity_size &&
+            memcmp(fill->identity, identity, identity_size) == 0 ) return 1;
+    }
+
+    return 0;
+}
+
+
+fpk_result_t fpk_cache_program(fpk_cache_t* cache, fpk_context_t* ctx,
+        const uint8_t* identity, size_t identity_size, const char* id,
+        uint32_t options, const fpk_hooks_t* hooks, void* user_data)
+{
+    uint32_t hash = hash_key(identity, identity_size, id);
+    fpk_cache_image_t* image;
+    fpk_cache_fill_t fill;
+    fpk_result_t result;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (;;)
+    {
+        image = find_image(cache, hash, identity, identity_size, id);
+
+        if ( image || !filling(cache, identity, identity_size) ) break;
+
+        pthread_cond_wait(&cache->filled, &cache->lock);
+    }
+
+    if ( image )
+    {
+        image->refs++;
+        touch_image(cache, image);
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+
+        fill.identity = identity;
+        fill.identity_size = identity_size;
+        fill.next = cache->fills;
+        cache->fills = &fill;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if ( !image )
+    {
+        fpk_cache_fill_t** link = &cache->fills;
+
+        result = fill_cache(cache, ctx, identity, identity_size, id,
+                options, hooks, user_data, &image);
+
+        pthread_mutex_lock(&cache->lock);
+
+        while (*link != &fill) link = &(*link)->next;
+        *link = fill.next;
+
+        pthread_cond_broadcast(&cache->filled);
+        pthread_mutex_unlock(&cache->lock);
+
+        if ( result != FPK_RESULT_OK ) return result;
+    }
+
+    result = program_image(image, hooks, user_data);
+
+    fpk_cache_release(cache, image);
+
+    return result;
+}
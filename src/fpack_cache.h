@@ -0,0 +1,121 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FPACK_CACHE_H_
+#define _FPACK_CACHE_H_
+
+#include <pthread.h>
+
+#include "fpack.h"
+
+
+// A cache of deciphered images, shared by any number of threads each
+// unpacking with their own context (POSIX threads). Images are keyed by an
+// identity that the caller gives for the package (as with the
+// package_identity hook) and their id, and are only added once the
+// package has verified. It holds at most capacity bytes, including a
+// small overhead per image, and evicts the least recently used images to
+// make room; images in use stay valid until released.
+
+#define FPK_CACHE_BUCKETS           1024
+
+
+typedef struct fpk_cache_image_s
+{
+    struct fpk_cache_image_s* newer;
+    struct fpk_cache_image_s* older;
+    struct fpk_cache_image_s* next;
+    uint32_t hash;
+    unsigned refs;
+    uint8_t evicted;
+    uint8_t charged;
+    size_t size;
+    const uint8_t* identity;
+    size_t identity_size;
+    char id[FPK_KEY_BUFFER_SIZE];
+    const uint8_t* data;
+    uint32_t length;
+
+} fpk_cache_image_t;
+
+
+typedef struct fpk_cache_fill_s
+{
+    struct fpk_cache_fill_s* next;
+    const uint8_t* identity;
+    size_t identity_size;
+
+} fpk_cache_fill_t;
+
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    size_t capacity;
+    size_t size;
+    fpk_cache_image_t* newest;
+    fpk_cache_image_t* oldest;
+    fpk_cache_image_t* buckets[FPK_CACHE_BUCKETS];
+    fpk_cache_fill_t* fills;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+} fpk_cache_t;
+
+
+fpk_result_t fpk_cache_init(fpk_cache_t* cache, size_t capacity);
+
+// Frees every image, none of which may still be in use.
+
+void fpk_cache_destroy(fpk_cache_t* cache);
+
+
+// Returns image id of the package with the given identity, or NULL if it
+// isn't cached. The image's data stays valid, even if it is evicted, until
+// it is passed to fpk_cache_release.
+
+const fpk_cache_image_t* fpk_cache_acquire(fpk_cache_t* cache,
+        const uint8_t* identity, size_t identity_size, const char* id);
+
+void fpk_cache_release(fpk_cache_t* cache, const fpk_cache_image_t* image);
+
+
+// Programs image id of the package with the given identity through the
+// prepare_memory, program_view, program_page (or program_memory),
+// program_tail and finalize_memory hooks, handing them the cached data
+// itself rather than a copy; program_buffer is only asked for the page
+// size. image_destination and program_page_async get the data copied into
+// their own memory, as in an unpack. On a miss, the package is first
+// unpacked with fpk_unpack, using ctx, options and the rest of hooks, and
+// every image in it that fits is cached. Threads that miss on a package
+// while another is unpacking it wait for that rather than unpack it again.
+// Fails with FPK_RESULT_UNKNOWN_ID if the package has no such image and
+// FPK_RESULT_OUT_OF_MEMORY if it is too large for the cache.
+
+fpk_result_t fpk_cache_program(fpk_cache_t* cache, fpk_context_t* ctx,
+        const uint8_t* identity, size_t identity_size, const char* id,
+        uint32_t options, const fpk_hooks_t* hooks, void* user_data);
+
+#endif /* _FPACK_CACHE_H_ */
@@ -0,0 +1,758 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fpack_catalog.h"
+
+
+#define SCAN_BUFFER_SIZE        65536
+
+
+typedef struct
+{
+    fpk_catalog_package_t* packages;
+    size_t n_packages;
+    size_t packages_capacity;
+    fpk_catalog_image_t* images;
+    size_t n_images;
+    size_t images_capacity;
+    fpk_catalog_metadata_t* metadata;
+    size_t n_metadata;
+    size_t metadata_capacity;
+    char* strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    int out_of_memory;
+
+} builder_t;
+
+
+// State for cataloging one package at a time. The caller's key hooks are
+// called through forwarders, as the hooks given to fpk_probe and fpk_index
+// get this as their user_data.
+
+typedef struct
+{
+    builder_t* builder;
+    FILE* file;
+    const fpk_hooks_t* hooks;
+    void* user_data;
+    fpk_context_t ctx;
+    fpk_image_entry_t* entries;
+    uint16_t entries_capacity;
+    uint8_t buffer[SCAN_BUFFER_SIZE];
+
+} scan_t;
+
+
+/* ==== BUILDING =========================================================== */
+
+// Makes sure array has room for needed items, doubling its capacity as
+// need be. On failure, array is returned as it was and the builder is
+// marked as out of memory.
+
+static void* reserve(builder_t* b, void* array, size_t* capacity,
+        size_t needed, size_t item_size)
+{
+    size_t n = *capacity;
+    void* grown;
+
+    if ( needed <= n ) return array;
+
+    while (n < needed) n = n ? n * 2 : 64;
+
+    grown = realloc(array, n * item_size);
+
+    if ( !grown )
+    {
+        b->out_of_memory = 1;
+        return array;
+    }
+
+    *capacity = n;
+    return grown;
+}
+
+
+static uint32_t add_string(builder_t* b, const char* string)
+{
+    size_t n = strlen(string) + 1;
+    uint32_t offset = (uint32_t) b->strings_size;
+
+    if ( b->strings_size + n > UINT32_MAX )
+    {
+        b->out_of_memory = 1;
+        return 0;
+    }
+
+    b->strings = reserve(b, b->strings, &b->strings_capacity,
+            b->strings_size + n, 1);
+
+    if ( b->out_of_memory ) return 0;
+
+    memcpy(b->strings + b->strings_size, string, n);
+    b->strings_size += n;
+
+    return offset;
+}
+
+
+static void add_image(builder_t* b, const char* id, uint32_t offset,
+        uint32_t length)
+{
+    fpk_catalog_image_t* image;
+
+    b->images = reserve(b, b->images, &b->images_capacity, b->n_images + 1,
+            sizeof(*b->images));
+
+    if ( b->out_of_memory ) return;
+
+    image = &b->images[b->n_images++];
+    image->id = add_string(b, id);
+    image->offset = offset;
+    image->length = length;
+}
+
+
+static void add_metadata(builder_t* b, const char* key, const char* value)
+{
+    fpk_catalog_metadata_t* metadata;
+
+    b->metadata = reserve(b, b->metadata, &b->metadata_capacity,
+            b->n_metadata + 1, sizeof(*b->metadata));
+
+    if ( b->out_of_memory ) return;
+
+    metadata = &b->metadata[b->n_metadata++];
+    metadata->key = add_string(b, key);
+    metadata->value = add_string(b, value);
+}
+
+
+static fpk_catalog_package_t* add_package(builder_t* b, const char* name)
+{
+    fpk_catalog_package_t* package;
+
+    b->packages = reserve(b, b->packages, &b->packages_capacity,
+            b->n_packages + 1, sizeof(*b->packages));
+
+    if ( b->out_of_memory ) return NULL;
+
+    package = &b->packages[b->n_packages++];
+    memset(package, 0, sizeof(*package));
+
+    package->name = add_string(b, name);
+    package->first_image = (uint32_t) b->n_images;
+    package->first_metadata = (uint32_t) b->n_metadata;
+
+    return package;
+}
+
+
+static void free_builder(builder_t* b)
+{
+    free(b->packages);
+    free(b->images);
+    free(b->metadata);
+    free(b->strings);
+}
+
+
+/* ==== SCANNING =========================================================== */
+
+static fpk_result_t read_file_cb(uint8_t* buffer, size_t n_bytes,
+        void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( fread(buffer, n_bytes, 1, scan->file) == 1 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_READ_ERROR;
+}
+
+
+static uint8_t* read_buffer_cb(size_t* size, void* user_data)
+{
+    scan_t* scan = user_data;
+
+    *size = sizeof(scan->buffer);
+    return scan->buffer;
+}
+
+
+static fpk_result_t seek_file_cb(uint32_t position, void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( fseek(scan->file, position, SEEK_SET) == 0 ) return FPK_RESULT_OK;
+    else return FPK_RESULT_READ_ERROR;
+}
+
+
+static fpk_result_t handle_metadata_cb(const char* key, const char* value,
+        void* user_data)
+{
+    scan_t* scan = user_data;
+
+    add_metadata(scan->builder, key, value);
+
+    if ( scan->builder->out_of_memory ) return FPK_RESULT_OUT_OF_MEMORY;
+    else return FPK_RESULT_OK;
+}
+
+
+static const uint8_t* authentication_key_cb(fpk_authentication_type_t type,
+        void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( !scan->hooks->authentication_key ) return NULL;
+    return scan->hooks->authentication_key(type, scan->user_data);
+}
+
+
+static const uint8_t* cipher_key_cb(fpk_cipher_type_t type, void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( !scan->hooks->cipher_key ) return NULL;
+    return scan->hooks->cipher_key(type, scan->user_data);
+}
+
+
+static const fpk_key_t* prepared_authentication_key_cb(
+        fpk_authentication_type_t type, void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( !scan->hooks->prepared_authentication_key ) return NULL;
+    return scan->hooks->prepared_authentication_key(type, scan->user_data);
+}
+
+
+static const fpk_key_t* prepared_cipher_key_cb(fpk_cipher_type_t type,
+        void* user_data)
+{
+    scan_t* scan = user_data;
+
+    if ( !scan->hooks->prepared_cipher_key ) return NULL;
+    return scan->hooks->prepared_cipher_key(type, scan->user_data);
+}
+
+
+// The probe only wants the header; metadata is taken from fpk_index,
+// once it has been verified.
+
+static const fpk_hooks_t PROBE_HOOKS =
+{
+    .read_file_bulk =               read_file_cb,
+    .cipher_key =                   cipher_key_cb,
+    .prepared_cipher_key =          prepared_cipher_key_cb,
+};
+
+
+static const fpk_hooks_t INDEX_HOOKS =
+{
+    .read_file_bulk =               read_file_cb,
+    .read_buffer =                  read_buffer_cb,
+    .seek_file =                    seek_file_cb,
+    .handle_metadata =              handle_metadata_cb,
+    .authentication_key =           authentication_key_cb,
+    .cipher_key =                   cipher_key_cb,
+    .prepared_authentication_key =  prepared_authentication_key_cb,
+    .prepared_cipher_key =          prepared_cipher_key_cb,
+};
+
+
+// Verifies and indexes the package open as scan->file into package,
+// growing the entries array and starting over if it has more images than
+// fit.
+
+static fpk_result_t index_package(scan_t* scan,
+        fpk_catalog_package_t* package)
+{
+    builder_t* b = scan->builder;
+    size_t n_metadata = b->n_metadata;
+    size_t strings_size = b->strings_size;
+    fpk_result_t result;
+    uint16_t n;
+
+    for (;;)
+    {
+        rewind(scan->file);
+
+        result = fpk_index(&scan->ctx, 0, &INDEX_HOOKS, scan, scan->entries,
+                scan->entries_capacity, &n);
+
+        if ( result != FPK_RESULT_OK || n <= scan->entries_capacity ) break;
+
+        // drop what this attempt added before the next
+        b->n_metadata = n_metadata;
+        b->strings_size = strings_size;
+
+        free(scan->entries);
+        scan->entries = malloc(n * sizeof(*scan->entries));
+        scan->entries_capacity = scan->entries ? n : 0;
+
+        if ( !scan->entries ) return FPK_RESULT_OUT_OF_MEMORY;
+    }
+
+    if ( result != FPK_RESULT_OK )
+    {
+        b->n_metadata = n_metadata;
+        b->strings_size = strings_size;
+
+        return result;
+    }
+
+    for (uint16_t i = 0; i < n; i++)
+    {
+        add_image(b, scan->entries[i].id, scan->entries[i].offset,
+                scan->entries[i].length);
+    }
+
+    package->n_images = n;
+    package->n_metadata = (uint32_t) (b->n_metadata - n_metadata);
+
+    return FPK_RESULT_OK;
+}
+
+
+static void scan_package(scan_t* scan, int dir_fd, const char* name)
+{
+    fpk_catalog_package_t* package;
+    fpk_probe_t probe;
+    fpk_result_t result;
+    struct stat st;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY);
+    if ( fd < 0 ) return;
+
+    if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        !(scan->file = fdopen(fd, "rb")) )
+    {
+        close(fd);
+        return;
+    }
+
+    package = add_package(scan->builder, name);
+
+    if ( package )
+    {
+        package->device = st.st_dev;
+        package->inode = st.st_ino;
+        package->size = st.st_size;
+        package->mtime_sec = st.st_mtim.tv_sec;
+        package->mtime_nsec = st.st_mtim.tv_nsec;
+
+        result = fpk_probe(&scan->ctx, &PROBE_HOOKS, scan, &probe);
+
+        package->timestamp = probe.timestamp;
+        package->n_blocks = probe.n_blocks;
+        package->auth_type = (uint8_t) probe.auth_type;
+        package->cipher_type = (uint8_t) probe.cipher_type;
+
+        if ( result == FPK_RESULT_OK ) result = index_package(scan, package);
+
+        package->status = result;
+    }
+
+    fclose(scan->file);
+}
+
+
+// Reads the header timestamp of the package name, returning 0 if it
+// can't.
+
+static int read_timestamp(int dir_fd, const char* name, uint32_t* timestamp)
+{
+    uint8_t header[16];
+    ssize_t n;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY);
+    if ( fd < 0 ) return 0;
+
+    n = pread(fd, header, sizeof(header), 0);
+    close(fd);
+
+    if ( n != (ssize_t) sizeof(header) ) return 0;
+
+    *timestamp = (uint32_t) header[4] |
+            ((uint32_t) header[5] << 8) |
+            ((uint32_t) header[6] << 16) |
+            ((uint32_t) header[7] << 24);
+
+    return 1;
+}
+
+
+static int unchanged(const fpk_catalog_package_t* package,
+        const struct stat* st, int dir_fd, const char* name)
+{
+    uint32_t timestamp;
+
+    if ( package->device != (uint64_t) st->st_dev ||
+        package->inode != (uint64_t) st->st_ino ||
+        package->size != (uint64_t) st->st_size ||
+        package->mtime_sec != (int64_t) st->st_mtim.tv_sec ||
+        package->mtime_nsec != (int64_t) st->st_mtim.tv_nsec ) return 0;
+
+    if ( !read_timestamp(dir_fd, name, &timestamp) ) return 0;
+
+    return timestamp == package->timestamp;
+}
+
+
+static void copy_package(builder_t* b, const fpk_catalog_t* catalog,
+        const fpk_catalog_package_t* from)
+{
+    const fpk_catalog_image_t* images = fpk_catalog_images(catalog, from);
+    const fpk_catalog_metadata_t* metadata = fpk_catalog_metadata(catalog,
+            from);
+    fpk_catalog_package_t* package;
+    fpk_catalog_package_t copy = *from;
+
+    package = add_package(b, fpk_catalog_string(catalog, from->name));
+    if ( !package ) return;
+
+    copy.name = package->name;
+    copy.first_image = package->first_image;
+    copy.first_metadata = package->first_metadata;
+    copy.n_images = images ? from->n_images : 0;
+    copy.n_metadata = metadata ? from->n_metadata : 0;
+
+    *package = copy;
+
+    // in the order scanning adds them, so that a refresh with nothing to do
+    // writes the same file
+
+    for (uint32_t i = 0; i < copy.n_metadata; i++)
+    {
+        add_metadata(b, fpk_catalog_string(catalog, metadata[i].key),
+                fpk_catalog_string(catalog, metadata[i].value));
+    }
+
+    for (uint32_t i = 0; i < copy.n_images; i++)
+    {
+        add_image(b, fpk_catalog_string(catalog, images[i].id),
+                images[i].offset, images[i].length);
+    }
+}
+
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+// Lists the *.fpk files in dir, sorted by name.
+
+static fpk_result_t list_packages(DIR* dir, char*** names, size_t* n_names)
+{
+    struct dirent* entry;
+    size_t capacity = 0;
+    size_t n = 0;
+    char** list = NULL;
+
+    while ((entry = readdir(dir)))
+    {
+        size_t length = strlen(entry->d_name);
+        char** grown;
+
+        if ( length < 5 || strcmp(entry->d_name + length - 4, ".fpk") != 0 )
+            continue;
+
+        if ( n == capacity )
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(list, capacity * sizeof(*list));
+            if ( !grown ) break;
+
+            list = grown;
+        }
+
+        list[n] = strdup(entry->d_name);
+        if ( !list[n] ) break;
+
+        n++;
+    }
+
+    *names = list;
+    *n_names = n;
+
+    if ( entry ) return FPK_RESULT_OUT_OF_MEMORY;
+
+    qsort(list, n, sizeof(*list), compare_names);
+
+    return FPK_RESULT_OK;
+}
+
+
+static fpk_result_t write_catalog(const builder_t* b, const char* path)
+{
+    fpk_catalog_header_t header;
+    FILE* file;
+    int ok;
+
+    header.magic = FPK_CATALOG_MAGIC;
+    header.version = FPK_CATALOG_VERSION;
+    header.n_packages = (uint32_t) b->n_packages;
+    header.n_images = (uint32_t) b->n_images;
+    header.n_metadata = (uint32_t) b->n_metadata;
+    header.strings_size = (uint32_t) b->strings_size;
+
+    file = fopen(path, "wb");
+    if ( !file ) return FPK_RESULT_WRITE_ERROR;
+
+    ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    ok = ok && fwrite(b->packages, sizeof(*b->packages), b->n_packages,
+            file) == b->n_packages;
+
+    ok = ok && fwrite(b->images, sizeof(*b->images), b->n_images,
+            file) == b->n_images;
+
+    ok = ok && fwrite(b->metadata, sizeof(*b->metadata), b->n_metadata,
+            file) == b->n_metadata;
+
+    ok = ok && fwrite(b->strings, 1, b->strings_size, file) ==
+            b->strings_size;
+
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+
+    return ok ? FPK_RESULT_OK : FPK_RESULT_WRITE_ERROR;
+}
+
+
+/* ==== API ================================================================ */
+
+fpk_result_t fpk_catalog_open(fpk_catalog_t* catalog, const char* path)
+{
+    const fpk_catalog_header_t* header;
+    const uint8_t* data;
+    fpk_result_t result;
+    size_t length;
+    size_t size;
+
+    result = fpk_file_map(&catalog->file, path);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    data = catalog->file.data;
+    length = catalog->file.length;
+    header = (const fpk_catalog_header_t*) data;
+
+    if ( length < sizeof(*header) ||
+        header->magic != FPK_CATALOG_MAGIC ||
+        header->version != FPK_CATALOG_VERSION )
+    {
+        fpk_catalog_close(catalog);
+        return FPK_RESULT_INVALID_FPK_FILE;
+    }
+
+    // the counts are 32-bit, so none of this can overflow a 64-bit size_t,
+    // and the check against the file length covers everything after
+
+    size = sizeof(*header) +
+            (uint64_t) header->n_packages * sizeof(fpk_catalog_package_t) +
+            (uint64_t) header->n_images * sizeof(fpk_catalog_image_t) +
+            (uint64_t) header->n_metadata * sizeof(fpk_catalog_metadata_t) +
+            header->strings_size;
+
+    if ( size != length || (header->strings_size > 0 &&
+        data[length - 1] != 0) )
+    {
+        fpk_catalog_close(catalog);
+        return FPK_RESULT_INVALID_FPK_FILE;
+    }
+
+    catalog->header = header;
+    catalog->packages = (const fpk_catalog_package_t*) (header + 1);
+    catalog->images = (const fpk_catalog_image_t*)
+            (catalog->packages + header->n_packages);
+    catalog->metadata = (const fpk_catalog_metadata_t*)
+            (catalog->images + header->n_images);
+    catalog->strings = (const char*)
+            (catalog->metadata + header->n_metadata);
+
+    // lookups hop about the file rather than reading it through
+
+    posix_madvise((void*) data, length, POSIX_MADV_RANDOM);
+
+    return FPK_RESULT_OK;
+}
+
+
+void fpk_catalog_close(fpk_catalog_t* catalog)
+{
+    fpk_file_unmap(&catalog->file);
+    catalog->header = NULL;
+}
+
+
+fpk_result_t fpk_catalog_update(const char* path, const char* directory,
+        const fpk_hooks_t* hooks, void* user_data)
+{
+    fpk_catalog_t previous;
+    int have_previous;
+    builder_t builder;
+    scan_t* scan;
+    DIR* dir;
+    char** names = NULL;
+    size_t n_names = 0;
+    char* temp_path;
+    fpk_result_t result;
+
+    dir = opendir(directory);
+    if ( !dir ) return FPK_RESULT_READ_ERROR;
+
+    memset(&builder, 0, sizeof(builder));
+
+    scan = calloc(1, sizeof(*scan));
+    temp_path = malloc(strlen(path) + 5);
+
+    result = list_packages(dir, &names, &n_names);
+
+    if ( result == FPK_RESULT_OK && (!scan || !temp_path) )
+        result = FPK_RESULT_OUT_OF_MEMORY;
+
+    have_previous = fpk_catalog_open(&previous, path) == FPK_RESULT_OK;
+
+    if ( result == FPK_RESULT_OK )
+    {
+        int dir_fd = dirfd(dir);
+
+        scan->builder = &builder;
+        scan->hooks = hooks;
+        scan->user_data = user_data;
+
+        for (size_t i = 0; i < n_names && !builder.out_of_memory; i++)
+        {
+            const fpk_catalog_package_t* package = NULL;
+            struct stat st;
+
+            if ( fstatat(dir_fd, names[i], &st, 0) != 0 ||
+                !S_ISREG(st.st_mode) ) continue;
+
+            if ( have_previous )
+                package = fpk_catalog_find(&previous, names[i]);
+
+            if ( package && unchanged(package, &st, dir_fd, names[i]) )
+                copy_package(&builder, &previous, package);
+            else
+                scan_package(scan, dir_fd, names[i]);
+        }
+
+        if ( builder.out_of_memory ) result = FPK_RESULT_OUT_OF_MEMORY;
+    }
+
+    if ( result == FPK_RESULT_OK )
+    {
+        strcpy(temp_path, path);
+        strcat(temp_path, ".tmp");
+
+        result = write_catalog(&builder, temp_path);
+
+        if ( result == FPK_RESULT_OK && rename(temp_path, path) != 0 )
+            result = FPK_RESULT_WRITE_ERROR;
+
+        if ( result != FPK_RESULT_OK ) unlink(temp_path);
+    }
+
+    if ( have_previous ) fpk_catalog_close(&previous);
+
+    for (size_t i = 0; i < n_names; i++) free(names[i]);
+    free(names);
+
+    if ( scan ) free(scan->entries);
+    free(scan);
+    free(temp_path);
+    free_builder(&builder);
+    closedir(dir);
+
+    return result;
+}
+
+
+const fpk_catalog_package_t* fpk_catalog_find(const fpk_catalog_t* catalog,
+        const char* name)
+{
+    size_t low = 0;
+    size_t high = catalog->header->n_packages;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        const fpk_catalog_package_t* package = &catalog->packages[middle];
+        int order = strcmp(name, fpk_catalog_string(catalog, package->name));
+
+        if ( order == 0 ) return package;
+
+        if ( order < 0 ) high = middle;
+        else low = middle + 1;
+    }
+
+    return NULL;
+}
+
+
+const fpk_catalog_image_t* fpk_catalog_images(const fpk_catalog_t* catalog,
+        const fpk_catalog_package_t* package)
+{
+    if ( (uint64_t) package->first_image + package->n_images >
+        catalog->header->n_images ) return NULL;
+
+    return catalog->images + package->first_image;
+}
+
+
+const fpk_catalog_metadata_t* fpk_catalog_metadata(
+        const fpk_catalog_t* catalog, const fpk_catalog_package_t* package)
+{
+    if ( (uint64_t) package->first_metadata + package->n_metadata >
+        catalog->header->n_metadata ) return NULL;
+
+    return catalog->metadata + package->first_metadata;
+}
+
+
+const char* fpk_catalog_string(const fpk_catalog_t* catalog,
+        uint32_t offset)
+{
+    if ( offset >= catalog->header->strings_size ) return "";
+
+    return catalog->strings + offset;
+}
@@ -0,0 +1,163 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _FPACK_CATALOG_H_
+#define _FPACK_CATALOG_H_
+
+#include "fpack.h"
+#include "fpack_file.h"
+
+
+// A catalog records what is in every package in a directory (POSIX): the
+// header, metadata, where each image lies and whether the package
+// verified. It is a single file, laid out so that it can be mapped and
+// searched in place:
+//
+//     fpk_catalog_header_t
+//     fpk_catalog_package_t[n_packages], sorted by file name
+//     fpk_catalog_image_t[n_images]
+//     fpk_catalog_metadata_t[n_metadata]
+//     strings_size bytes of NUL-terminated strings
+//
+// Strings are referred to by their offset into the strings. Everything is
+// in the byte order of the machine that wrote the catalog; a catalog from
+// a machine of the other byte order fails to open.
+
+#define FPK_CATALOG_MAGIC           0x434B5046UL
+#define FPK_CATALOG_VERSION         1
+
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_packages;
+    uint32_t n_images;
+    uint32_t n_metadata;
+    uint32_t strings_size;
+
+} fpk_catalog_header_t;
+
+
+// device, inode, size and mtime are of the package file when it was
+// cataloged, and are what fpk_catalog_update checks (along with the
+// header timestamp) to tell whether it needs looking at again. status is
+// the result of verifying the package; if that failed, the package has
+// no images or metadata listed, and the header fields are only as good as
+// fpk_probe could manage.
+
+typedef struct
+{
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t name;
+    uint32_t timestamp;
+    uint32_t n_blocks;
+    uint32_t status;
+    uint8_t auth_type;
+    uint8_t cipher_type;
+    uint16_t n_images;
+    uint32_t first_image;
+    uint32_t first_metadata;
+    uint32_t n_metadata;
+
+} fpk_catalog_package_t;
+
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t offset;
+    uint32_t length;
+
+} fpk_catalog_image_t;
+
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t value;
+
+} fpk_catalog_metadata_t;
+
+
+typedef struct
+{
+    fpk_file_t file;
+    const fpk_catalog_header_t* header;
+    const fpk_catalog_package_t* packages;
+    const fpk_catalog_image_t* images;
+    const fpk_catalog_metadata_t* metadata;
+    const char* strings;
+
+} fpk_catalog_t;
+
+
+// Maps the catalog at path. Fails with FPK_RESULT_INVALID_FPK_FILE if it
+// isn't a catalog this version can read.
+
+fpk_result_t fpk_catalog_open(fpk_catalog_t* catalog, const char* path);
+
+void fpk_catalog_close(fpk_catalog_t* catalog);
+
+
+// Brings the catalog at path up to date with the *.fpk files in
+// directory, creating it if need be. Packages whose file and header
+// timestamp are unchanged are carried over from the existing catalog;
+// the rest are verified and indexed with fpk_index, using the key hooks
+// (authentication_key, cipher_key and their prepared_ forms) from hooks,
+// which are passed user_data. The new catalog is written alongside and
+// renamed into place, so a catalog that is open stays valid (and
+// unchanged) until it is closed.
+
+fpk_result_t fpk_catalog_update(const char* path, const char* directory,
+        const fpk_hooks_t* hooks, void* user_data);
+
+
+// Looks up a package by file name with a binary search, returning NULL if
+// it isn't in the catalog.
+
+const fpk_catalog_package_t* fpk_catalog_find(const fpk_catalog_t* catalog,
+        const char* name);
+
+
+// Return a package's images and metadata (n_images and n_metadata of
+// them), or NULL if the catalog doesn't hold them all.
+
+const fpk_catalog_image_t* fpk_catalog_images(const fpk_catalog_t* catalog,
+        const fpk_catalog_package_t* package);
+
+const fpk_catalog_metadata_t* fpk_catalog_metadata(
+        const fpk_catalog_t* catalog, const fpk_catalog_package_t* package);
+
+
+// Returns the string at offset, or "" if offset is out of range.
+
+const char* fpk_catalog_string(const fpk_catalog_t* catalog,
+        uint32_t offset);
+
+#endif /* _FPACK_CATALOG_H_ */
@@ -0,0 +1,103 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fpack_file.h"
+
+
+fpk_result_t fpk_file_map(fpk_file_t* file, const char* path)
+{
+    struct stat st;
+    void* data;
+    int fd;
+
+    file->data = NULL;
+    file->length = 0;
+
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 ) return FPK_RESULT_READ_ERROR;
+
+    if ( fstat(fd, &st) != 0 )
+    {
+        close(fd);
+        return FPK_RESULT_READ_ERROR;
+    }
+
+    // an empty file can't be mapped, but then there is nothing to read
+    // anyway
+
+    if ( st.st_size == 0 )
+    {
+        close(fd);
+        return FPK_RESULT_OK;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if ( data == MAP_FAILED ) return FPK_RESULT_READ_ERROR;
+
+    // packages are read front to back (twice, unless single pass), so let
+    // the kernel read ahead aggressively
+
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    file->data = data;
+    file->length = st.st_size;
+
+    return FPK_RESULT_OK;
+}
+
+
+void fpk_file_unmap(fpk_file_t* file)
+{
+    if ( file->data ) munmap((void*) file->data, file->length);
+
+    file->data = NULL;
+    file->length = 0;
+}
+
+
+fpk_result_t fpk_unpack_file(fpk_context_t* ctx, const char* path,
+        uint32_t options, const fpk_hooks_t* hooks, void* user_data)
+{
+    fpk_file_t file;
+    fpk_result_t result;
+
+    result = fpk_file_map(&file, path);
+    if ( result != FPK_RESULT_OK ) return result;
+
+    result = fpk_unpack_buffer(ctx, file.data, file.length, options, hooks,
+            user_data);
+
+    fpk_file_unmap(&file);
+
+    return result;
+}
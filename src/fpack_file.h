@@ -0,0 +1,51 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _FPACK_FILE_H_
+#define _FPACK_FILE_H_
+
+#include "fpack.h"
+
+
+// A read-only memory mapping of a package file (POSIX).
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t length;
+
+} fpk_file_t;
+
+
+fpk_result_t fpk_file_map(fpk_file_t* file, const char* path);
+
+void fpk_file_unmap(fpk_file_t* file);
+
+
+// Maps the file at path and unpacks it with fpk_unpack_buffer().
+
+fpk_result_t fpk_unpack_file(fpk_context_t* ctx, const char* path,
+        uint32_t options, const fpk_hooks_t* hooks, void* user_data);
+
+#endif /* _FPACK_FILE_H_ */
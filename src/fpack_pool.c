@@ -0,0 +1,116 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "fpack_pool.h"
+
+
+// The free contexts form a stack linked through pool->next. Each change to
+// the head also bumps the count kept with it, so a pop that read a head
+// which has since been popped and pushed back again fails its compare and
+// exchange rather than installing a stale next.
+
+static uint64_t new_head(uint64_t head, uint32_t top)
+{
+    return (((head >> 32) + 1) << 32) | top;
+}
+
+
+fpk_result_t fpk_context_pool_init(fpk_context_pool_t* pool,
+        uint32_t n_contexts)
+{
+    size_t stride = (sizeof(fpk_context_t) + FPK_POOL_ALIGNMENT - 1) &
+            ~(size_t) (FPK_POOL_ALIGNMENT - 1);
+
+    pool->head = 0;
+    pool->stride = stride;
+    pool->n_contexts = n_contexts;
+    pool->next = malloc((n_contexts + 1) * sizeof(uint32_t));
+    pool->memory = malloc(n_contexts * stride + FPK_POOL_ALIGNMENT);
+
+    if ( !pool->next || !pool->memory )
+    {
+        free(pool->next);
+        free(pool->memory);
+        return FPK_RESULT_OUT_OF_MEMORY;
+    }
+
+    pool->contexts = pool->memory + (-(uintptr_t) pool->memory &
+            (FPK_POOL_ALIGNMENT - 1));
+
+    // stacked so that the first context is taken first
+    for (uint32_t i = 0; i < n_contexts; i++)
+        pool->next[i] = i + 2 <= n_contexts ? i + 2 : 0;
+
+    if ( n_contexts > 0 ) pool->head = 1;
+
+    return FPK_RESULT_OK;
+}
+
+
+void fpk_context_pool_destroy(fpk_context_pool_t* pool)
+{
+    free(pool->next);
+    free(pool->memory);
+}
+
+
+fpk_context_t* fpk_context_pool_acquire(fpk_context_pool_t* pool)
+{
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint32_t top;
+    uint32_t next;
+
+    do
+    {
+        top = (uint32_t) head;
+        if ( top == 0 ) return NULL;
+
+        // may be rewritten meanwhile, but then the exchange fails
+        next = __atomic_load_n(&pool->next[top - 1], __ATOMIC_RELAXED);
+
+    } while (!__atomic_compare_exchange_n(&pool->head, &head,
+        new_head(head, next), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return (fpk_context_t*) (pool->contexts + (top - 1) * pool->stride);
+}
+
+
+void fpk_context_pool_release(fpk_context_pool_t* pool, fpk_context_t* ctx)
+{
+    uint32_t top = (uint32_t) (((uint8_t*) ctx - pool->contexts) /
+            pool->stride) + 1;
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+
+    do
+    {
+        __atomic_store_n(&pool->next[top - 1], (uint32_t) head,
+                __ATOMIC_RELAXED);
+
+    } while (!__atomic_compare_exchange_n(&pool->head, &head,
+        new_head(head, top), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
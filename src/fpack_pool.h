@@ -0,0 +1,70 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2017 Matthew T. Bucknall
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FPACK_POOL_H_
+#define _FPACK_POOL_H_
+
+#include "fpack.h"
+
+
+// A fixed number of contexts that any number of threads can take and give
+// back without locking, for a server holding thousands of sessions at
+// once. The contexts are allocated together up front, each starting on its
+// own cache line, and are not cleared between uses: every unpack sets up
+// what it needs itself. With no read_buffer hook a context needs nothing
+// else outside the stack, so stride is the whole per-session footprint.
+
+#define FPK_POOL_ALIGNMENT          64
+
+
+typedef struct
+{
+    // the index (plus one, or zero if none) of the first free context in
+    // the low half, and a count of the changes to it in the high half
+    uint64_t head;
+    uint32_t* next;
+    uint8_t* memory;
+    uint8_t* contexts;
+    size_t stride;
+    uint32_t n_contexts;
+
+} fpk_context_pool_t;
+
+
+// Fails with FPK_RESULT_OUT_OF_MEMORY if the contexts can't be allocated.
+
+fpk_result_t fpk_context_pool_init(fpk_context_pool_t* pool,
+        uint32_t n_contexts);
+
+// Frees the contexts, none of which may still be in use.
+
+void fpk_context_pool_destroy(fpk_context_pool_t* pool);
+
+
+// Returns a free context, or NULL if every one is in use.
+
+fpk_context_t* fpk_context_pool_acquire(fpk_context_pool_t* pool);
+
+void fpk_context_pool_release(fpk_context_pool_t* pool, fpk_context_t* ctx);
+
+#endif /* _FPACK_POOL_H_ */